@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <string.h>     // memcpy, strdup
+
+#include <fcntl.h>      // open, openat
+#include <unistd.h>     // close
+#include <sys/stat.h>   // mkdirat
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Line attribution
+ *
+ * Alongside replay, each document is tracked as a run-length list of spans,
+ * each tagged with the revNum that inserted it. Spans are split by retains
+ * and deletes, and neighbours from the same revision merged. A delete also
+ * leaves an empty span behind, so the line it changed is still credited to
+ * it - unless it took out whole lines, which leaves nothing to credit.
+ *
+ * Once a document is replayed, every line is credited to the latest
+ * revision that touched it, and the result kept in 'ctx->attrib' until
+ * `attrib_write()` writes an index per document under ATTRIB_DIR, in the
+ * git directory:
+ *
+ *   <first line> <line count> <revNum> <author>
+ *
+ * one row per run of consecutive lines from the same revision. Text older
+ * than the replayed history is credited to revNum 0.
+ */
+
+static int push_run(attrib_t *a, int len, int rev)
+{
+    if (a->next_cnt && a->next[a->next_cnt - 1].rev == rev)
+    {
+        a->next[a->next_cnt - 1].len += len;
+        return 0;
+    }
+
+    if (a->next_cnt == a->next_cap)
+    {
+        int cap = a->next_cap ? a->next_cap * 2 : 256;
+        attrib_run_t *runs = realloc(a->next, cap * sizeof(attrib_run_t));
+
+        if (!runs)
+        {
+            return -1;
+        }
+
+        a->next = runs;
+        a->next_cap = cap;
+    }
+
+    a->next[a->next_cnt].len = len;
+    a->next[a->next_cnt].rev = rev;
+    a->next_cnt++;
+
+    return 0;
+}
+
+void attrib_free(attrib_t *a)
+{
+    free(a->runs);
+    free(a->next);
+    memset(a, 0, sizeof(attrib_t));
+}
+
+// The runs just built become the current ones
+static void swap_runs(attrib_t *a)
+{
+    attrib_run_t *runs = a->runs;
+    int cap = a->cap;
+
+    a->runs = a->next;
+    a->cap = a->next_cap;
+    a->cnt = a->next_cnt;
+
+    a->next = runs;
+    a->next_cap = cap;
+    a->next_cnt = 0;
+}
+
+/*
+ * Start a document 'len' bytes long, all credited to 'rev'
+ */
+int attrib_begin(attrib_t *a, long len, int rev)
+{
+    a->next_cnt = 0;
+
+    if (push_run(a, len, rev) < 0)
+    {
+        return -1;
+    }
+
+    swap_runs(a);
+
+    return 0;
+}
+
+/*
+ * Follow `apply_rev()` through 'rev', which turned 'prev' into the next state
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int attrib_apply(c9_ctx_t *ctx, rev_cache_t *cache, attrib_t *a, rev_t *rev, const c9_buf_t *prev)
+{
+    char *cur = rev_op(ctx, cache, rev);
+    if (!cur)
+    {
+        return -1;
+    }
+
+    int ri = 0;         // Run being read from
+    int ro = 0;         // Offset into it
+    long pos = 0;       // Offset into 'prev'
+
+    a->next_cnt = 0;
+
+    while (next_op_code(&cur))
+    {
+        char code = *cur;
+        int len, n;
+
+        switch (code)
+        {
+            case 'i':
+                len = get_instruction_len(++cur);
+
+                if (push_run(a, len, rev->num) < 0)
+                {
+                    return -1;
+                }
+                break;
+            case 'd':
+            case 'r':
+                len = (code == 'r') ? get_retain_val(++cur) : get_instruction_len(++cur);
+
+                // Deletes that take whole lines leave no line to credit
+                int whole_lines = code == 'd' && len && cur[len - 1] == '\n'
+                                  && (pos == 0 || prev->data[pos - 1] == '\n');
+
+                // Empty spans at the cursor go with whatever follows them
+                for (n = len; ri < a->cnt && (n > 0 || a->runs[ri].len == ro); )
+                {
+                    int take = a->runs[ri].len - ro < n ? a->runs[ri].len - ro : n;
+
+                    if (code == 'r' && push_run(a, take, a->runs[ri].rev) < 0)
+                    {
+                        return -1;
+                    }
+
+                    ro += take;
+                    n -= take;
+
+                    if (ro == a->runs[ri].len)
+                    {
+                        ri++;
+                        ro = 0;
+                    }
+                }
+
+                if (n > 0)
+                {
+                    fprintf(stderr, "[ERROR] Revision %d runs past the end of the document\n", rev->num);
+                    return -2;
+                }
+
+                pos += len;
+
+                if (code == 'd' && !whole_lines && push_run(a, 0, rev->num) < 0)
+                {
+                    return -1;
+                }
+                break;
+        }
+    }
+
+    swap_runs(a);
+
+    return 0;
+}
+
+/*
+ * Credit each line of 'state' (document 'idx' of 'doc_list', as replayed)
+ * to a revision, and keep the result for `attrib_write()`
+ * Safe to call from several threads at once, for different documents.
+ */
+int attrib_finish(c9_ctx_t *ctx, attrib_t *a, unsigned int idx, const c9_buf_t *state)
+{
+    attrib_doc_t *out = ctx->attrib + idx;
+
+    int line_cnt = 0;
+
+    for (long i = 0; i < state->len; i++)
+    {
+        line_cnt += state->data[i] == '\n';
+    }
+
+    if (state->len && state->data[state->len - 1] != '\n')
+    {
+        line_cnt++;
+    }
+
+    free(out->line_revs);
+    out->line_revs = calloc(line_cnt + 1, sizeof(int));
+    out->line_cnt = line_cnt;
+
+    if (!out->line_revs)
+    {
+        out->line_cnt = 0;
+        return -1;
+    }
+
+    long pos = 0;
+    int line = 0;       // Line of the byte at 'pos'
+
+    for (int i = 0; i < a->cnt && line_cnt; i++)
+    {
+        long end = pos + a->runs[i].len;
+        int rev = a->runs[i].rev;
+
+        // An empty span credits the line it sits on
+        if (pos == end)
+        {
+            int at = line < line_cnt ? line : line_cnt - 1;
+
+            if (out->line_revs[at] < rev)
+            {
+                out->line_revs[at] = rev;
+            }
+        }
+
+        for (; pos < end && pos < state->len; pos++)
+        {
+            // A line break only counts for an otherwise empty line - whoever
+            // split a line shouldn't take credit for the first half
+            if ((state->data[pos] != '\n' || pos == 0 || state->data[pos - 1] == '\n')
+                && out->line_revs[line] < rev)
+            {
+                out->line_revs[line] = rev;
+            }
+
+            line += state->data[pos] == '\n';
+        }
+    }
+
+    return 0;
+}
+
+void attrib_close(c9_ctx_t *ctx)
+{
+    for (unsigned int i = 0; ctx->attrib && i < ctx->doc_cnt; i++)
+    {
+        free(ctx->attrib[i].line_revs);
+    }
+
+    free(ctx->attrib);
+    ctx->attrib = NULL;
+}
+
+/* ========================================================================== */
+
+typedef struct authors {
+    int *revs;          // Distinct revNums credited in the document, ascending
+    char **names;
+    int cnt;
+} authors_t;
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * sqlite3_exec callback
+ * Expects:
+ *   col_data[0] to be 'revNum'
+ *   col_data[1] to be 'author'
+ */
+static int author_cb(void *data, int col_cnt, char **col_data, char **col_name)
+{
+    authors_t *authors = (authors_t *)data;
+    int rev_num = atoi(col_data[0]);
+
+    int *found = bsearch(&rev_num, authors->revs, authors->cnt, sizeof(int), cmp_int);
+
+    if (found && col_data[1] && !authors->names[found - authors->revs])
+    {
+        authors->names[found - authors->revs] = strdup(col_data[1]);
+    }
+
+    return 0;
+}
+
+static int write_doc_index(c9_ctx_t *ctx, int dir_fd, doc_t *doc, attrib_doc_t *lines)
+{
+    authors_t authors = {0};
+    int ret = 0;
+
+    authors.revs = malloc((lines->line_cnt + 1) * sizeof(int));
+    authors.names = calloc(lines->line_cnt + 1, sizeof(char *));
+
+    if (!authors.revs || !authors.names)
+    {
+        free(authors.revs);
+        free(authors.names);
+        return -1;
+    }
+
+    memcpy(authors.revs, lines->line_revs, lines->line_cnt * sizeof(int));
+    qsort(authors.revs, lines->line_cnt, sizeof(int), cmp_int);
+
+    for (int i = 0; i < lines->line_cnt; i++)
+    {
+        if (authors.cnt == 0 || authors.revs[authors.cnt - 1] != authors.revs[i])
+        {
+            authors.revs[authors.cnt++] = authors.revs[i];
+        }
+    }
+
+    char *query = sqlite3_mprintf("SELECT revNum, author FROM Revisions WHERE document_id = %d", doc->id);
+
+    if (authors.cnt && sqlite3_exec(ctx->db, query, author_cb, &authors, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "[WARNING] Could not read authors for '%s'\n", doc->save_path);
+    }
+
+    sqlite3_free(query);
+
+    FILE *fp = NULL;
+    int fd = -1;
+
+    if (mkdir_parents(ctx, dir_fd, doc->save_path) < 0
+        || (fd = openat(dir_fd, doc->save_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1
+        || (fp = fdopen(fd, "w")) == NULL)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to write attribution for '%s'\n", errno, doc->save_path);
+        ret = -1;
+        goto DONE;
+    }
+
+    for (int i = 0; i < lines->line_cnt; )
+    {
+        int rev = lines->line_revs[i];
+        int n = 1;
+
+        while (i + n < lines->line_cnt && lines->line_revs[i + n] == rev)
+        {
+            n++;
+        }
+
+        int *found = bsearch(&rev, authors.revs, authors.cnt, sizeof(int), cmp_int);
+        char *author = found ? authors.names[found - authors.revs] : NULL;
+
+        fprintf(fp, "%d %d %d %s\n", i + 1, n, rev, author ? author : "-");
+
+        i += n;
+    }
+
+    if (fclose(fp) != 0)
+    {
+        ret = -1;
+    }
+
+    fd = -1;
+
+DONE:
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    for (int i = 0; i < authors.cnt; i++)
+    {
+        free(authors.names[i]);
+    }
+
+    free(authors.revs);
+    free(authors.names);
+
+    return ret;
+}
+
+/*
+ * Write the attribution index of every document replayed
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int attrib_write(c9_ctx_t *ctx, git_repository *repo)
+{
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Write line attribution...\n");
+    }
+
+    int git_fd = open(git_repository_path(repo), O_DIRECTORY | O_RDONLY);
+
+    if (git_fd == -1
+        || (mkdirat(git_fd, ATTRIB_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST))
+    {
+        fprintf(stderr, "[ERROR %d] Failed to create '%s'\n", errno, ATTRIB_DIR);
+
+        if (git_fd != -1)
+        {
+            close(git_fd);
+        }
+        return -1;
+    }
+
+    int dir_fd = openat(git_fd, ATTRIB_DIR, O_DIRECTORY | O_RDONLY);
+    close(git_fd);
+
+    if (dir_fd == -1)
+    {
+        return -1;
+    }
+
+    int ret = 0;
+
+    for (unsigned int i = 0; i < ctx->doc_cnt && ret == 0; i++)
+    {
+        ret = write_doc_index(ctx, dir_fd, ctx->doc_list + i, ctx->attrib + i);
+    }
+
+    close(dir_fd);
+
+    return ret;
+}
@@ -0,0 +1,810 @@
+#include <errno.h>
+#include <getopt.h>     // getopt
+#include <string.h>     // memcmp, memcpy, strlen
+#include <time.h>       // clock_gettime
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Kernel benchmark
+ *
+ * Times the op kernels on their own - `parse_op()`, the instruction walk
+ * (`next_op_code()`, `get_instruction_len()`, `get_retain_val()`) and
+ * `apply_rev()` both ways - so a change to one can be measured without
+ * running a whole conversion.
+ *
+ * The built in corpus covers escapes, large inserts, long retains and
+ * non-ASCII text, each with its expected parse and result. A database adds
+ * every one of its revisions, replayed forward then inverted back, with
+ * each state checked on the way. Its results can also be kept in a golden
+ * file, written when missing and compared against otherwise.
+ *
+ * Nothing is timed until every check has passed.
+ */
+
+#define BENCH_MIN_MS 200        // Default minimum time per kernel
+
+typedef struct bench_case {
+    const char *name;
+    char *src;                  // Document before the op
+    char *raw;                  // Op, as stored in the database
+    char *parsed;               // Expected `parse_op()` output
+    char *out;                  // Expected document after the op
+} bench_case_t;
+
+// A document, and the revisions replayed on it
+typedef struct chain {
+    int doc_id;                 // 0 for the built in corpus
+    const char *name;
+    rev_t *revisions;
+    int rev_cnt;
+    c9_buf_t initial;
+    c9_buf_t final;
+    uint64_t *hashes;           // State after each revision
+} chain_t;
+
+typedef struct corpus {
+    char **raw;                 // Every op, as stored
+    long raw_cnt;
+    long raw_cap;
+    long raw_bytes;
+
+    chain_t *chains;
+    int chain_cnt;
+    int chain_cap;
+    long op_bytes;              // Parsed length of every op
+    long apply_bytes;           // Length of every state replayed forward
+    long invert_bytes;          // ... and back
+} corpus_t;
+
+typedef struct bench {
+    c9_ctx_t *ctx;
+    c9_buf_t state;
+    c9_buf_t spare;
+    char *scratch;              // `parse_op()` output
+    long sink;                  // Keeps the instruction walk from being optimised out
+} bench_t;
+
+/* ========================================================================== */
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 'unit' repeated 'cnt' times, after 'prefix' and before 'suffix'
+static char *repeat(const char *prefix, const char *unit, long cnt, const char *suffix)
+{
+    long pre_len = strlen(prefix);
+    long unit_len = strlen(unit);
+    char *text = malloc(pre_len + unit_len * cnt + strlen(suffix) + 1);
+
+    if (!text)
+    {
+        return NULL;
+    }
+
+    char *out = text + pre_len;
+    memcpy(text, prefix, pre_len);
+
+    for (long i = 0; i < cnt; i++, out += unit_len)
+    {
+        memcpy(out, unit, unit_len);
+    }
+
+    strcpy(out, suffix);
+
+    return text;
+}
+
+/*
+ * Build the generated cases - too large to write out by hand
+ * Their expected results are put together directly, rather than with any
+ * of the kernels under test.
+ */
+static int generate_cases(bench_case_t *cases)
+{
+    // One large insert of multi-line text
+    long lines = 1 << 16;
+
+    cases[0].name = "large insert";
+    cases[0].src = strdup("");
+    cases[0].raw = repeat("[\"i", "static int x = 0;\\n", lines, "\"]");
+    cases[0].parsed = repeat("\x1fi", "static int x = 0;\n", lines, "");
+    cases[0].out = repeat("", "static int x = 0;\n", lines, "");
+
+    // Long retains either side of a small edit, in a large document
+    const char *unit = "The quick brown fox jumps over the lazy dog.\n";
+    long unit_len = strlen(unit);
+    long doc_len = unit_len << 16;
+    long half = doc_len / 2;
+
+    cases[1].name = "long retain";
+    cases[1].src = repeat("", unit, 1 << 16, "");
+    cases[1].raw = malloc(unit_len + 64);
+    cases[1].parsed = malloc(unit_len + 64);
+    cases[1].out = malloc(doc_len);
+
+    // Many small instructions, as typing produces
+    int edits = 4096;
+
+    cases[2].name = "many small";
+    cases[2].src = repeat("", "abcdefghij", edits, "");
+    cases[2].raw = repeat("[\"r10\",\"i-\"", ",\"r10\",\"i-\"", edits - 1, "]");
+    cases[2].parsed = repeat("", "\x1fr10\x1fi-", edits, "");
+    cases[2].out = repeat("", "abcdefghij-", edits, "");
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (!cases[i].src || !cases[i].raw || !cases[i].parsed || !cases[i].out)
+        {
+            return -1;
+        }
+    }
+
+    // Deletes carry the text they remove, so they can be inverted - here a
+    // whole line, its line break escaped in the stored op
+    long rest = doc_len - half - unit_len;
+
+    sprintf(cases[1].raw, "[\"r%ld\",\"iedited\",\"d%.*s\\n\",\"r%ld\"]", half, (int)unit_len - 1, unit, rest);
+    sprintf(cases[1].parsed, "\x1fr%ld\x1fiedited\x1f" "d%s\x1fr%ld", half, unit, rest);
+
+    memcpy(cases[1].out, cases[1].src, half);
+    memcpy(cases[1].out + half, "edited", 6);
+    memcpy(cases[1].out + half + 6, cases[1].src + half + unit_len, rest);
+    cases[1].out[half + 6 + rest] = '\0';
+
+    return 0;
+}
+
+/*
+ * Returns the number of cases, or -1 on failure
+ */
+static int load_cases(bench_case_t *cases)
+{
+    // Written out in full, so the expected results are plain to see
+    static const struct {
+        const char *name, *src, *raw, *parsed, *out;
+    } fixed[] = {
+        {"insert", "", "[\"ihello world\"]", "\x1fihello world", "hello world"},
+        {"delete", "hello cruel world", "[\"r6\",\"dcruel \",\"r5\"]", "\x1fr6\x1f" "dcruel \x1fr5", "hello world"},
+        {"escapes", "ab", "[\"r1\",\"i\\n\\t\\\"x\",\"r1\"]", "\x1fr1\x1fi\n\t\"x\x1fr1", "a\n\t\"xb"},
+        // An escaped backslash does not start an escape of its own
+        {"backslash", "", "[\"ia\\\\nb\"]", "\x1fia\\nb", "a\\nb"},
+        // Counts are in bytes
+        {"non-ascii", "na\xc3\xafve", "[\"r6\",\"i caf\xc3\xa9 \xe2\x98\x95\"]",
+         "\x1fr6\x1fi caf\xc3\xa9 \xe2\x98\x95", "na\xc3\xafve caf\xc3\xa9 \xe2\x98\x95"},
+    };
+
+    int cnt = sizeof(fixed) / sizeof(fixed[0]);
+
+    for (int i = 0; i < cnt; i++)
+    {
+        cases[i].name = fixed[i].name;
+        cases[i].src = strdup(fixed[i].src);
+        cases[i].raw = strdup(fixed[i].raw);
+        cases[i].parsed = strdup(fixed[i].parsed);
+        cases[i].out = strdup(fixed[i].out);
+
+        if (!cases[i].src || !cases[i].raw || !cases[i].parsed || !cases[i].out)
+        {
+            return -1;
+        }
+    }
+
+    if (generate_cases(cases + cnt) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to generate benchmark corpus\n");
+        return -1;
+    }
+
+    return cnt + 3;
+}
+
+static void free_cases(bench_case_t *cases, int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+    {
+        free(cases[i].src);
+        free(cases[i].parsed);
+        free(cases[i].out);
+        // 'raw' is owned by the corpus
+    }
+}
+
+/* ========================================================================== */
+
+static int corpus_add_raw(corpus_t *c, char *raw)
+{
+    if (c->raw_cnt == c->raw_cap)
+    {
+        long cap = c->raw_cap ? c->raw_cap * 2 : 1024;
+        char **list = realloc(c->raw, cap * sizeof(char *));
+
+        if (!list)
+        {
+            return -1;
+        }
+
+        c->raw = list;
+        c->raw_cap = cap;
+    }
+
+    c->raw[c->raw_cnt++] = raw;
+    c->raw_bytes += strlen(raw);
+
+    return 0;
+}
+
+static chain_t *corpus_add_chain(corpus_t *c)
+{
+    if (c->chain_cnt == c->chain_cap)
+    {
+        int cap = c->chain_cap ? c->chain_cap * 2 : 256;
+        chain_t *list = realloc(c->chains, cap * sizeof(chain_t));
+
+        if (!list)
+        {
+            return NULL;
+        }
+
+        c->chains = list;
+        c->chain_cap = cap;
+    }
+
+    chain_t *chain = c->chains + c->chain_cnt++;
+    memset(chain, 0, sizeof(chain_t));
+
+    return chain;
+}
+
+static int set_buf(c9_buf_t *buf, const char *data, long len)
+{
+    if (doc_buf_reserve(buf, len + 1) < 0)
+    {
+        return -1;
+    }
+
+    memcpy(buf->data, data, len);
+    buf->len = len;
+
+    return 0;
+}
+
+static int same(const c9_buf_t *buf, const char *data)
+{
+    long len = strlen(data);
+
+    return buf->len == len && memcmp(buf->data, data, len) == 0;
+}
+
+/*
+ * Parse and run each built in case once, checking every result
+ * Returns:
+ *  0 : Success
+ * <0 : A kernel gave the wrong result
+ */
+static int check_cases(bench_t *b, corpus_t *c, bench_case_t *cases, int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+    {
+        bench_case_t *tc = cases + i;
+        chain_t *chain = corpus_add_chain(c);
+        rev_t *rev = calloc(1, sizeof(rev_t));
+        char *parsed = malloc(strlen(tc->raw) + 1);
+
+        if (!chain || !rev || !parsed || corpus_add_raw(c, tc->raw) < 0)
+        {
+            free(rev);
+            free(parsed);
+            return -1;
+        }
+
+        rev->num = 1;
+        rev->block = -1;
+        rev->op = parsed;
+
+        chain->name = tc->name;
+        chain->revisions = rev;
+        chain->rev_cnt = 1;
+
+        int p_len = parse_op(tc->raw, parsed);
+        c->op_bytes += p_len - 1;
+
+        if (p_len != (int)strlen(tc->parsed) + 1 || strcmp(parsed, tc->parsed) != 0)
+        {
+            fprintf(stderr, "[ERROR] %s: parse_op() result differs\n", tc->name);
+            return -2;
+        }
+
+        if (set_buf(&chain->initial, tc->src, strlen(tc->src)) < 0
+            || apply_rev(b->ctx, &b->ctx->rev_cache, &chain->final, &chain->initial, rev, false) < 0)
+        {
+            return -1;
+        }
+
+        c->apply_bytes += chain->final.len;
+        c->invert_bytes += chain->initial.len;
+
+        if (!same(&chain->final, tc->out))
+        {
+            fprintf(stderr, "[ERROR] %s: apply_rev() result differs\n", tc->name);
+            return -2;
+        }
+
+        if (apply_rev(b->ctx, &b->ctx->rev_cache, &b->state, &chain->final, rev, true) < 0 || !same(&b->state, tc->src))
+        {
+            fprintf(stderr, "[ERROR] %s: inverted apply_rev() does not restore the document\n", tc->name);
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
+/* ========================================================================== */
+
+/*
+ * sqlite3_exec callback
+ * Expects:
+ *   data to be a corpus_t
+ *   col_data[0] to be 'op'
+ */
+static int raw_op_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    // Skipped by `load_revisions()` too
+    if (!col_data[0] || strcmp(col_data[0], "[]") == 0)
+    {
+        return 0;
+    }
+
+    char *raw = strdup(col_data[0]);
+
+    if (!raw || corpus_add_raw((corpus_t *)data, raw) < 0)
+    {
+        free(raw);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Replay every document of the database forward, noting each state, then
+ * invert back to the start, checking each state against its note
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+static int check_db(bench_t *b, corpus_t *c)
+{
+    c9_ctx_t *ctx = b->ctx;
+
+    if (load_revisions(ctx) != C9_OK)
+    {
+        return -1;
+    }
+
+    char *query = sqlite3_mprintf("SELECT operation FROM Revisions WHERE %s ORDER BY document_id ASC, revNum ASC", ctx->rev_where);
+    int res = sqlite3_exec(ctx->db, query, raw_op_cb, c, NULL);
+    sqlite3_free(query);
+
+    if (res != SQLITE_OK)
+    {
+        fprintf(stderr, "[ERROR] Failed to read operations : %s\n", sqlite3_errmsg(ctx->db));
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < ctx->doc_cnt; i++)
+    {
+        doc_t *doc = ctx->doc_list + i;
+
+        if (doc->rev_cnt == 0)
+        {
+            continue;
+        }
+
+        chain_t *chain = corpus_add_chain(c);
+        if (!chain)
+        {
+            return -1;
+        }
+
+        chain->doc_id = doc->id;
+        chain->name = doc->save_path;
+        chain->revisions = doc->revisions;
+        chain->rev_cnt = doc->rev_cnt;
+        chain->hashes = malloc(doc->rev_cnt * sizeof(uint64_t));
+
+        if (!chain->hashes
+            || (!history_resets(ctx, &ctx->rev_cache, doc) && load_contents(ctx, doc, &chain->initial) != C9_OK)
+            || initial_state(ctx, &ctx->rev_cache, doc, &chain->initial, &b->spare, &chain->initial) < 0
+            || set_buf(&b->state, chain->initial.data, chain->initial.len) < 0)
+        {
+            fprintf(stderr, "[ERROR] Could not rebuild the initial state of '%s'\n", doc->save_path);
+            return -1;
+        }
+
+        for (int r = 0; r < doc->rev_cnt; r++)
+        {
+            c->op_bytes += strlen(doc->revisions[r].op);
+
+            if (replay_doc(ctx, &ctx->rev_cache, doc, &b->state, &b->spare, r, r + 1) < 0)
+            {
+                return -1;
+            }
+
+            chain->hashes[r] = content_hash(b->state.data, b->state.len);
+            c->apply_bytes += b->state.len;
+        }
+
+        if (set_buf(&chain->final, b->state.data, b->state.len) < 0)
+        {
+            return -1;
+        }
+
+        for (int r = doc->rev_cnt - 1; r >= 0; r--)
+        {
+            uint64_t expect = r ? chain->hashes[r - 1] : content_hash(chain->initial.data, chain->initial.len);
+
+            if (apply_rev(ctx, &ctx->rev_cache, &b->spare, &b->state, doc->revisions + r, true) < 0
+                || content_hash(b->spare.data, b->spare.len) != expect)
+            {
+                fprintf(stderr, "[ERROR] '%s': inverting revision %d does not restore the document\n",
+                        doc->save_path, doc->revisions[r].num);
+                return -2;
+            }
+
+            c->invert_bytes += b->spare.len;
+
+            c9_buf_t tmp = b->state;
+            b->state = b->spare;
+            b->spare = tmp;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Compare the database corpus against 'path', or write it there when missing
+ * One line per document: '<doc_id> <rev count> <op hash> <final state hash>'
+ * Returns:
+ *  0 : Success
+ * <0 : Failure, or a difference
+ */
+static int check_golden(corpus_t *c, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    int write = fp == NULL;
+
+    if (write && (fp = fopen(path, "w")) == NULL)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to create golden file '%s'\n", errno, path);
+        return -1;
+    }
+
+    int diff = 0;
+
+    for (int i = 0; i < c->chain_cnt; i++)
+    {
+        chain_t *chain = c->chains + i;
+
+        if (chain->doc_id == 0)
+        {
+            continue;
+        }
+
+        uint64_t op_hash = 0;
+        for (int r = 0; r < chain->rev_cnt; r++)
+        {
+            char *op = chain->revisions[r].op;
+            op_hash = op_hash * 31 + content_hash((BYTE *)op, strlen(op));
+        }
+
+        uint64_t final_hash = content_hash(chain->final.data, chain->final.len);
+
+        if (write)
+        {
+            fprintf(fp, "%d %d %016llx %016llx\n", chain->doc_id, chain->rev_cnt,
+                    (unsigned long long)op_hash, (unsigned long long)final_hash);
+            continue;
+        }
+
+        int doc_id, rev_cnt;
+        unsigned long long want_op, want_final;
+
+        if (fscanf(fp, "%d %d %llx %llx", &doc_id, &rev_cnt, &want_op, &want_final) != 4
+            || doc_id != chain->doc_id || rev_cnt != chain->rev_cnt)
+        {
+            fprintf(stderr, "[ERROR] Golden file '%s' is for another database\n", path);
+            diff = 1;
+            break;
+        }
+
+        if (want_op != op_hash)
+        {
+            fprintf(stderr, "[ERROR] '%s': parsed ops differ from the golden file\n", chain->name);
+            diff = 1;
+        }
+
+        if (want_final != final_hash)
+        {
+            fprintf(stderr, "[ERROR] '%s': final state differs from the golden file\n", chain->name);
+            diff = 1;
+        }
+    }
+
+    if (fclose(fp) != 0 && write)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to write golden file '%s'\n", errno, path);
+        return -1;
+    }
+
+    if (write)
+    {
+        fprintf(stdout, "[INFO] Wrote golden file: %s\n", path);
+    }
+
+    return diff ? -2 : 0;
+}
+
+/* ========================================================================== */
+
+/*
+ * Kernels - each makes one pass over the whole corpus
+ * Returns the number of ops run
+ */
+
+static long run_parse(bench_t *b, corpus_t *c)
+{
+    for (long i = 0; i < c->raw_cnt; i++)
+    {
+        parse_op(c->raw[i], b->scratch);
+    }
+
+    return c->raw_cnt;
+}
+
+static long run_walk(bench_t *b, corpus_t *c)
+{
+    long ops = 0;
+
+    for (int i = 0; i < c->chain_cnt; i++)
+    {
+        for (int r = 0; r < c->chains[i].rev_cnt; r++, ops++)
+        {
+            // The same walk as `apply_rev()`
+            char *cur = c->chains[i].revisions[r].op;
+
+            while (next_op_code(&cur))
+            {
+                char code = *cur++;
+                b->sink += (code == 'r') ? get_retain_val(cur) : get_instruction_len(cur);
+            }
+        }
+    }
+
+    return ops;
+}
+
+static long run_apply(bench_t *b, corpus_t *c)
+{
+    long ops = 0;
+
+    for (int i = 0; i < c->chain_cnt; i++)
+    {
+        chain_t *chain = c->chains + i;
+        set_buf(&b->state, chain->initial.data, chain->initial.len);
+
+        for (int r = 0; r < chain->rev_cnt; r++, ops++)
+        {
+            apply_rev(b->ctx, &b->ctx->rev_cache, &b->spare, &b->state, chain->revisions + r, false);
+
+            c9_buf_t tmp = b->state;
+            b->state = b->spare;
+            b->spare = tmp;
+        }
+    }
+
+    return ops;
+}
+
+static long run_invert(bench_t *b, corpus_t *c)
+{
+    long ops = 0;
+
+    for (int i = 0; i < c->chain_cnt; i++)
+    {
+        chain_t *chain = c->chains + i;
+        set_buf(&b->state, chain->final.data, chain->final.len);
+
+        for (int r = chain->rev_cnt - 1; r >= 0; r--, ops++)
+        {
+            apply_rev(b->ctx, &b->ctx->rev_cache, &b->spare, &b->state, chain->revisions + r, true);
+
+            c9_buf_t tmp = b->state;
+            b->state = b->spare;
+            b->spare = tmp;
+        }
+    }
+
+    return ops;
+}
+
+/*
+ * Run 'kernel' over the corpus until at least 'min_ms' have passed
+ */
+static void time_kernel(bench_t *b, corpus_t *c, const char *name, long (*kernel)(bench_t *, corpus_t *),
+                        long bytes, int min_ms)
+{
+    long long start = now_ns();
+    long long elapsed;
+    long ops = 0;
+    long passes = 0;
+
+    do
+    {
+        ops += kernel(b, c);
+        passes++;
+        elapsed = now_ns() - start;
+    } while (elapsed < min_ms * 1000000LL);
+
+    fprintf(stdout, "%-8s %10ld ops %12.1f ns/op %10.1f MB/s\n", name, ops,
+            ops ? (double)elapsed / ops : 0.0,
+            (double)bytes * passes / (1 << 20) / (elapsed / 1e9));
+}
+
+/* ========================================================================== */
+
+void print_usage()
+{
+    fprintf(stderr, "Usage: ./c9bench [-t ms] [-g golden] [database.db]\n");
+}
+
+int main(int argc, char **argv)
+{
+    int min_ms = BENCH_MIN_MS;
+    const char *golden = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:g:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                // Minimum time per kernel
+                min_ms = atoi(optarg);
+                if (min_ms < 1)
+                {
+                    print_usage();
+                    return C9_EUSAGE;
+                }
+                break;
+            case 'g':
+                // Golden results for the database corpus
+                golden = optarg;
+                break;
+            default: /* '?' */
+                print_usage();
+                return C9_EUSAGE;
+        }
+    }
+
+    if (optind + 1 < argc || (golden && optind == argc))
+    {
+        print_usage();
+        return C9_EUSAGE;
+    }
+
+    bench_t b = {0};
+    corpus_t c = {0};
+    bench_case_t cases[16];
+    int ret = C9_OK;
+
+    if (optind < argc)
+    {
+        c9_options_t opts;
+        c9_options_init(&opts);
+        opts.quiet = 1;
+
+        if ((ret = c9_open(&b.ctx, argv[optind], &opts)) != C9_OK)
+        {
+            return ret;
+        }
+    }
+    else
+    {
+        // Ops are all held raw, so no context state is ever touched
+        b.ctx = calloc(1, sizeof(c9_ctx_t));
+    }
+
+    int case_cnt = load_cases(cases);
+
+    if (case_cnt < 0 || !b.ctx)
+    {
+        return C9_ENOMEM;
+    }
+
+    int res = check_cases(&b, &c, cases, case_cnt);
+
+    if (res == 0 && optind < argc)
+    {
+        res = check_db(&b, &c);
+    }
+
+    if (res == 0 && golden)
+    {
+        res = check_golden(&c, golden);
+    }
+
+    if (res == 0)
+    {
+        long longest = 0;
+        for (long i = 0; i < c.raw_cnt; i++)
+        {
+            long len = strlen(c.raw[i]);
+            longest = len > longest ? len : longest;
+        }
+
+        b.scratch = malloc(longest + 1);
+    }
+
+    if (res == 0 && b.scratch)
+    {
+        fprintf(stdout, "[INFO] Corpus: %ld ops, %d documents, %ld op bytes\n", c.raw_cnt, c.chain_cnt, c.raw_bytes);
+
+        // Parsing is measured on the stored op, the walk on the parsed op, and
+        // replay on the document written
+        time_kernel(&b, &c, "parse", run_parse, c.raw_bytes, min_ms);
+        time_kernel(&b, &c, "walk", run_walk, c.op_bytes, min_ms);
+        time_kernel(&b, &c, "apply", run_apply, c.apply_bytes, min_ms);
+        time_kernel(&b, &c, "invert", run_invert, c.invert_bytes, min_ms);
+    }
+    else
+    {
+        ret = (res == -2) ? C9_EREPLAY : C9_ENOMEM;
+    }
+
+    for (int i = 0; i < c.chain_cnt; i++)
+    {
+        c9_buf_free(&c.chains[i].initial);
+        c9_buf_free(&c.chains[i].final);
+        free(c.chains[i].hashes);
+
+        // Built in cases own their revision
+        if (c.chains[i].doc_id == 0 && c.chains[i].revisions)
+        {
+            free(c.chains[i].revisions->op);
+            free(c.chains[i].revisions);
+        }
+    }
+
+    for (long i = 0; i < c.raw_cnt; i++)
+    {
+        free(c.raw[i]);
+    }
+
+    free_cases(cases, case_cnt);
+    free(c.raw);
+    free(c.chains);
+    free(b.scratch);
+    c9_buf_free(&b.state);
+    c9_buf_free(&b.spare);
+
+    if (optind < argc)
+    {
+        c9_close(b.ctx);
+    }
+    else
+    {
+        free(b.ctx);
+    }
+
+    return ret;
+}
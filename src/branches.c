@@ -0,0 +1,447 @@
+#include <pthread.h>
+#include <string.h>     // memset
+
+#include <unistd.h>     // sysconf
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Branch per document
+ *
+ * Each document's history is committed on its own ref (BRANCH_REF_PREFIX
+ * followed by the document id), rooted at the initial commit. No chain
+ * depends on another, so documents are shared out to a pool of threads, each
+ * with its own repository handle and in-memory index. Once every chain is
+ * built, a single merge commit on HEAD joins them, with the union of the
+ * final trees. Its first parent is the initial commit HEAD still points to.
+ *
+ * Revision data is read-only during replay. Blocks of a compressed store are
+ * decoded into a cache of each thread's own, so only the database handle is
+ * shared, and used while holding 'lock'.
+ *
+ * Threads default to one per core, or 'encode_threads' when set.
+ */
+
+typedef struct branch_result {
+    git_oid head;           // Tip of the document's chain
+    git_oid blob;           // Final contents
+} branch_result_t;
+
+typedef struct branch_job {
+    c9_ctx_t *ctx;
+    const char *git_dir;
+    git_oid root;
+    branch_result_t *results;
+    int thread_cnt;
+    int next;               // Next unclaimed document, advanced atomically
+    int errors;
+    pthread_mutex_t lock;
+} branch_job_t;
+
+typedef struct branch_worker {
+    branch_job_t *job;
+    git_repository *repo;
+    git_index *idx;
+    git_signature *sig;
+    obj_cache_t cache;      // Per thread, each with its share of OBJ_CACHE_BYTES
+    rev_cache_t rev_cache;  // Blocks of a compressed store, decoded by this thread
+    c9_buf_t state;
+    c9_buf_t spare;
+    attrib_t attrib;
+} branch_worker_t;
+
+/*
+ * Commit 'state' as 'path' on top of 'parent', moving 'parent' to the new commit
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+static int commit_state(branch_worker_t *w, int doc_id, const char *path, int rev_num,
+                        git_commit **parent, git_oid *blob_id)
+{
+    git_oid tree_id, commit_id;
+    git_tree *tree;
+
+    uint64_t hash = content_hash(w->state.data, w->state.len);
+
+    if (!blob_cache_find(&w->cache, hash, w->state.data, w->state.len, blob_id))
+    {
+        if (git_blob_create_from_buffer(blob_id, w->repo, w->state.data, w->state.len) < 0)
+        {
+            fprintf(stderr, "[ERROR] Failed to write blob for '%s' [rev: %d]\n", path, rev_num);
+            return -1;
+        }
+
+        BYTE *copy = malloc(w->state.len + 1);
+        if (copy)
+        {
+            memcpy(copy, w->state.data, w->state.len);
+            blob_cache_add(&w->cache, hash, copy, w->state.len, blob_id);
+        }
+    }
+
+    // Chains only ever hold one file, so the tree depends on nothing else
+    git_oid empty = {{0}};
+
+    if (!tree_cache_find(&w->cache, &empty, path, blob_id, &tree_id))
+    {
+        git_index_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.mode = GIT_FILEMODE_BLOB;
+        entry.path = path;
+        git_oid_cpy(&entry.id, blob_id);
+
+        if (git_index_add(w->idx, &entry) < 0
+            || git_index_write_tree_to(&tree_id, w->idx, w->repo) < 0)
+        {
+            fprintf(stderr, "[ERROR] Unable to write tree for '%s' [rev: %d]\n", path, rev_num);
+            return -1;
+        }
+
+        tree_cache_add(&w->cache, &empty, path, blob_id, &tree_id);
+    }
+
+    if (git_tree_lookup(&tree, w->repo, &tree_id) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not look up tree for '%s' [rev: %d]\n", path, rev_num);
+        return -1;
+    }
+
+    char commit_msg[255] = {0};
+    snprintf(commit_msg, sizeof(commit_msg), "./%s [rev: %d]", path, rev_num);
+
+    int error = git_commit_create(&commit_id, w->repo, NULL, w->sig, w->sig,
+                                  NULL, commit_msg, tree, 1, (const git_commit **)parent);
+
+    git_tree_free(tree);
+
+    if (error < 0)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to create commit '%s'\n", error, commit_msg);
+        return -1;
+    }
+
+    git_commit_free(*parent);
+
+    if (git_commit_lookup(parent, w->repo, &commit_id) < 0)
+    {
+        *parent = NULL;
+        return -1;
+    }
+
+    return revmap_add(w->job->ctx, doc_id, rev_num, &commit_id);
+}
+
+/*
+ * Replay one document, committing each revision on its own chain
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+static int build_branch(branch_worker_t *w, doc_t *doc, branch_result_t *result)
+{
+    branch_job_t *job = w->job;
+    c9_ctx_t *ctx = job->ctx;
+    char *doc_path = doc->save_path;
+    int ret = 0;
+
+    git_commit *parent;
+
+    if (git_commit_lookup(&parent, w->repo, &job->root) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not look up initial commit\n");
+        return -1;
+    }
+
+    // Each chain only ever holds its own document
+    git_index_clear(w->idx);
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Process Revisions for '%s'...\n", doc_path);
+    }
+
+    // Read straight into the replay buffer, and only if replay needs it
+    if (!history_resets(ctx, &w->rev_cache, doc))
+    {
+        pthread_mutex_lock(&job->lock);
+        ret = load_contents(ctx, doc, &w->state) != C9_OK ? -1 : 0;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    if (ret == 0)
+    {
+        ret = initial_state(ctx, &w->rev_cache, doc, &w->state, &w->spare, &w->state);
+    }
+
+    if (ret < 0
+        || (ctx->attrib && (ret = attrib_begin(&w->attrib, w->state.len, doc->rev_cnt ? 0 : doc->rev_num)) < 0))
+    {
+        goto DONE;
+    }
+
+    // Revisionless docs get a single commit
+    if (doc->rev_num == 0)
+    {
+        ret = commit_state(w, doc->id, doc_path, 0, &parent, &result->blob);
+        goto DONE;
+    }
+
+    for (int i = 0; i < doc->rev_cnt; i++)
+    {
+        // 'spare' is left holding the state before the revision
+        if ((ret = replay_doc(ctx, &w->rev_cache, doc, &w->state, &w->spare, i, i + 1)) < 0
+            || (ctx->attrib && (ret = attrib_apply(ctx, &w->rev_cache, &w->attrib, doc->revisions + i, &w->spare)) < 0)
+            || (ret = commit_state(w, doc->id, doc_path, doc->revisions[i].num, &parent, &result->blob)) < 0)
+        {
+            goto DONE;
+        }
+    }
+
+    // Documents with no non-empty revisions still appear in the merge
+    if (doc->rev_cnt == 0)
+    {
+        ret = commit_state(w, doc->id, doc_path, doc->rev_num, &parent, &result->blob);
+    }
+
+DONE:
+    if (ret == 0 && ctx->attrib)
+    {
+        ret = attrib_finish(ctx, &w->attrib, doc - ctx->doc_list, &w->state);
+    }
+
+    if (ret == 0)
+    {
+        char ref_name[64];
+        snprintf(ref_name, sizeof(ref_name), BRANCH_REF_PREFIX "%d", doc->id);
+
+        git_reference *ref;
+        git_oid_cpy(&result->head, git_commit_id(parent));
+
+        if (git_reference_create(&ref, w->repo, ref_name, &result->head, 1, NULL) < 0)
+        {
+            fprintf(stderr, "[ERROR] Failed to create ref '%s'\n", ref_name);
+            ret = -1;
+        }
+        else
+        {
+            git_reference_free(ref);
+        }
+    }
+
+    git_commit_free(parent);
+
+    return ret;
+}
+
+static void * branch_worker(void *data)
+{
+    branch_worker_t w = {0};
+    w.job = (branch_job_t *)data;
+
+    branch_job_t *job = w.job;
+    c9_ctx_t *ctx = job->ctx;
+
+    if (git_repository_open(&w.repo, job->git_dir) < 0
+        || git_index_new(&w.idx) < 0
+        || get_signature(w.repo, &w.sig) < 0
+        || obj_cache_init(&w.cache, job->thread_cnt) < 0)
+    {
+        fprintf(stderr, "[ERROR] Branch worker could not open '%s'\n", job->git_dir);
+        __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+        goto DONE;
+    }
+
+    for (;;)
+    {
+        int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= (int)ctx->doc_cnt)
+        {
+            break;
+        }
+
+        if (build_branch(&w, ctx->doc_list + i, job->results + i) < 0)
+        {
+            __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+DONE:
+    obj_cache_free(&w.cache);
+    rev_cache_free(&w.rev_cache);
+    c9_buf_free(&w.state);
+    c9_buf_free(&w.spare);
+    attrib_free(&w.attrib);
+
+    git_signature_free(w.sig);
+    git_index_free(w.idx);
+    git_repository_free(w.repo);
+
+    return NULL;
+}
+
+/*
+ * Stage every document's final contents, and commit with every chain as a parent
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+static int merge_branches(c9_ctx_t *ctx, git_repository *repo, branch_result_t *results)
+{
+    git_index *idx;
+
+    if (git_repository_index(&idx, repo) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not open repository index. Exiting...\n");
+        return -1;
+    }
+
+    int ret = 0;
+    int parent_cnt = 0;
+    git_commit **parents = calloc(ctx->doc_cnt + 1, sizeof(git_commit *));
+
+    if (!parents)
+    {
+        git_index_free(idx);
+        return -1;
+    }
+
+    // As with `git merge --no-ff`, the current HEAD comes first
+    parents[parent_cnt++] = ctx->head;
+
+    for (unsigned int i = 0; i < ctx->doc_cnt; i++)
+    {
+        git_index_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.mode = GIT_FILEMODE_BLOB;
+        entry.path = ctx->doc_list[i].save_path;
+        git_oid_cpy(&entry.id, &results[i].blob);
+
+        if (git_index_add(idx, &entry) < 0
+            || git_commit_lookup(parents + parent_cnt, repo, &results[i].head) < 0)
+        {
+            fprintf(stderr, "[ERROR] Failed to merge '%s'\n", entry.path);
+            ret = -1;
+            goto DONE;
+        }
+
+        parent_cnt++;
+    }
+
+    char commit_msg[255] = {0};
+    snprintf(commit_msg, sizeof(commit_msg), "Merge %u document histories", ctx->doc_cnt);
+
+    ret = commit_index_onto(ctx, repo, idx, commit_msg, (const git_commit **)parents, parent_cnt, NULL);
+
+DONE:
+    // 'ctx->head' has been replaced by the merge itself
+    for (int i = 1; i < parent_cnt; i++)
+    {
+        git_commit_free(parents[i]);
+    }
+
+    free(parents);
+    git_index_free(idx);
+
+    return ret;
+}
+
+/*
+ * As `process_revisions_bare()`, but each document is committed on its own
+ * branch, in parallel, then merged into HEAD
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int process_revisions_branches(c9_ctx_t *ctx, git_repository *repo)
+{
+    if (ctx->doc_cnt == 0)
+    {
+        return 0;
+    }
+
+    branch_job_t job = {0};
+    job.ctx = ctx;
+    job.git_dir = git_repository_path(repo);
+    git_oid_cpy(&job.root, git_commit_id(ctx->head));
+    job.results = calloc(ctx->doc_cnt, sizeof(branch_result_t));
+
+    if (!job.results)
+    {
+        return -1;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    int thread_cnt = ctx->opts.encode_threads;
+
+    if (thread_cnt == 0)
+    {
+        thread_cnt = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (thread_cnt > BRANCH_MAX_THREADS)
+    {
+        thread_cnt = BRANCH_MAX_THREADS;
+    }
+    if (thread_cnt > (int)ctx->doc_cnt)
+    {
+        thread_cnt = ctx->doc_cnt;
+    }
+    if (thread_cnt < 1)
+    {
+        thread_cnt = 1;
+    }
+
+    job.thread_cnt = thread_cnt;
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Build %u document branches on %d threads...\n", ctx->doc_cnt, thread_cnt);
+    }
+
+    pthread_t threads[BRANCH_MAX_THREADS];
+    int started = 0;
+
+    for (; started < thread_cnt; started++)
+    {
+        if (pthread_create(threads + started, NULL, branch_worker, &job) != 0)
+        {
+            break;
+        }
+    }
+
+    // Fall back to this thread if none could be started
+    if (started == 0)
+    {
+        branch_worker(&job);
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    int ret = 0;
+
+    if (job.errors)
+    {
+        fprintf(stderr, "[ERROR] %d document branches failed\n", job.errors);
+        ret = -1;
+    }
+    else
+    {
+        if (ctx->opts.quiet == 0)
+        {
+            fprintf(stdout, "[INFO] Merge document branches...\n");
+        }
+
+        ret = merge_branches(ctx, repo, job.results);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(job.results);
+
+    return ret;
+}
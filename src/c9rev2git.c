@@ -1,912 +1,160 @@
-#include <unistd.h>     // getopt
+#include <signal.h>     // signal
+#include <unistd.h>     // getopt, write
+#include <getopt.h>     // getopt_long
 
-#include <errno.h>
 #include <stdio.h>      // printf, fprintf
-#include <string.h>     // strncpy
+#include <stdlib.h>     // strtol
 
-#include <sys/stat.h>   // open, mkdir
-#include <sys/types.h>  // open, mkdir
-#include <fcntl.h>      // open
-
-#include <git2.h>
-
-#include <sqlite3.h>
-
-/* ========================================================================== */
-
-/*
- * Reference:
- * - https://libgit2.org/docs/
- * - https://www.sqlite.org/docs.html
- * - https://www.tutorialspoint.com/sqlite/sqlite_c_cpp.htm
- */
-
-/* ========================================================================== */
-
-#define BYTE char
-
-#define KILOBYTE(v) ((v) * 1024LL)
-#define MEGABYTE(v) (KILOBYTE(v) * 1024L)
-
-#ifdef DEBUG
-    #define ASSERT(exp) \
-        if (!(exp)) \
-        { \
-            fprintf(stderr, "[ASSERT] %s:%d:%s\n", __FILE__, __LINE__, __func__); \
-            exit(2); \
-        }
-#else
-    #define ASSERT(exp)
-#endif
-
-#define false 0
-#define true 1
-
-/* ========================================================================== */
-
-typedef struct mem_pool
-{
-    BYTE *base;
-    BYTE *top;
-    BYTE *cur;
-} mem_pool_t;
-
-typedef struct rev {
-    int num;
-    char *op;
-} rev_t;
-
-typedef struct doc {
-    int id;
-    int rev_num;
-    int rev_cnt;
-    char *save_path;
-    rev_t *revisions;
-} doc_t;
-
-/* ========================================================================== */
-
-// Global memory for entire Process
-mem_pool_t MEM;
-mem_pool_t STRUCT_POOL;
-mem_pool_t STRING_POOL;
-mem_pool_t SCRATCH_POOL;
-
-git_commit **HEAD;
-
-doc_t *DOC_LIST;
-rev_t *REV_LIST;
-
-unsigned int DOC_CNT;
-unsigned int REV_CNT;
-
-// Boolean to limit prints to stdout
-int QUIET = 0;
-
-// Unit Separator
-char US = 31;
+#include "c9rev2git.h"
 
 /* ========================================================================== */
 
 void print_usage()
 {
     // TODO : Have `make` insert the binary name before compilation ?
-    fprintf(stderr, "Usage: ./c9rev2git [-q] [-o output-dir] database.db\n");
-}
-
-void git2_exit_with_error(int error)
-{
-    // ref: https://libgit2.org/docs/guides/101-samples/
-    const git_error *e = git_error_last();
-    fprintf(stderr, "[ERROR %d/%d] %s\n", error, e->klass, e->message);
-    exit(error);
+    fprintf(stderr, "Usage: ./c9rev2git [-q] [-z] [--bare | --checkout] [--branches] [--follow[=ms]] [--pipeline] [-j threads] [-l level] [-J journal] [-O] [-A] [-o output-dir]\n");
+    fprintf(stderr, "                   [--snapshot [--graft]] [--include glob]... [--exclude glob]... [--since-rev N] [--since-time T] database.db\n");
+    fprintf(stderr, "       ./c9rev2git [-z] [-k interval] [-J journal] --doc path --rev N[:M] database.db\n");
+    fprintf(stderr, "       ./c9rev2git [-o output-dir] --commit-of doc-id:N | --rev-of commit\n");
 }
 
 /* ========================================================================== */
 
-BYTE * mem_push(mem_pool_t *pool, unsigned int sz)
-{
-    // Used during DEBUG. Can be used to tune total required memory
-    ASSERT(pool->base + sz <= pool->top);
-
-    BYTE *ret = pool->cur;
-
-    pool->cur += sz;
-
-    return ret;
-}
-
-void mem_pop(BYTE **mem, mem_pool_t *pool, unsigned int sz)
-{
-    ASSERT(pool->cur - sz >= pool->base);
-
-    pool->cur -= sz;
-    *mem = NULL;
-}
-
-int mem_alloc(mem_pool_t *pool, unsigned long capacity)
-{
-    pool->base = malloc(capacity);
-    if (!pool->base)
-    {
-        return 1;
-    }
-
-    pool->top = pool->base + capacity;
-    pool->cur = pool->base;
-
-    return 0;
-}
+typedef struct query {
+    c9_ctx_t *ctx;
+    c9_doc_info_t doc;
+    int rev_from;
+    int rev_to;
+    c9_buf_t state;
+} query_t;
 
-int mem_sub_alloc(mem_pool_t *parent, mem_pool_t *child, unsigned long capacity)
+void write_state(query_t *q, int rev_num)
 {
-    ASSERT(parent->base);
-    ASSERT(parent->cur + capacity <= parent->top);
-
-    child->base = mem_push(parent, capacity);
-    child->top = child->base + capacity;
-    child->cur = child->base;
-
-    return 0;
-}
+    char header[600];
+    int header_len = snprintf(header, sizeof(header), "./%s [rev: %d] %ld\n", q->doc.path, rev_num, q->state.len);
 
-void mem_free(mem_pool_t *pool)
-{
-    free(pool->base);
+    write(STDOUT_FILENO, header, header_len);
+    write(STDOUT_FILENO, q->state.data, q->state.len);
+    write(STDOUT_FILENO, "\n", 1);
 }
 
-/* ========================================================================== */
-
 /*
- * Replace quotes around instructions with a single Unit Separator char
- * Replace escaped characters
- *   TODO : anything other than '\n' and '\t' ?
- * Return parsed op len, including null terminator
+ * Write each revision within the range, after the first
  */
-int parse_op(const char *op, char *parsed)
+static int query_rev_cb(const c9_rev_info_t *rev, void *data)
 {
-    int len = 0;
+    query_t *q = (query_t *)data;
 
-    // Can safely skip the first char - it is always '['
-    while (*++op)
-    {
-        if (*op == '"' && *(op - 1) != '\\')
-        {
-            if (*(op + 1) == ',' || *(op + 1) == ']')
-            {
-                op++;
-            }
-            else {
-                *parsed++ = US;
-                len++;
-            }
-        }
-        else if (*op == '\\')
-        {
-            switch (*(op + 1))
-            {
-                case '\\':
-                    // Preserve escaped escape sequences
-                    // TODO : Don't just allow for single-char escape sequences
-                    *parsed++ = *++op;
-                    *parsed++ = *++op;
-                    len += 2;
-                    break;
-                case 'n':
-                    *parsed++ = '\n';
-                    len++;
-                    op++;
-                    break;
-                case 't':
-                    *parsed++ = '\t';
-                    len++;
-                    op++;
-                    break;
-                case '"':
-                    *parsed++ = *++op;
-                    len++;
-                    break;
-            }
-        }
-        else
-        {
-            *parsed++ = *op;
-            len++;
-        }
-    }
-
-    // Nul terminate parsed op
-    *parsed = '\0';
-
-    return ++len;
-}
-
-/*
- * sqlite3 Callback Reference:
- *   data      : Data provided in the 4th argument of `sqlite3_exec()`
- *   col_cnt   : The number of columns in row
- *   col_data  : An array of strings representing fields in the row
- *   col_names : An array of strings representing column names
- */
-
-/*
- * Process each file revision
- *   - Store revision data in memory
- *
- * Expects:
- *   data to be null
- *   col_data[0] to be 'doc_id'
- *   col_data[1] to be 'rev_num'
- *   col_data[2] to be 'op'
- *   col_data[3] to be 'op_len'
- */
-static int process_rev_cb(void *unused, int col_cnt, char **col_data, char **col_names)
-{
-    // WARNING : `col_data` will contain NULL pointers where there is no value stored
-    int doc_id  = atoi(col_data[0]);
-    int rev_num = atoi(col_data[1]);
-    int op_len  = atoi(col_data[3]);
-    char *op    = col_data[2];
-
-    // Thanks to the SQL query, we can guarantee the revisions are in
-    // ascending document id order, and per doc in ascending revision number.
-    // Should give better memory access when working with a given document.
-
-    // Skip "empty" revisions - generally the first for each document
-    if (strcmp(op, "[]") == 0)
+    if (rev->num <= q->rev_from || rev->num > q->rev_to)
     {
         return 0;
     }
 
-    // Append rev directly to STRUCT_POOL
-    // They will be contiguous, and managed elsewhere
-    rev_t *rev = (rev_t *)mem_push(&STRUCT_POOL, sizeof(rev_t));
-
-    rev->num = rev_num;
-
-    // Get some temp mem for the parsing the op
-    char *parsed = mem_push(&SCRATCH_POOL, op_len);
-    int p_len = parse_op(op, parsed);
-
-    // Operation strings will also be contiguous in STRING_POOL
-    // Can therefore also be accessed directly
-    //   - whole operations are "null byte" separated
-    //   - operation instructions are "unit separator" separated
-    rev->op = mem_push(&STRING_POOL, p_len);
-    strncpy(rev->op, parsed, p_len);
-
-    // Remember to clean up temp mem usage
-    mem_pop(&parsed, &SCRATCH_POOL, op_len);
-
-    // Document id's are 1-indexed in the database
-    doc_t *doc = DOC_LIST + doc_id - 1;
-
-    // Point doc to the first revision
-    if (!doc->revisions)
-    {
-        doc->revisions = rev;
-    }
-    doc->rev_cnt++;
-
-    REV_CNT++;
-
-    return 0;
-}
-
-/*
- * Process each target file
- *   - Create any directory tree as required
- *   - Store some document data in memory
- *   - Save copy of original file to repo, for further processing
- *
- * Expects:
- *   data to be a file descriptor for the repository directory
- *   col_data[0] to be 'id'
- *   col_data[1] to be 'path'
- *   col_data[2] to be 'contents'
- *   col_data[3] to be 'content_len'
- *   col_data[4] to be 'rev_num'
-*/
-static int prepare_doc_cb(void *repo_fd, int col_cnt, char **col_data, char **col_names)
-{
-    // WARNING : `col_data` will contain NULL pointers where there is no value stored
-    char *doc_id    = col_data[0];
-    char *path      = col_data[1];
-    char *contents  = col_data[2];
-    int content_len = atoi(col_data[3]);
-    int rev_num     = atoi(col_data[4]);
-
-    // TODO : Test and/or get feedback on this assumption
-    // Assuming 512 is long enough to account for most reasonable directory tree depth
-    char dir_path[512];
-
-    int cnt = 0;
-    int dir_len = 0;
-    int filename_len = 0;
-
-    for (; path[cnt] != '\0'; cnt++)
-    {
-        // Create any necessary directories as we find them
-        if (!(path[cnt] == '/'))
-        {
-            continue;
-        }
-
-        strncpy(dir_path, path, cnt);
-
-        // Always remember the null terminator
-        dir_path[cnt] = '\0';
-
-        // Update total directory path length
-        dir_len = cnt;
-
-        if (mkdirat(*(int *)repo_fd, dir_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1)
-        {
-            if (errno == EEXIST)
-            {
-                // Don't worry if the directory already exists
-
-                if (QUIET == 0)
-                {
-                    fprintf(stdout, "[mkdir] Skipping '%s'. Already exists\n", dir_path);
-                }
-                continue;
-            }
-
-            // Trigger a sqlite abort
-            fprintf(stderr, "[ERROR] Failed to create directory '%s'. Aborting...\n", dir_path);
-
-            // TODO : Implement "clean up" on failure, in main(), and remove this
-            fprintf(stderr, "[WARNING] This may leave file and/or directory artefacts.\n");
-
-            return 1;
-        }
-        else if (QUIET == 0)
-        {
-            fprintf(stdout, "[mkdir] Creating '%s'\n", dir_path);
-        }
-
-    }
-
-    // Thanks to the SQL query, we can guarantee the file paths are in
-    // ascending document id order - which means they can be accessed
-    // directly by index later when using DOC_LIST
-
-    // Append doc directly to STRUCT_POOL
-    // They will be contiguous, and managed elsewhere
-    doc_t *doc = (doc_t *)mem_push(&STRUCT_POOL, sizeof(doc_t));
-    doc->id = atoi(doc_id);
-    doc->rev_num = rev_num;
-    doc->rev_cnt = 0;
-
-    // Save paths will also be contiguous in STRING_POOL
-    // (can therefore also be accessed directly - null pointer separated)
-    doc->save_path = mem_push(&STRING_POOL, cnt + 1);
-
-    // Revisions will get set later
-    doc->revisions = NULL;
-
-    // Store a copy of the relative save path
-    strncpy(doc->save_path, path, cnt + 1);
-
-    DOC_CNT++;
-
-    // Save out document in it's "final" state.
-    // Working later with revisions will initially process backwards
-    // from that state, or wipe the doc and start fresh.
-    int save_fd = openat(*(int *)repo_fd, path, O_WRONLY | O_CREAT,
-                                                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
-    if (write(save_fd, contents, content_len) == -1)
+    // Carries on from the previous revision in 'state'
+    int res = c9_materialize(q->ctx, q->doc.id, rev->num, &q->state);
+    if (res != C9_OK)
     {
-        fprintf(stderr, "[ERROR] Failed to write out %s\n", path);
-
-        close(save_fd);
-        return -1;
+        return res;
     }
 
-    close(save_fd);
+    write_state(q, rev->num);
 
     return 0;
 }
 
-/* ========================================================================== */
-
-// TODO : Find a way to clean up the overt repetition in `git_initial_commit()`
-//        and `add_and_commit()`
-
 /*
- * Returns:
- *  0 : Success
- * <0 : Failure
+ * Write 'path' as of each revision in [rev_from, rev_to] to stdout
+ * A single revision is written raw. A range writes each revision of the
+ * document within it, preceded by a "./path [rev: N] length" line.
  */
-int git_initial_commit(git_repository *repo)
+int query_doc(c9_ctx_t *ctx, const char *path, int rev_from, int rev_to)
 {
-    // Get latest repo index
-    git_index *idx;
+    query_t q = {0};
+    q.ctx = ctx;
+    q.rev_from = rev_from;
+    q.rev_to = rev_to;
 
-    if (git_repository_index(&idx, repo) < 0)
+    int res = c9_find_doc(ctx, path, &q.doc);
+    if (res != C9_OK)
     {
-        fprintf(stderr, "[ERROR] Could not open repository index. Exiting...\n");
+        return res;
     }
 
-    // Prepare commit
-    git_oid tree_id, commit_id;
-    git_tree *tree;
-
-    if (git_index_write_tree(&tree_id, idx) < 0)
+    if (rev_to > q.doc.rev_num)
     {
-        fprintf(stderr, "[ERROR] Unable to write initial tree from index\n");
-        return -2;
+        fprintf(stderr, "[ERROR] '%s' has no revision %d (latest is %d)\n", q.doc.path, rev_to, q.doc.rev_num);
+        return C9_EUSAGE;
     }
 
-    if (git_index_write(idx) < 0)
+    if ((res = c9_materialize(ctx, q.doc.id, rev_from, &q.state)) != C9_OK)
     {
-        fprintf(stderr, "[ERROR] Failed to write updated repo index\n");
-        return -3;
+        goto DONE;
     }
 
-    if (git_tree_lookup(&tree, repo, &tree_id) < 0)
+    if (rev_from == rev_to)
     {
-        fprintf(stderr, "[ERROR] Could not look up initial tree\n");
-        return -4;
+        write(STDOUT_FILENO, q.state.data, q.state.len);
+        goto DONE;
     }
 
-    // NOTE : Defaults to using global git config, but has a fallback
-    // TODO : Allow sig to be set from command line
-    git_signature *sig;
-    if (git_signature_default(&sig, repo) < 0)
-    {
-        fprintf(stdout, "[INFO] It appears 'user.name' and 'user.email' are not set. Using 'c9rev2git' and 'bot@localhost'\n");
+    write_state(&q, rev_from);
 
-        if (git_signature_now(&sig, "c9rev2git", "bot@localhost") < 0)
-        {
-            fprintf(stderr, "[ERROR] Failed to set 'user.name' and 'user.email'. Exiting...\n");
-            return -1;
-        }
-    }
+    res = c9_foreach_rev(ctx, q.doc.id, query_rev_cb, &q);
 
-    int error = git_commit_create(&commit_id, repo, "HEAD", sig, sig,
-                                  NULL, "Initial commit", tree, 0, NULL);
-    if (error < 0)
-    {
-        fprintf(stderr, "[ERROR] Failed to create initial commit\n");
-        return -4;
-    }
-
-    // Dereference HEAD to a commit
-    //git_commit_lookup(HEAD, repo, &commit_id);
-    git_object *head_commit;
-    error = git_revparse_single(&head_commit, repo, "HEAD^{commit}");
-    *HEAD = (git_commit*)head_commit;
+DONE:
+    c9_buf_free(&q.state);
 
-    // Cleanup
-    git_tree_free(tree);
-    git_signature_free(sig);
-    git_index_free(idx);
-
-    return 0;
+    return res;
 }
 
 /*
- * Returns:
- *  0 : Success
- * <0 : Failure
+ * Look a revision's commit up in the revision map of 'repo_dir', or a
+ * commit's revision, and write it to stdout
  */
-int add_and_commit(git_repository *repo, char *path, int rev_num)
+int query_revmap(const char *repo_dir, const char *commit_of, const char *rev_of)
 {
-    // Get latest repo index
-    git_index *idx;
+    int doc_id, rev_num;
+    char hex[41];
+    int res;
 
-    if (git_repository_index(&idx, repo) < 0)
+    if (commit_of)
     {
-        fprintf(stderr, "[ERROR] Could not open repository index. Exiting...\n");
-    }
-
-    // Stage file
-    if (git_index_add_bypath(idx, path) < 0)
-    {
-        fprintf(stderr, "[ERROR] Failed to add %s for new commit. Exiting...\n", path);
-        return -1;
-    }
-
-    // Prepare commit
-    git_oid tree_id, commit_id;
-    git_tree *tree;
-
-    if (git_index_write_tree(&tree_id, idx) < 0)
-    {
-        fprintf(stderr, "[ERROR] Unable to write initial tree from index\n");
-        return -2;
-    }
-
-    if (git_index_write(idx) < 0)
-    {
-        fprintf(stderr, "[ERROR] Failed to write updated repo index\n");
-        return -3;
-    }
+        char *end;
+        doc_id = strtol(commit_of, &end, 10);
+        rev_num = (*end == ':') ? strtol(end + 1, &end, 10) : -1;
 
-    if (git_tree_lookup(&tree, repo, &tree_id) < 0)
-    {
-        fprintf(stderr, "[ERROR] Could not look up initial tree\n");
-        return -4;
-    }
-
-    // TODO : Allow sig to be set from command line
-    // NOTE : Defaults to using global git config, but has a fallback
-    git_signature *sig;
-    if (git_signature_default(&sig, repo) < 0)
-    {
-        fprintf(stdout, "[INFO] It appears 'user.name' and 'user.email' are not set. Using 'c9rev2git' and 'bot@localhost'\n");
-
-        if (git_signature_now(&sig, "c9rev2git", "bot@localhost") < 0)
+        if (*end != '\0' || rev_num < 0)
         {
-            fprintf(stderr, "[ERROR] Failed to set 'user.name' and 'user.email'. Exiting...\n");
-            return -1;
+            print_usage();
+            return C9_EUSAGE;
         }
-    }
-
-    char commit_msg[255] = {0};
-    sprintf(commit_msg, "./%s [rev: %d]", path, rev_num);
-
-    int error = git_commit_create(&commit_id, repo, "HEAD", sig, sig,
-                                  NULL, commit_msg, tree, 1, (const git_commit **)HEAD);
-    if (error < 0)
-    {
-        fprintf(stderr, "[ERROR %d] Failed to create commit for %s\n", error, path);
-        return -4;
-    }
-
-    // Dereference HEAD to a commit
-    //git_commit_lookup(HEAD, repo, &commit_id);
-    git_object *head_commit;
-    error = git_revparse_single(&head_commit, repo, "HEAD^{commit}");
-    *HEAD = (git_commit*)head_commit;
-
-    // Cleanup
-    git_tree_free(tree);
-    git_signature_free(sig);
-    git_index_free(idx);
 
-    return 0;
-}
-
-/* ========================================================================== */
-
-/*
- * Modify 'op' pointer to point at the next instruction char.
- * Returns: 1 for success, 0 for failure
- */
-int next_op_code(char **op)
-{
-    while (**op)
-    {
-        if (**op == US)
+        if ((res = c9_revmap_commit(repo_dir, doc_id, rev_num, hex)) == C9_OK)
         {
-            // The next char is an instruction
-            (*op)++;
-
-            return 1;
+            printf("%s\n", hex);
         }
-        (*op)++;
     }
-
-    return 0;
-}
-
-/*
- * Returns retain value
- */
-int get_retain_val(const char *val)
-{
-    const char *cur = val;
-    int len = 0;
-
-    while (*cur)
+    else if ((res = c9_revmap_rev(repo_dir, rev_of, &doc_id, &rev_num)) == C9_OK)
     {
-        if (*cur == US)
-        {
-            break;
-        }
-        cur++;
-        len++;
+        printf("%d:%d\n", doc_id, rev_num);
     }
 
-    char val_dup[len + 1];
-    strncpy(val_dup, val, len);
-    val_dup[len] = '\0';
-
-    return atoi(val_dup);
-}
-
-/*
- * Returns character count for instruction
- */
-int get_instruction_len(const char *cur)
-{
-    int len = 0;
-
-    while (*cur)
+    if (res == C9_EUSAGE)
     {
-        if (*cur == US)
-        {
-            return len;
-        }
-        cur++;
-        len++;
+        fprintf(stderr, "[ERROR] No single commit for '%s'\n", commit_of ? commit_of : rev_of);
     }
 
-    return len;
+    return res;
 }
 
-int reset_check(char *op)
-{
-    // If instruction is an insertion ('i'), with no preceding or trailing retain ('r'),
-    // then we know the revision process began with an empty document
-    char *cur = op;
-    while(next_op_code(&cur))
-    {
-        if (*cur == 'r' || *cur == 'd')
-        {
-            // The revisions do not start from a "clean slate"
-            // and require full processing
-            return false;
-        }
-    }
-    return true;
-}
-
-/*
- * Process each revision from last to first, with inverted operations
- */
-int revert_doc(int repo_fd, doc_t *doc)
-{
-#ifdef DEBUG
-    // Save a backup of the original
-    char bak_name[255] = {0};
-    sprintf(bak_name, "%s.bak", doc->save_path);
-    int bak_fd = openat(repo_fd, bak_name, O_CREAT | O_WRONLY | O_TRUNC,
-                                           S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
-    if (QUIET == 0)
-    {
-        fprintf(stdout, "[DEBUG] Saving backup as '%s'...\n", bak_name);
-    }
-#endif
-
-    for (int i = doc->rev_cnt -1; i >= 0; i--)
-    {
-        // Read a copy of doc into memory
-        int read_fd = openat(repo_fd, doc->save_path, O_RDONLY);
-        if (read_fd == -1)
-        {
-            fprintf(stderr, "[ERROR %d] Failed to open document for copying!\n", errno);
-            return false;
-        }
-
-        struct stat rs;
-        if (fstat(read_fd, &rs) == -1)
-        {
-            fprintf(stderr, "Failed to retrieve document file stats.\n");
-            return false;
-        }
-
-        char *read_copy = mem_push(&SCRATCH_POOL, rs.st_size);
-        read(read_fd, read_copy, rs.st_size);
-#ifdef DEBUG
-        write(bak_fd, read_copy, rs.st_size);
-        close(bak_fd);
-#endif
-        close(read_fd);
-
-        // Overwrite original doc
-        int write_fd = openat(repo_fd, doc->save_path, O_WRONLY | O_TRUNC);
-        if (write_fd == -1)
-        {
-            fprintf(stderr, "[ERROR %d] Couldn't open file for writing!\n", errno);
-            return false;
-        }
-
-        rev_t *rev = doc->revisions + i;
-
-        char *cur = rev->op;
-
-        while(next_op_code(&cur))
-        {
-            char *buffer = NULL;
-            int len;
-
-            // Remember 'i' and 'd' must be swapped here
-            switch(*cur)
-            {
-                case 'i':
-                    len = get_instruction_len(++cur);
-
-                    // Skip 'len' letters after read cursor
-                    read_copy += len;
-                    break;
-                case 'd':
-                    len = get_instruction_len(++cur);
-
-                    // Write from op instruction
-                    write(write_fd, cur, len);
-                    break;
-                case 'r':
-                    len = get_retain_val(++cur);
-
-                    // Write from original
-                    write(write_fd, read_copy, len);
-
-                    // Move read cursor forward
-                    read_copy += len;
-                    break;
-            }
-        }
-
-        // Save changes
-        close(write_fd);
-        mem_pop(&read_copy, &SCRATCH_POOL, rs.st_size);
-    }
+/* ========================================================================== */
 
-    return 0;
-}
+// Context to stop on SIGINT / SIGTERM, while following
+static c9_ctx_t *follow_ctx;
 
-/*
- * Process each revision from first to last
- * Commit changes to git repo
- */
-int revise_and_commit(int repo_fd, doc_t *doc, git_repository *repo)
+static void stop_following(int sig)
 {
-    for (int i = 0; i < doc->rev_cnt; i++)
-    {
-        // Read a copy of doc into memory
-        int read_fd = openat(repo_fd, doc->save_path, O_RDONLY);
-        if (read_fd == -1)
-        {
-            fprintf(stderr, "[ERROR %d] Failed to open document for copying!\n", errno);
-            return false;
-        }
-
-        struct stat rs;
-        if (fstat(read_fd, &rs) == -1)
-        {
-            fprintf(stderr, "Failed to retrieve document file stats.\n");
-            return false;
-        }
-
-        char *read_copy = mem_push(&SCRATCH_POOL, rs.st_size);
-        read(read_fd, read_copy, rs.st_size);
-        close(read_fd);
-
-        // Overwrite original doc
-        int write_fd = openat(repo_fd, doc->save_path, O_WRONLY | O_TRUNC);
-        if (write_fd == -1)
-        {
-            fprintf(stderr, "[ERROR %d] Couldn't open file for writing!\n", errno);
-            return false;
-        }
-
-        rev_t *rev = doc->revisions + i;
-
-        char *cur = rev->op;
-
-        while(next_op_code(&cur))
-        {
-            char *buffer = NULL;
-            int len;
-
-            // TODO : Determine if the switch from here and `revert_doc()`
-            // can be efficiently pulled out into a separate function
-            switch(*cur)
-            {
-                case 'i':
-                    len = get_instruction_len(++cur);
-
-                    // Write from op instruction
-                    write(write_fd, cur, len);
-                    break;
-                case 'd':
-                    len = get_instruction_len(++cur);
-
-                    // Skip 'len' letters after read cursor
-                    read_copy += len;
-                    break;
-                case 'r':
-                    len = get_retain_val(++cur);
-
-                    // Write from original
-                    write(write_fd, read_copy, len);
-
-                    // Move read cursor forward
-                    read_copy += len;
-                    break;
-            }
-        }
-
-        // Save changes
-        close(write_fd);
-        mem_pop(&read_copy, &SCRATCH_POOL, rs.st_size);
-
-        // Update repo
-        // TODO : Determine method to combine multiple revisions into one commit
-        if (add_and_commit(repo, doc->save_path, rev->num) < 0)
-        {
-            return -1;
-        }
-    }
-
-    return 0;
-}
-
-/*
- * Ops are "null terminated", with "unit separated" instructions.
- * An op may consist of multiple instructions, denoted by a single
- * char at the head - 'i', 'd' and 'r' for "insert", "delete" and "retain" respectively.
- * 'i' and 'd' are followed by the text to insert or delete.
- * 'r' is followed by an integer character count.
- */
-int process_revisions(int repo_fd, git_repository *repo)
-{
-    for (doc_t *doc = DOC_LIST; doc < DOC_LIST + DOC_CNT; doc++)
-    {
-        char *doc_path = doc->save_path;
-
-        if (doc->rev_num == 0)
-        {
-            if (QUIET == 0)
-            {
-                fprintf(stdout, "[INFO] No revisions for '%s'. Simply `add` and `commit`...\n", doc_path);
-            }
-
-            // Revisionless doc
-            if (add_and_commit(repo, doc->save_path, 0) < 0)
-            {
-                return -1;
-            }
-
-            continue;
-        }
-
-        // Initially check the first rev op to see if we can skip doc reversion.
-        int reset = reset_check(doc->revisions->op);
-
-        if (reset)
-        {
-            if (QUIET == 0)
-            {
-                fprintf(stdout, "[INFO] Clear '%s'...\n", doc_path);
-            }
-
-            // Revert document to blank state
-            int doc_fd = openat(repo_fd, doc_path, O_WRONLY | O_TRUNC);
-            if (doc_fd == -1)
-            {
-                fprintf(stderr, "[ERROR] Failed to open %s\n", doc_path);
-                close(doc_fd);
-                return -1;
-            }
-            close(doc_fd);
-        }
-        else
-        {
-            if (QUIET == 0)
-            {
-                fprintf(stdout, "[INFO] Revert '%s' to original state...\n", doc_path);
-            }
-
-            // Revert to initial state
-            revert_doc(repo_fd, doc);
-        }
-
-        if (QUIET == 0)
-        {
-            fprintf(stdout, "[INFO] Process Revisions for '%s'...\n", doc_path);
-        }
-
-        revise_and_commit(repo_fd, doc, repo);
-    }
-
-    return 0;
+    c9_stop(follow_ctx);
 }
 
 /* ========================================================================== */
@@ -917,181 +165,302 @@ int process_revisions(int repo_fd, git_repository *repo)
  *   1 - Usage error
  *   2 - mkdir error
  *   3 - sqlite3 error
+ *   4 - Replay error
+ *   5 - git error
+ *   (see c9rev2git.h)
  */
 int main(int argc, char **argv)
 {
     if (argc < 2)
     {
         print_usage();
-        return 1;
+        return C9_EUSAGE;
     }
 
-    int flags, opt;
+    int opt;
     char *repo_dir = "repo";
 
+    c9_options_t opts;
+    c9_options_init(&opts);
+
+    // Path globs - there can't be more than there are arguments
+    const char *include[argc];
+    const char *exclude[argc];
+
+    opts.include = include;
+    opts.exclude = exclude;
+
+    // Single document query mode
+    char *query_path = NULL;
+    char *rev_arg = NULL;
+    int rev_from = -1;
+    int rev_to = -1;
+
+    // Revision map lookup mode
+    char *commit_of = NULL;
+    char *rev_of = NULL;
+
+    opts.keyframe_interval = C9_KEYFRAME_INTERVAL;
+
+    static struct option long_opts[] = {
+        {"quiet",             no_argument,       0, 'q'},
+        {"compress",          no_argument,       0, 'z'},
+        {"output",            required_argument, 0, 'o'},
+        {"bare",              no_argument,       0, 'b'},
+        {"checkout",          no_argument,       0, 'c'},
+        {"branches",          no_argument,       0, 'B'},
+        {"follow",            optional_argument, 0, 'F'},
+        {"pipeline",          no_argument,       0, 'P'},
+        {"journal",           required_argument, 0, 'J'},
+        {"optimize",          no_argument,       0, 'O'},
+        {"attribution",       no_argument,       0, 'A'},
+        {"snapshot",          no_argument,       0, 's'},
+        {"graft",             no_argument,       0, 'G'},
+        {"include",           required_argument, 0, 'I'},
+        {"exclude",           required_argument, 0, 'X'},
+        {"since-rev",         required_argument, 0, 'S'},
+        {"since-time",        required_argument, 0, 'T'},
+        {"doc",               required_argument, 0, 'd'},
+        {"rev",               required_argument, 0, 'r'},
+        {"keyframe-interval", required_argument, 0, 'k'},
+        {"encode-threads",    required_argument, 0, 'j'},
+        {"compression-level", required_argument, 0, 'l'},
+        {"commit-of",         required_argument, 0, 'C'},
+        {"rev-of",            required_argument, 0, 'R'},
+        {0, 0, 0, 0}
+    };
+
     // Get command line args
-    while ((opt = getopt(argc, argv, "qo:")) != -1)
+    while ((opt = getopt_long(argc, argv, "qzo:bcBFPJ:OAsGI:X:S:T:d:r:k:j:l:", long_opts, NULL)) != -1)
     {
         switch (opt)
         {
             case 'q':
                 // quiet - prevent output to stdout
-                QUIET = 1;
+                opts.quiet = 1;
+                break;
+            case 'z':
+                // Keep revision ops compressed in memory
+                opts.compress = 1;
                 break;
             case 'o':
                 // Alter the output directory name
                 repo_dir = optarg;
                 break;
+            case 'b':
+                // Write no working files
+                opts.bare = 1;
+                break;
+            case 'c':
+                // Write no working files until the very end
+                opts.checkout = 1;
+                break;
+            case 'B':
+                // One branch per document, merged at the end
+                opts.branches = 1;
+                break;
+            case 'F':
+                // Keep committing new revisions, polling every 'ms'
+                opts.follow = 1;
+                if (optarg && (opts.follow_interval = atoi(optarg)) < 1)
+                {
+                    print_usage();
+                    return C9_EUSAGE;
+                }
+                break;
+            case 'P':
+                // Read, replay and commit all at once
+                opts.pipeline = 1;
+                break;
+            case 'J':
+                // Revision journal to load, or write for next time
+                opts.journal = optarg;
+                break;
+            case 'O':
+                // Pack, and write a commit-graph, once converted
+                opts.optimize = 1;
+                break;
+            case 'A':
+                // Credit every line to the revision behind it
+                opts.attribution = 1;
+                break;
+            case 's':
+                // Commit the final contents first, then the history
+                opts.snapshot = 1;
+                break;
+            case 'G':
+                // Graft the history under the snapshot
+                opts.graft = 1;
+                break;
+            case 'I':
+                // Only convert documents matching any of these
+                include[opts.include_cnt++] = optarg;
+                break;
+            case 'X':
+                // Skip documents matching any of these
+                exclude[opts.exclude_cnt++] = optarg;
+                break;
+            case 'S':
+                // Start history after this revNum
+                opts.since_rev = atoi(optarg);
+                if (opts.since_rev < 1)
+                {
+                    print_usage();
+                    return C9_EUSAGE;
+                }
+                break;
+            case 'T':
+                // Start history at this Unix time
+                opts.since_time = atoll(optarg);
+                if (opts.since_time < 1)
+                {
+                    print_usage();
+                    return C9_EUSAGE;
+                }
+                break;
+            case 'd':
+                // Document to materialize, instead of converting
+                query_path = optarg;
+                break;
+            case 'r':
+                // Revision, or range of revisions, to materialize
+                rev_arg = optarg;
+                break;
+            case 'k':
+                // Revisions between keyframes
+                opts.keyframe_interval = atoi(optarg);
+                if (opts.keyframe_interval < 1)
+                {
+                    print_usage();
+                    return C9_EUSAGE;
+                }
+                break;
+            case 'j':
+                // Threads hashing and compressing blobs, alongside replay
+                opts.encode_threads = atoi(optarg);
+                if (opts.encode_threads < 0)
+                {
+                    print_usage();
+                    return C9_EUSAGE;
+                }
+                break;
+            case 'l':
+                // zlib level for loose objects
+                opts.compression_level = atoi(optarg);
+                if (opts.compression_level < 1 || opts.compression_level > 9)
+                {
+                    print_usage();
+                    return C9_EUSAGE;
+                }
+                break;
+            case 'C':
+                // Commit made for a document revision
+                commit_of = optarg;
+                break;
+            case 'R':
+                // Document revision a commit was made for
+                rev_of = optarg;
+                break;
             default: /* '?' */
                 print_usage();
-                return 1;
+                return C9_EUSAGE;
         }
     }
 
+    // Lookups only read the repository
+    if (commit_of || rev_of)
+    {
+        if ((commit_of && rev_of) || optind < argc)
+        {
+            print_usage();
+            return C9_EUSAGE;
+        }
+
+        return query_revmap(repo_dir, commit_of, rev_of);
+    }
+
     // Make sure a 'database path' has been passed
     if (optind >= argc)
     {
         print_usage();
-        return 1;
+        return C9_EUSAGE;
     }
 
-    // Initialise main memory
-    mem_alloc(&MEM, MEGABYTE(2));
-
-    // Initialise sub-pools
-    mem_sub_alloc(&MEM, &STRUCT_POOL, KILOBYTE(512));
-    mem_sub_alloc(&MEM, &STRING_POOL, KILOBYTE(512));
-    mem_sub_alloc(&MEM, &SCRATCH_POOL, KILOBYTE(512));
-
-    char *filepath = argv[optind];
-    sqlite3 *db;
-
-    if (QUIET == 0)
+    // Queries need both a document and a revision
+    if (!query_path != !rev_arg)
     {
-        fprintf(stdout, "[INFO] Open database: %s\n", filepath);
+        print_usage();
+        return C9_EUSAGE;
     }
 
-    if (sqlite3_open(filepath, &db) != SQLITE_OK)
+    // Working files would only ever show the initial conversion
+    if (opts.follow && (opts.checkout || query_path))
     {
-        // TODO : Utilise sqlite3_errmsg() [ref: https://www.sqlite.org/c3ref/errcode.html]
-        fprintf(stderr, "Failed to open %s : %s\n", filepath, sqlite3_errmsg(db));
-        return 2;
+        print_usage();
+        return C9_EUSAGE;
     }
 
-    // Create working directory with permissions 755
-    if (mkdir(repo_dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1)
+    // Following would only ever add to the history, never the snapshot
+    if ((opts.snapshot && opts.follow) || (opts.graft && !opts.snapshot))
     {
-        switch (errno)
-        {
-            // TODO : Add more specific cases ? [see: `man 2 mkdir`]
-            case EEXIST:
-                fprintf(stderr, "[ERROR %d] Directory already exists. Exiting.\n", errno);
-                break;
-            default:
-                fprintf(stderr, "[ERROR %d] Failed to create working directory. (Ref: errno-base.h) Exiting\n", errno);
-        }
-
-        return 2;
+        print_usage();
+        return C9_EUSAGE;
     }
 
-    // Intitialise git2 library
-    git_libgit2_init();
-
-    // Set up git repo
-    git_repository *repo = NULL;
-
-    if (QUIET == 0)
+    // Queries name their document and revisions directly
+    if (query_path && (opts.include_cnt || opts.exclude_cnt || opts.since_rev || opts.since_time))
     {
-        fprintf(stdout, "[INFO] Initialise git repo...\n");
+        print_usage();
+        return C9_EUSAGE;
     }
 
-    HEAD = (git_commit **)mem_push(&SCRATCH_POOL, sizeof(git_commit **));
-
-    // Git Init Repo
-    int res = git_repository_init(&repo, repo_dir, false);
-    if (res < 0)
+    if (rev_arg)
     {
-        git2_exit_with_error(res);
-        goto CLEANUP;
-    }
+        char *end;
+        rev_from = strtol(rev_arg, &end, 10);
+        rev_to = (*end == ':') ? strtol(end + 1, &end, 10) : rev_from;
 
-    git_initial_commit(repo);
+        if (*end != '\0' || rev_from < 0 || rev_to < rev_from)
+        {
+            print_usage();
+            return C9_EUSAGE;
+        }
 
-    if (QUIET == 0)
-    {
-        fprintf(stdout, "[INFO] Import document data...\n");
+        // Revision content goes to stdout
+        opts.quiet = 1;
     }
 
-    // Store the repo file descriptor
-    int repo_fd = open(repo_dir, O_DIRECTORY | O_RDONLY);
-
-    char *sql_err = NULL;
-
-    // DOC_LIST array will be stored contiguously in STRUCT_POOL
-    // and populated by the following sqlite3_exec()
-    DOC_LIST = (doc_t *)STRUCT_POOL.cur;
-
-    // Query to select and store all relevent document data
-    char *file_query = "SELECT id, path, contents, length(contents) AS content_len, revNum AS rev_num FROM Documents ORDER BY id ASC";
+    char *filepath = argv[optind];
+    c9_ctx_t *ctx;
 
-    // Process each target file in database
-    if (sqlite3_exec(db, file_query, prepare_doc_cb, &repo_fd, &sql_err) != SQLITE_OK)
+    int ret = c9_open(&ctx, filepath, &opts);
+    if (ret != C9_OK)
     {
-        fprintf(stderr, "[ERROR] Failed to retrieve target filenames from database\n");
-        fprintf(stderr, "[SQLERR] %s\n", sql_err);
-
-        goto CLEANUP;
-
-        return 3;
+        return ret;
     }
 
-    if (QUIET == 0)
+    if (opts.follow)
     {
-        fprintf(stdout, "[INFO] Importing revision data...\n");
+        follow_ctx = ctx;
+        signal(SIGINT, stop_following);
+        signal(SIGTERM, stop_following);
     }
 
-    // REV_LIST array will be stored contiguously in STRUCT_POOL
-    // and populated by the following sqlite3_exec()
-    // TODO : Implement better memory alignment
-    REV_LIST = (rev_t *)STRUCT_POOL.cur;
-
-    // Query to select relevant revision data - with optimal ordering
-    char *rev_query = "SELECT document_id AS doc_id, revNum AS rev_num, operation AS op, length(operation) AS op_len FROM Revisions ORDER BY document_id ASC, revNum ASC";
-
-    // Store data on all revisions in database
-    if (sqlite3_exec(db, rev_query, process_rev_cb, 0, &sql_err) != SQLITE_OK)
+    if (query_path)
     {
-        fprintf(stderr, "Failed to retrieve revisions from database\n");
-        fprintf(stderr, "[ERROR: SQL] %s\n", sql_err);
-
-        goto CLEANUP;
-
-        return 3;
+        ret = query_doc(ctx, query_path, rev_from, rev_to);
     }
-
-    if (process_revisions(repo_fd, repo) != 0)
+    else
     {
-        fprintf(stderr, "[ERROR] Processing failed. Aborting\n");
+        ret = c9_convert(ctx, repo_dir);
     }
 
-CLEANUP:
-
-    if (QUIET == 0)
+    if (opts.quiet == 0)
     {
         fprintf(stdout, "[INFO] Cleaning up memory...\n");
     }
 
-    sqlite3_free(sql_err);
-    sqlite3_close(db);
-
-    git_repository_free(repo);
+    c9_close(ctx);
 
-    // Clean up libgit2 global state (not strictly necessary)
-    git_libgit2_shutdown();
-
-    close(repo_fd);
-
-    mem_free(&MEM);
-
-    return 0;
+    return ret;
 }
@@ -0,0 +1,169 @@
+#ifndef C9REV2GIT_H
+#define C9REV2GIT_H
+
+/*
+ * c9rev2git - convert c9 document revisions into a git repository
+ *
+ * Every call takes an explicit context, which owns its own memory arenas,
+ * database connection and revision data. Contexts share no state, so any
+ * number of them may be used concurrently from separate threads.
+ * A single context must only be used by one thread at a time.
+ *
+ * Unless stated otherwise, calls return C9_OK on success, or one of the
+ * C9_E* codes below. Details of a failure are written to stderr.
+ */
+
+#if defined(__GNUC__)
+    #define C9_API __attribute__((visibility("default")))
+#else
+    #define C9_API
+#endif
+
+/* ========================================================================== */
+
+// Return codes - also used as the exit status of the command line tool
+#define C9_OK       0
+#define C9_EUSAGE   1   // Bad argument, or unknown document / revision
+#define C9_EIO      2   // File system error
+#define C9_ESQL     3   // sqlite3 error
+#define C9_EREPLAY  4   // A revision could not be applied
+#define C9_EGIT     5   // libgit2 error
+#define C9_ENOMEM   6
+
+// Suggested number of revisions between keyframes
+#define C9_KEYFRAME_INTERVAL 64
+
+/* ========================================================================== */
+
+typedef struct c9_ctx c9_ctx_t;
+
+typedef struct c9_options {
+    int quiet;                  // Suppress informational output on stdout
+    int compress;               // Keep revision ops compressed in memory
+    int keyframe_interval;      // Revisions between cached keyframes, 0 to disable
+    int bare;                   // Replay in memory, writing no working files
+    int checkout;               // Implies 'bare', then checks out the final tree once
+    int branches;               // Implies 'bare', commits each document on its own branch
+    int follow;                 // Implies 'bare', then keeps committing new revisions
+    int pipeline;               // Implies 'bare', reading, replaying and committing all at once
+    int follow_interval;        // ms between polls for new revisions, 0 for the default
+    int encode_threads;         // Threads hashing and compressing blobs in bare mode, 0 for none
+    int compression_level;      // zlib level for loose objects (1-9), -1 for the default
+    const char *journal;        // Revision journal to load from, or to write when missing or stale
+    int optimize;               // Pack the repository, and write a commit-graph, once done
+    int attribution;            // Implies 'bare', and writes the revision behind every line
+    int snapshot;               // Implies 'bare', and commits the final contents before any history
+    int graft;                  // With 'snapshot', grafts the history under the snapshot once built
+    const char **include;       // Path globs - only matching documents are converted
+    int include_cnt;
+    const char **exclude;       // Path globs - matching documents are skipped
+    int exclude_cnt;
+    int since_rev;              // Skip revisions up to and including this revNum, 0 for none
+    long long since_time;       // Skip revisions created before this Unix time (s), 0 for none
+    unsigned long mem_size;     // Arena size in bytes, 0 for the default
+} c9_options_t;
+
+typedef struct c9_doc_info {
+    int id;
+    const char *path;
+    int rev_num;                // Latest revision number
+    int rev_cnt;                // Number of non-empty revisions
+} c9_doc_info_t;
+
+/*
+ * 'op' is the parsed operation: a run of instructions, each introduced by a
+ * unit separator (0x1f) followed by 'i' (insert text), 'd' (delete text) or
+ * 'r' (retain a decimal character count).
+ * It is only valid for the duration of the callback.
+ */
+typedef struct c9_rev_info {
+    int doc_id;
+    int num;
+    const char *op;
+} c9_rev_info_t;
+
+/*
+ * Document contents, as produced by `c9_materialize()`
+ * Zero initialise before first use, and release with `c9_buf_free()`.
+ */
+typedef struct c9_buf {
+    char *data;
+    long len;
+    long cap;
+
+    // Where 'data' is in a document's history. Lets a later call continue
+    // forward from here, rather than starting over.
+    int doc_id;
+    int applied;
+} c9_buf_t;
+
+// Return non-zero to stop iterating. That value is then returned.
+typedef int (*c9_doc_cb)(const c9_doc_info_t *doc, void *data);
+typedef int (*c9_rev_cb)(const c9_rev_info_t *rev, void *data);
+
+/* ========================================================================== */
+
+C9_API void c9_options_init(c9_options_t *opts);
+
+/*
+ * Open a database (read only) and load its document list
+ * A document's revisions are only read once a call below needs them, and
+ * then for that document alone.
+ * 'opts' may be NULL for defaults
+ */
+C9_API int c9_open(c9_ctx_t **out, const char *db_path, const c9_options_t *opts);
+
+C9_API void c9_close(c9_ctx_t *ctx);
+
+// Documents are visited in ascending id order
+C9_API int c9_foreach_doc(c9_ctx_t *ctx, c9_doc_cb cb, void *data);
+
+C9_API int c9_find_doc(c9_ctx_t *ctx, const char *path, c9_doc_info_t *out);
+
+// Revisions are visited in ascending revision number order - only those
+// within 'since_rev' / 'since_time', when set
+C9_API int c9_foreach_rev(c9_ctx_t *ctx, int doc_id, c9_rev_cb cb, void *data);
+
+/*
+ * Reconstruct a document as of 'rev_num' into 'out'
+ * When 'out' already holds an earlier revision of the same document, replay
+ * continues from there - so walking a range of revisions in a loop is cheap.
+ * Otherwise replay starts from the nearest keyframe (if enabled), or from
+ * the beginning of the document's history.
+ * Fails with C9_EUSAGE when 'since_rev' or 'since_time' is set.
+ */
+C9_API int c9_materialize(c9_ctx_t *ctx, int doc_id, int rev_num, c9_buf_t *out);
+
+C9_API void c9_buf_free(c9_buf_t *buf);
+
+/*
+ * Convert the full revision history into a new git repository at 'repo_dir'
+ * 'repo_dir' must not already exist.
+ * With 'follow' set, this then carries on committing revisions as they are
+ * added to the database, until `c9_stop()` is called.
+ * With 'snapshot' set (and not 'follow'), the final contents of every document
+ * are committed to HEAD before any revision is read, and the history built on
+ * "refs/heads/c9-history" afterwards.
+ */
+C9_API int c9_convert(c9_ctx_t *ctx, const char *repo_dir);
+
+/*
+ * Ask a following `c9_convert()` to return, after its current poll
+ * Safe to call from a signal handler, or another thread.
+ */
+C9_API void c9_stop(c9_ctx_t *ctx);
+
+/*
+ * Look up the revision map `c9_convert()` leaves in the git directory of
+ * 'repo_dir' - no context or database needed.
+ * `c9_revmap_commit()` writes the 40 hex digit id (plus NUL) of the commit for
+ * revision 'rev_num' of 'doc_id' to 'hex', or for its latest revision before
+ * that with a commit. `c9_revmap_rev()` goes the other way, and accepts an
+ * unambiguous abbreviation of at least 4 digits.
+ * Both return C9_EIO without a revision map, and C9_EUSAGE when there is no
+ * such entry.
+ */
+C9_API int c9_revmap_commit(const char *repo_dir, int doc_id, int rev_num, char *hex);
+C9_API int c9_revmap_rev(const char *repo_dir, const char *hex, int *doc_id, int *rev_num);
+
+#endif
@@ -0,0 +1,219 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include <unistd.h>     // write, close, sysconf
+#include <sys/stat.h>   // open
+#include <fcntl.h>      // open
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Deferred checkout
+ *
+ * After a bare-style conversion, the final tree (as held by the index) is
+ * written to the working directory once. Files are shared out to a pool of
+ * threads in batches of CHECKOUT_BATCH. Each thread opens its own repository
+ * handle, as libgit2 repositories must not be shared between threads.
+ */
+
+typedef struct checkout_entry {
+    const char *path;
+    git_oid id;
+} checkout_entry_t;
+
+typedef struct checkout_job {
+    c9_ctx_t *ctx;
+    const char *git_dir;
+    checkout_entry_t *entries;
+    int entry_cnt;
+    int next;               // Next unclaimed entry, advanced atomically
+    int errors;
+} checkout_job_t;
+
+static int checkout_entry(c9_ctx_t *ctx, git_repository *repo, checkout_entry_t *entry)
+{
+    git_blob *blob;
+
+    if (git_blob_lookup(&blob, repo, &entry->id) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not look up blob for '%s'\n", entry->path);
+        return -1;
+    }
+
+    const char *data = git_blob_rawcontent(blob);
+    long len = (long)git_blob_rawsize(blob);
+    int ret = 0;
+
+    int fd = -1;
+
+    if (mkdir_parents(ctx, ctx->repo_fd, entry->path) < 0
+        || (fd = openat(ctx->repo_fd, entry->path, O_WRONLY | O_CREAT | O_TRUNC,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to create '%s'\n", errno, entry->path);
+        ret = -1;
+    }
+
+    while (ret == 0 && len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+        if (written == -1)
+        {
+            fprintf(stderr, "[ERROR %d] Failed to write out '%s'\n", errno, entry->path);
+            ret = -1;
+            break;
+        }
+
+        data += written;
+        len -= written;
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    git_blob_free(blob);
+
+    return ret;
+}
+
+static void * checkout_worker(void *data)
+{
+    checkout_job_t *job = (checkout_job_t *)data;
+    git_repository *repo;
+
+    if (git_repository_open(&repo, job->git_dir) < 0)
+    {
+        fprintf(stderr, "[ERROR] Checkout could not open '%s'\n", job->git_dir);
+        __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    for (;;)
+    {
+        int first = __atomic_fetch_add(&job->next, CHECKOUT_BATCH, __ATOMIC_RELAXED);
+        if (first >= job->entry_cnt)
+        {
+            break;
+        }
+
+        int last = first + CHECKOUT_BATCH;
+        if (last > job->entry_cnt)
+        {
+            last = job->entry_cnt;
+        }
+
+        for (int i = first; i < last; i++)
+        {
+            if (checkout_entry(job->ctx, repo, job->entries + i) < 0)
+            {
+                __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    git_repository_free(repo);
+
+    return NULL;
+}
+
+/*
+ * Write every file in the index to the working directory, then save the index
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int checkout_index(c9_ctx_t *ctx, git_repository *repo)
+{
+    git_index *idx;
+
+    if (git_repository_index(&idx, repo) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not open repository index\n");
+        return -1;
+    }
+
+    checkout_job_t job = {0};
+    job.ctx = ctx;
+    job.git_dir = git_repository_path(repo);
+    job.entry_cnt = (int)git_index_entrycount(idx);
+    job.entries = malloc(sizeof(checkout_entry_t) * (job.entry_cnt ? job.entry_cnt : 1));
+
+    if (!job.entries)
+    {
+        git_index_free(idx);
+        return -1;
+    }
+
+    // Paths stay owned by the index, which is left untouched until we're done
+    for (int i = 0; i < job.entry_cnt; i++)
+    {
+        const git_index_entry *entry = git_index_get_byindex(idx, i);
+        job.entries[i].path = entry->path;
+        job.entries[i].id = entry->id;
+    }
+
+    int thread_cnt = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int batch_cnt = (job.entry_cnt + CHECKOUT_BATCH - 1) / CHECKOUT_BATCH;
+
+    if (thread_cnt > CHECKOUT_MAX_THREADS)
+    {
+        thread_cnt = CHECKOUT_MAX_THREADS;
+    }
+    if (thread_cnt > batch_cnt)
+    {
+        thread_cnt = batch_cnt;
+    }
+    if (thread_cnt < 1)
+    {
+        thread_cnt = 1;
+    }
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Checkout %d files on %d threads...\n", job.entry_cnt, thread_cnt);
+    }
+
+    pthread_t threads[CHECKOUT_MAX_THREADS];
+    int started = 0;
+
+    for (; started < thread_cnt; started++)
+    {
+        if (pthread_create(threads + started, NULL, checkout_worker, &job) != 0)
+        {
+            break;
+        }
+    }
+
+    // Fall back to this thread if none could be started
+    if (started == 0)
+    {
+        checkout_worker(&job);
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    int ret = 0;
+
+    if (job.errors)
+    {
+        fprintf(stderr, "[ERROR] %d files failed to check out\n", job.errors);
+        ret = -1;
+    }
+    else if (git_index_write(idx) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to write updated repo index\n");
+        ret = -1;
+    }
+
+    free(job.entries);
+    git_index_free(idx);
+
+    return ret;
+}
@@ -0,0 +1,751 @@
+#include <errno.h>
+#include <string.h>     // strncpy
+
+#include <unistd.h>     // read, write, close
+#include <sys/stat.h>   // open, mkdir
+#include <sys/types.h>  // open, mkdir
+#include <fcntl.h>      // open
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Create any directories leading up to 'path', relative to 'dir_fd'
+ * Returns:
+ *  0 : Success
+ * -1 : Failure
+ */
+int mkdir_parents(c9_ctx_t *ctx, int dir_fd, const char *path)
+{
+    // TODO : Test and/or get feedback on this assumption
+    // Assuming 512 is long enough to account for most reasonable directory tree depth
+    char dir_path[512];
+
+    for (int cnt = 0; path[cnt] != '\0'; cnt++)
+    {
+        // Create any necessary directories as we find them
+        if (!(path[cnt] == '/'))
+        {
+            continue;
+        }
+
+        strncpy(dir_path, path, cnt);
+
+        // Always remember the null terminator
+        dir_path[cnt] = '\0';
+
+        if (mkdirat(dir_fd, dir_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1)
+        {
+            if (errno == EEXIST)
+            {
+                // Don't worry if the directory already exists
+
+                if (ctx->opts.quiet == 0)
+                {
+                    fprintf(stdout, "[mkdir] Skipping '%s'. Already exists\n", dir_path);
+                }
+                continue;
+            }
+
+            fprintf(stderr, "[ERROR] Failed to create directory '%s'. Aborting...\n", dir_path);
+
+            return -1;
+        }
+        else if (ctx->opts.quiet == 0)
+        {
+            fprintf(stdout, "[mkdir] Creating '%s'\n", dir_path);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Process each target file
+ *   - Create any directory tree as required
+ * The file itself is only written once it is reached, and only if its
+ * history doesn't start from an empty document (see `write_contents()`).
+ *
+ * Expects:
+ *   data to be the context
+ *   col_data[0] to be 'id'
+ *   col_data[1] to be 'path'
+*/
+static int prepare_doc_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    c9_ctx_t *ctx = (c9_ctx_t *)data;
+    int repo_fd = ctx->repo_fd;
+
+    // WARNING : `col_data` will contain NULL pointers where there is no value stored
+    char *path = col_data[1];
+
+    if (mkdir_parents(ctx, repo_fd, path) < 0)
+    {
+        // Trigger a sqlite abort
+        // TODO : Implement "clean up" on failure, in main(), and remove this
+        fprintf(stderr, "[WARNING] This may leave file and/or directory artefacts.\n");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Save out document in it's "final" state.
+ * Working later with revisions will initially process backwards from that
+ * state. 'contents' is only a read buffer, reused between documents.
+ */
+static int write_contents(c9_ctx_t *ctx, doc_t *doc, c9_buf_t *contents)
+{
+    if (load_contents(ctx, doc, contents) != C9_OK)
+    {
+        return -1;
+    }
+
+    int save_fd = openat(ctx->repo_fd, doc->save_path, O_WRONLY | O_CREAT | O_TRUNC,
+                                                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if (save_fd == -1 || write(save_fd, contents->data, contents->len) != contents->len)
+    {
+        fprintf(stderr, "[ERROR] Failed to write out %s\n", doc->save_path);
+
+        if (save_fd != -1)
+        {
+            close(save_fd);
+        }
+        return -1;
+    }
+
+    close(save_fd);
+
+    return 0;
+}
+
+/* ========================================================================== */
+
+/*
+ * Process each revision from last to first, with inverted operations
+ */
+int revert_doc(c9_ctx_t *ctx, doc_t *doc)
+{
+    int repo_fd = ctx->repo_fd;
+
+#ifdef DEBUG
+    // Save a backup of the original
+    char bak_name[255] = {0};
+    sprintf(bak_name, "%s.bak", doc->save_path);
+    int bak_fd = openat(repo_fd, bak_name, O_CREAT | O_WRONLY | O_TRUNC,
+                                           S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[DEBUG] Saving backup as '%s'...\n", bak_name);
+    }
+#endif
+
+    for (int i = doc->rev_cnt -1; i >= 0; i--)
+    {
+        // Read a copy of doc into memory
+        int read_fd = openat(repo_fd, doc->save_path, O_RDONLY);
+        if (read_fd == -1)
+        {
+            fprintf(stderr, "[ERROR %d] Failed to open document for copying!\n", errno);
+            return false;
+        }
+
+        struct stat rs;
+        if (fstat(read_fd, &rs) == -1)
+        {
+            fprintf(stderr, "Failed to retrieve document file stats.\n");
+            return false;
+        }
+
+        char *read_copy = mem_push(&ctx->scratch_pool, rs.st_size);
+        read(read_fd, read_copy, rs.st_size);
+#ifdef DEBUG
+        // Only the original is backed up. Closing more than once could
+        // close a descriptor since reused by another context's thread
+        if (bak_fd != -1)
+        {
+            write(bak_fd, read_copy, rs.st_size);
+            close(bak_fd);
+            bak_fd = -1;
+        }
+#endif
+        close(read_fd);
+
+        // Overwrite original doc
+        int write_fd = openat(repo_fd, doc->save_path, O_WRONLY | O_TRUNC);
+        if (write_fd == -1)
+        {
+            fprintf(stderr, "[ERROR %d] Couldn't open file for writing!\n", errno);
+            return false;
+        }
+
+        rev_t *rev = doc->revisions + i;
+
+        char *cur = rev_op(ctx, &ctx->rev_cache, rev);
+        if (!cur)
+        {
+            close(write_fd);
+            return -1;
+        }
+
+        while(next_op_code(&cur))
+        {
+            char *buffer = NULL;
+            int len;
+
+            // Remember 'i' and 'd' must be swapped here
+            switch(*cur)
+            {
+                case 'i':
+                    len = get_instruction_len(++cur);
+
+                    // Skip 'len' letters after read cursor
+                    read_copy += len;
+                    break;
+                case 'd':
+                    len = get_instruction_len(++cur);
+
+                    // Write from op instruction
+                    write(write_fd, cur, len);
+                    break;
+                case 'r':
+                    len = get_retain_val(++cur);
+
+                    // Write from original
+                    write(write_fd, read_copy, len);
+
+                    // Move read cursor forward
+                    read_copy += len;
+                    break;
+            }
+        }
+
+        // Save changes
+        close(write_fd);
+        mem_pop(&read_copy, &ctx->scratch_pool, rs.st_size);
+    }
+
+    return 0;
+}
+
+/*
+ * Process each revision from first to last
+ * Commit changes to git repo
+ */
+int revise_and_commit(c9_ctx_t *ctx, doc_t *doc, git_repository *repo)
+{
+    int repo_fd = ctx->repo_fd;
+
+    for (int i = 0; i < doc->rev_cnt; i++)
+    {
+        // Read a copy of doc into memory
+        int read_fd = openat(repo_fd, doc->save_path, O_RDONLY);
+        if (read_fd == -1)
+        {
+            fprintf(stderr, "[ERROR %d] Failed to open document for copying!\n", errno);
+            return false;
+        }
+
+        struct stat rs;
+        if (fstat(read_fd, &rs) == -1)
+        {
+            fprintf(stderr, "Failed to retrieve document file stats.\n");
+            return false;
+        }
+
+        char *read_copy = mem_push(&ctx->scratch_pool, rs.st_size);
+        read(read_fd, read_copy, rs.st_size);
+        close(read_fd);
+
+        // Overwrite original doc
+        int write_fd = openat(repo_fd, doc->save_path, O_WRONLY | O_TRUNC);
+        if (write_fd == -1)
+        {
+            fprintf(stderr, "[ERROR %d] Couldn't open file for writing!\n", errno);
+            return false;
+        }
+
+        rev_t *rev = doc->revisions + i;
+
+        char *cur = rev_op(ctx, &ctx->rev_cache, rev);
+        if (!cur)
+        {
+            close(write_fd);
+            return -1;
+        }
+
+        while(next_op_code(&cur))
+        {
+            char *buffer = NULL;
+            int len;
+
+            // TODO : Determine if the switch from here and `revert_doc()`
+            // can be efficiently pulled out into a separate function
+            switch(*cur)
+            {
+                case 'i':
+                    len = get_instruction_len(++cur);
+
+                    // Write from op instruction
+                    write(write_fd, cur, len);
+                    break;
+                case 'd':
+                    len = get_instruction_len(++cur);
+
+                    // Skip 'len' letters after read cursor
+                    read_copy += len;
+                    break;
+                case 'r':
+                    len = get_retain_val(++cur);
+
+                    // Write from original
+                    write(write_fd, read_copy, len);
+
+                    // Move read cursor forward
+                    read_copy += len;
+                    break;
+            }
+        }
+
+        // Save changes
+        close(write_fd);
+        mem_pop(&read_copy, &ctx->scratch_pool, rs.st_size);
+
+        // Update repo
+        // TODO : Determine method to combine multiple revisions into one commit
+        if (add_and_commit(ctx, repo, doc->id, doc->save_path, rev->num) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Ops are "null terminated", with "unit separated" instructions.
+ * An op may consist of multiple instructions, denoted by a single
+ * char at the head - 'i', 'd' and 'r' for "insert", "delete" and "retain" respectively.
+ * 'i' and 'd' are followed by the text to insert or delete.
+ * 'r' is followed by an integer character count.
+ */
+int process_revisions(c9_ctx_t *ctx, git_repository *repo)
+{
+    int repo_fd = ctx->repo_fd;
+    c9_buf_t contents = {0};
+    int ret = 0;
+
+    for (doc_t *doc = ctx->doc_list; doc < ctx->doc_list + ctx->doc_cnt; doc++)
+    {
+        char *doc_path = doc->save_path;
+
+        // Also docs whose revisions were all empty, or filtered out
+        if (doc->rev_cnt == 0)
+        {
+            if (ctx->opts.quiet == 0)
+            {
+                fprintf(stdout, "[INFO] No revisions for '%s'. Simply `add` and `commit`...\n", doc_path);
+            }
+
+            // Revisionless doc
+            if (write_contents(ctx, doc, &contents) < 0
+                || add_and_commit(ctx, repo, doc->id, doc->save_path, doc->rev_num) < 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            continue;
+        }
+
+        // Initially check the first rev op to see if we can skip doc reversion.
+        char *first_op = rev_op(ctx, &ctx->rev_cache, doc->revisions);
+        if (!first_op)
+        {
+            ret = -1;
+            break;
+        }
+
+        int reset = reset_check(first_op);
+
+        if (reset)
+        {
+            if (ctx->opts.quiet == 0)
+            {
+                fprintf(stdout, "[INFO] Clear '%s'...\n", doc_path);
+            }
+
+            // Start from a blank document - its contents are never read
+            int doc_fd = openat(repo_fd, doc_path, O_WRONLY | O_CREAT | O_TRUNC,
+                                                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if (doc_fd == -1)
+            {
+                fprintf(stderr, "[ERROR] Failed to open %s\n", doc_path);
+                ret = -1;
+                break;
+            }
+            close(doc_fd);
+        }
+        else
+        {
+            if (ctx->opts.quiet == 0)
+            {
+                fprintf(stdout, "[INFO] Revert '%s' to original state...\n", doc_path);
+            }
+
+            // Revert to initial state
+            if (write_contents(ctx, doc, &contents) < 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            revert_doc(ctx, doc);
+        }
+
+        if (ctx->opts.quiet == 0)
+        {
+            fprintf(stdout, "[INFO] Process Revisions for '%s'...\n", doc_path);
+        }
+
+        revise_and_commit(ctx, doc, repo);
+    }
+
+    c9_buf_free(&contents);
+
+    return ret;
+}
+
+/*
+ * Commit each encoded blob, oldest first
+ * Waits for every outstanding blob with 'wait' set, otherwise only for as
+ * many as it takes to free up a slot.
+ */
+static int commit_encoded(c9_ctx_t *ctx, git_repository *repo, obj_writer_t *w, int wait)
+{
+    obj_job_t *job;
+
+    while ((job = obj_writer_next(w, wait || obj_writer_full(w))) != NULL)
+    {
+        if (job->state == JOB_FAILED
+            || add_oid_and_commit(ctx, repo, job->doc_id, job->path, &job->id, job->rev_num) < 0)
+        {
+            return -1;
+        }
+
+        obj_writer_release(w);
+    }
+
+    return 0;
+}
+
+/*
+ * As `process_revisions()`, but documents are replayed in memory and staged
+ * straight from the replay buffer. No working files are written.
+ * Blobs are hashed and compressed by the object writer, which runs ahead of
+ * the commits when it has threads.
+ */
+int process_revisions_bare(c9_ctx_t *ctx, git_repository *repo)
+{
+    c9_buf_t state = {0};
+    c9_buf_t spare = {0};
+    attrib_t attrib = {0};
+    obj_writer_t writer;
+    int ret = 0;
+
+    if (obj_writer_start(&writer, ctx, repo) < 0)
+    {
+        return -1;
+    }
+
+    for (doc_t *doc = ctx->doc_list; doc < ctx->doc_list + ctx->doc_cnt; doc++)
+    {
+        char *doc_path = doc->save_path;
+
+        // Read straight into the replay buffer, and only if replay needs it
+        if (!history_resets(ctx, &ctx->rev_cache, doc) && load_contents(ctx, doc, &state) != C9_OK)
+        {
+            ret = -1;
+            break;
+        }
+
+        // Also docs whose revisions were all empty, or filtered out
+        if (doc->rev_cnt == 0)
+        {
+            if (ctx->opts.quiet == 0)
+            {
+                fprintf(stdout, "[INFO] No revisions for '%s'. Simply `add` and `commit`...\n", doc_path);
+            }
+
+            // Revisionless doc
+            if (obj_writer_submit(&writer, &state, doc->id, doc_path, doc->rev_num) < 0
+                || commit_encoded(ctx, repo, &writer, false) < 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            if (ctx->attrib
+                && (attrib_begin(&attrib, state.len, doc->rev_num) < 0
+                    || attrib_finish(ctx, &attrib, doc - ctx->doc_list, &state) < 0))
+            {
+                ret = -1;
+                break;
+            }
+
+            continue;
+        }
+
+        if (ctx->opts.quiet == 0)
+        {
+            fprintf(stdout, "[INFO] Process Revisions for '%s'...\n", doc_path);
+        }
+
+        if (initial_state(ctx, &ctx->rev_cache, doc, &state, &spare, &state) < 0
+            || (ctx->attrib && attrib_begin(&attrib, state.len, 0) < 0))
+        {
+            ret = -1;
+            break;
+        }
+
+        for (int i = 0; i < doc->rev_cnt; i++)
+        {
+            // 'spare' is left holding the state before the revision
+            if (replay_doc(ctx, &ctx->rev_cache, doc, &state, &spare, i, i + 1) < 0
+                || (ctx->attrib && attrib_apply(ctx, &ctx->rev_cache, &attrib, doc->revisions + i, &spare) < 0)
+                || obj_writer_submit(&writer, &state, doc->id, doc_path, doc->revisions[i].num) < 0
+                || commit_encoded(ctx, repo, &writer, false) < 0)
+            {
+                ret = -1;
+                goto DONE;
+            }
+        }
+
+        if (ctx->attrib && attrib_finish(ctx, &attrib, doc - ctx->doc_list, &state) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0)
+    {
+        ret = commit_encoded(ctx, repo, &writer, true);
+    }
+
+DONE:
+    obj_writer_stop(&writer);
+
+    c9_buf_free(&state);
+    c9_buf_free(&spare);
+    attrib_free(&attrib);
+
+    return ret;
+}
+
+/* ========================================================================== */
+
+/*
+ * Create the repository, and replay every document's history into it
+ */
+C9_API int c9_convert(c9_ctx_t *ctx, const char *repo_dir)
+{
+    int ret = C9_OK;
+    char *sql_err = NULL;
+    git_repository *repo = NULL;
+
+    // Create working directory with permissions 755
+    if (mkdir(repo_dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1)
+    {
+        switch (errno)
+        {
+            // TODO : Add more specific cases ? [see: `man 2 mkdir`]
+            case EEXIST:
+                fprintf(stderr, "[ERROR %d] Directory already exists. Exiting.\n", errno);
+                break;
+            default:
+                fprintf(stderr, "[ERROR %d] Failed to create working directory. (Ref: errno-base.h) Exiting\n", errno);
+        }
+
+        return C9_EIO;
+    }
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Initialise git repo...\n");
+    }
+
+    // A deferred checkout still needs somewhere to check out to
+    int bare_repo = ctx->opts.bare && !ctx->opts.checkout;
+
+    // Git Init Repo
+    int res = git_repository_init(&repo, repo_dir, bare_repo);
+    if (res < 0)
+    {
+        git2_print_error(res);
+        return C9_EGIT;
+    }
+
+    revmap_init(&ctx->revmap);
+
+    if (git_initial_commit(ctx, repo) < 0)
+    {
+        ret = C9_EGIT;
+        goto CLEANUP;
+    }
+
+    // Store the repo file descriptor
+    ctx->repo_fd = open(repo_dir, O_DIRECTORY | O_RDONLY);
+
+    if (ctx->opts.bare)
+    {
+        // Without it, every state is simply written out
+        obj_cache_init(&ctx->obj_cache, 1);
+
+        if (ctx->opts.attribution && !(ctx->attrib = calloc(ctx->doc_cnt + 1, sizeof(attrib_doc_t))))
+        {
+            ret = C9_ENOMEM;
+            goto CLEANUP;
+        }
+
+        // Branches take precedence - the pipeline commits to HEAD only
+        int pipeline = ctx->opts.pipeline && !ctx->opts.branches;
+
+        // New revisions would only ever reach the history, not the snapshot
+        int snapshot = ctx->opts.snapshot && !ctx->opts.follow;
+
+        // Usable straight away, before a single revision is read
+        if (snapshot && snapshot_commit(ctx, repo) < 0)
+        {
+            ret = C9_EGIT;
+            goto CLEANUP;
+        }
+
+        // The pipeline streams revisions in for itself
+        if (!pipeline && (ret = load_revisions(ctx)) != C9_OK)
+        {
+            goto CLEANUP;
+        }
+
+        if (pipeline)
+        {
+            res = process_revisions_pipeline(ctx, repo);
+        }
+        else
+        {
+            res = ctx->opts.branches ? process_revisions_branches(ctx, repo)
+                                 : process_revisions_bare(ctx, repo);
+        }
+
+        if (res != 0)
+        {
+            fprintf(stderr, "[ERROR] Processing failed. Aborting\n");
+            ret = C9_EREPLAY;
+            goto CLEANUP;
+        }
+
+        if (snapshot && snapshot_link(ctx, repo) < 0)
+        {
+            ret = C9_EGIT;
+            goto CLEANUP;
+        }
+
+        // Covers the conversion only - following doesn't keep it up to date
+        if (ctx->attrib && attrib_write(ctx, repo) < 0)
+        {
+            ret = C9_EIO;
+            goto CLEANUP;
+        }
+
+        if (ctx->opts.checkout && checkout_index(ctx, repo) < 0)
+        {
+            ret = C9_EIO;
+            goto CLEANUP;
+        }
+
+        if (ctx->opts.follow && follow_revisions(ctx, repo) < 0)
+        {
+            fprintf(stderr, "[ERROR] Following failed. Aborting\n");
+            ret = C9_EREPLAY;
+        }
+
+        goto OPTIMIZE;
+    }
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Import document data...\n");
+    }
+
+    // Query to select every document - contents are read as each is reached
+    char *file_query = sqlite3_mprintf("SELECT id, path FROM Documents WHERE %s ORDER BY id ASC", ctx->doc_where);
+
+    // Process each target file in database
+    res = sqlite3_exec(ctx->db, file_query, prepare_doc_cb, ctx, &sql_err);
+    sqlite3_free(file_query);
+
+    if (res != SQLITE_OK)
+    {
+        fprintf(stderr, "[ERROR] Failed to retrieve target filenames from database\n");
+        fprintf(stderr, "[SQLERR] %s\n", sql_err);
+
+        ret = C9_ESQL;
+        goto CLEANUP;
+    }
+
+    if ((ret = load_revisions(ctx)) != C9_OK)
+    {
+        goto CLEANUP;
+    }
+
+    if (process_revisions(ctx, repo) != 0)
+    {
+        fprintf(stderr, "[ERROR] Processing failed. Aborting\n");
+        ret = C9_EREPLAY;
+    }
+
+OPTIMIZE:
+
+    if (ret == C9_OK && revmap_write(ctx, repo) < 0)
+    {
+        ret = C9_EIO;
+    }
+
+    if (ret == C9_OK && ctx->opts.optimize && optimize_repo(ctx, repo) < 0)
+    {
+        ret = C9_EGIT;
+    }
+
+CLEANUP:
+
+    if (ctx->obj_cache.hits + ctx->obj_cache.misses && ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Object cache: %lu blobs reused, %lu written, %lu trees reused\n",
+                ctx->obj_cache.hits, ctx->obj_cache.misses, ctx->obj_cache.tree_hits);
+    }
+
+    obj_cache_free(&ctx->obj_cache);
+    revmap_free(&ctx->revmap);
+    attrib_close(ctx);
+    snapshot_free(ctx);
+
+    sqlite3_free(sql_err);
+
+    git_commit_free(ctx->head);
+    ctx->head = NULL;
+
+    git_repository_free(repo);
+
+    if (ctx->repo_fd != -1)
+    {
+        close(ctx->repo_fd);
+        ctx->repo_fd = -1;
+    }
+
+    return ret;
+}
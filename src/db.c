@@ -0,0 +1,876 @@
+#include <errno.h>
+#include <string.h>     // strncpy, strcmp
+
+#include <unistd.h>     // close, pread
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Start a read transaction - everything read until `end_read()` then comes
+ * from the same snapshot of the database, whatever writers do meanwhile.
+ * The snapshot itself is taken by the first read.
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int begin_read(c9_ctx_t *ctx)
+{
+    char *sql_err = NULL;
+
+    if (sqlite3_exec(ctx->db, "BEGIN", NULL, NULL, &sql_err) != SQLITE_OK)
+    {
+        fprintf(stderr, "[ERROR] Failed to start reading '%s'\n", ctx->db_path);
+        fprintf(stderr, "[SQLERR] %s\n", sql_err);
+
+        sqlite3_free(sql_err);
+
+        return -1;
+    }
+
+    ctx->reading = 1;
+
+    return 0;
+}
+
+void end_read(c9_ctx_t *ctx)
+{
+    if (ctx->reading)
+    {
+        sqlite3_exec(ctx->db, "COMMIT", NULL, NULL, NULL);
+        ctx->reading = 0;
+    }
+}
+
+/*
+ * Returns the document with 'doc_id', or NULL if it was not loaded
+ */
+doc_t * find_doc(c9_ctx_t *ctx, int doc_id)
+{
+    doc_t *doc_list = ctx->doc_list;
+
+    // Document id's are 1-indexed in the database, and usually dense
+    if (doc_id >= 1 && doc_id <= ctx->doc_cnt && doc_list[doc_id - 1].id == doc_id)
+    {
+        return doc_list + doc_id - 1;
+    }
+
+    // Otherwise, 'doc_list' is still in ascending id order
+    int lo = 0;
+    int hi = (int)ctx->doc_cnt - 1;
+
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (doc_list[mid].id == doc_id)
+        {
+            return doc_list + mid;
+        }
+        else if (doc_list[mid].id < doc_id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Append a new document to 'doc_list'
+ */
+doc_t * push_doc(c9_ctx_t *ctx, int doc_id, const char *path, int rev_num)
+{
+    int path_len = strlen(path);
+
+    // Append doc directly to 'struct_pool'
+    // They will be contiguous, and managed elsewhere
+    doc_t *doc = (doc_t *)mem_push(&ctx->struct_pool, sizeof(doc_t));
+    doc->id = doc_id;
+    doc->rev_num = rev_num;
+    doc->rev_cnt = 0;
+    doc->revs_loaded = 0;
+
+    // Save paths will also be contiguous in 'string_pool'
+    // (can therefore also be accessed directly - null pointer separated)
+    doc->save_path = mem_push(&ctx->string_pool, path_len + 1);
+
+    // Revisions will get set later
+    doc->revisions = NULL;
+
+    // Store a copy of the relative save path
+    strncpy(doc->save_path, path, path_len + 1);
+
+    ctx->doc_cnt++;
+
+    return doc;
+}
+
+/* ========================================================================== */
+
+/*
+ * sqlite3 Callback Reference:
+ *   data      : Data provided in the 4th argument of `sqlite3_exec()`
+ *   col_cnt   : The number of columns in row
+ *   col_data  : An array of strings representing fields in the row
+ *   col_names : An array of strings representing column names
+ */
+
+/*
+ * Store some document data in memory
+ *
+ * Expects:
+ *   data to be the context
+ *   col_data[0] to be 'id'
+ *   col_data[1] to be 'path'
+ *   col_data[2] to be 'rev_num'
+ */
+static int load_doc_cb(void *ctx, int col_cnt, char **col_data, char **col_names)
+{
+    // Thanks to the SQL query, we can guarantee the file paths are in
+    // ascending document id order - which means they can be accessed
+    // directly by index later when using 'doc_list'
+    push_doc((c9_ctx_t *)ctx, atoi(col_data[0]), col_data[1], atoi(col_data[2]));
+
+    return 0;
+}
+
+/*
+ * Process each file revision
+ *   - Store revision data in memory
+ *
+ * Expects:
+ *   data to be the context
+ *   col_data[0] to be 'doc_id'
+ *   col_data[1] to be 'rev_num'
+ *   col_data[2] to be 'op'
+ */
+static int process_rev_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    c9_ctx_t *ctx = (c9_ctx_t *)data;
+
+    // WARNING : `col_data` will contain NULL pointers where there is no value stored
+    int doc_id  = atoi(col_data[0]);
+    int rev_num = atoi(col_data[1]);
+    char *op    = col_data[2];
+
+    // Thanks to the SQL query, we can guarantee the revisions are in
+    // ascending document id order, and per doc in ascending revision number.
+    // Should give better memory access when working with a given document.
+
+    // Skip "empty" revisions - generally the first for each document
+    if (strcmp(op, "[]") == 0)
+    {
+        return 0;
+    }
+
+    doc_t *doc = find_doc(ctx, doc_id);
+    if (!doc)
+    {
+        // Created since the document list was loaded - picked up once followed
+        if (ctx->opts.follow)
+        {
+            return 0;
+        }
+
+        fprintf(stderr, "[ERROR] Revision %d refers to unknown document %d\n", rev_num, doc_id);
+        return 1;
+    }
+
+    // Append rev directly to 'struct_pool'
+    // They will be contiguous, and managed elsewhere
+    rev_t *rev = (rev_t *)mem_push(&ctx->struct_pool, sizeof(rev_t));
+
+    rev->num = rev_num;
+    rev->block = -1;
+    rev->offset = 0;
+    rev->op = NULL;
+
+    // Get some temp mem for the parsing the op
+    // Sized in bytes - `length()` counts characters of text
+    int op_len = strlen(op) + 1;
+    char *parsed = mem_push(&ctx->scratch_pool, op_len);
+    int p_len = parse_op(op, parsed);
+
+    if (ctx->opts.compress)
+    {
+        // Packed in blocks of consecutive ops - see `rev_op()`
+        rev_store_append(ctx, doc_id, rev, parsed, p_len);
+    }
+    else
+    {
+        // Operation strings will also be contiguous in 'string_pool'
+        // Can therefore also be accessed directly
+        //   - whole operations are "null byte" separated
+        //   - operation instructions are "unit separator" separated
+        rev->op = mem_push(&ctx->string_pool, p_len);
+        strncpy(rev->op, parsed, p_len);
+    }
+
+    // Remember to clean up temp mem usage
+    mem_pop(&parsed, &ctx->scratch_pool, op_len);
+
+    // Point doc to the first revision
+    if (!doc->revisions)
+    {
+        doc->revisions = rev;
+    }
+    doc->rev_cnt++;
+
+    ctx->rev_cnt++;
+
+    return 0;
+}
+
+/*
+ * Copy a document's "final" contents into a buffer
+ *
+ * Expects:
+ *   data to be a c9_buf_t
+ *   col_data[0] to be 'contents'
+ *   col_data[1] to be 'content_len'
+ */
+static int load_contents_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    c9_buf_t *buf = (c9_buf_t *)data;
+    long content_len = col_data[0] ? atol(col_data[1]) : 0;
+
+    if (doc_buf_reserve(buf, content_len + 1) < 0)
+    {
+        return 1;
+    }
+
+    memcpy(buf->data, col_data[0] ? col_data[0] : "", content_len);
+    buf->len = content_len;
+
+    return 0;
+}
+
+/*
+ * Note a document's revision count
+ *
+ * Expects:
+ *   data to be the context
+ *   col_data[0] to be 'doc_id'
+ *   col_data[1] to be the number of non-empty revisions
+ */
+static int rev_count_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    doc_t *doc = find_doc((c9_ctx_t *)data, atoi(col_data[0]));
+
+    // Counted as loaded otherwise
+    if (doc && !doc->revs_loaded)
+    {
+        doc->rev_cnt = atoi(col_data[1]);
+    }
+
+    return 0;
+}
+
+/* ========================================================================== */
+
+/*
+ * Store every revision 'rev_query' selects, through `process_rev_cb()`
+ * Takes ownership of 'rev_query'.
+ */
+static int read_revisions(c9_ctx_t *ctx, char *rev_query)
+{
+    char *sql_err = NULL;
+
+    if (ctx->opts.compress)
+    {
+        // Staging area for the block currently being filled
+        ctx->rev_stage.buf = mem_push(&ctx->scratch_pool, REV_BLOCK_SIZE);
+    }
+
+    int res = sqlite3_exec(ctx->db, rev_query, process_rev_cb, ctx, &sql_err);
+    sqlite3_free(rev_query);
+
+    if (ctx->opts.compress)
+    {
+        rev_store_flush(ctx);
+        mem_pop(&ctx->rev_stage.buf, &ctx->scratch_pool, REV_BLOCK_SIZE);
+    }
+
+    if (res != SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to retrieve revisions from database\n");
+        fprintf(stderr, "[ERROR: SQL] %s\n", sql_err);
+
+        sqlite3_free(sql_err);
+
+        return C9_ESQL;
+    }
+
+    return C9_OK;
+}
+
+/*
+ * Load every revision into memory, if not done already
+ * Only a conversion needs them all - see `load_doc_revisions()`.
+ */
+int load_revisions(c9_ctx_t *ctx)
+{
+    if (ctx->revs_loaded)
+    {
+        return C9_OK;
+    }
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Importing revision data...\n");
+    }
+
+    // Documents already loaded on their own are loaded again, alongside
+    // the rest
+    for (doc_t *doc = ctx->doc_list; doc < ctx->doc_list + ctx->doc_cnt; doc++)
+    {
+        doc->revisions = NULL;
+        doc->rev_cnt = 0;
+        doc->revs_loaded = 0;
+    }
+
+    ctx->rev_cnt = 0;
+
+    // 'rev_list' array will be stored contiguously in 'struct_pool'
+    // and populated by the following sqlite3_exec()
+    // TODO : Implement better memory alignment
+    ctx->rev_list = (rev_t *)ctx->struct_pool.cur;
+
+    // Query to select relevant revision data - with optimal ordering
+    int res = read_revisions(ctx, sqlite3_mprintf("SELECT document_id AS doc_id, revNum AS rev_num, operation AS op FROM Revisions WHERE %s ORDER BY document_id ASC, revNum ASC", ctx->rev_where));
+
+    if (res != C9_OK)
+    {
+        return res;
+    }
+
+    if (ctx->opts.compress && ctx->opts.quiet == 0)
+    {
+        unsigned long packed = 0;
+        for (rev_block_t *block = ctx->block_list; block < ctx->block_list + ctx->block_cnt; block++)
+        {
+            packed += block->packed_len;
+        }
+
+        fprintf(stdout, "[INFO] Revision store: %u ops in %u blocks, %lu bytes packed from %lu\n",
+                ctx->rev_cnt, ctx->block_cnt, packed, ctx->rev_raw_bytes);
+    }
+
+    ctx->revs_loaded = 1;
+
+    // Not fatal - the next run just loads from the database again
+    // A journal always holds everything, so filtered loads aren't written
+    if (ctx->opts.journal && !ctx->opts.follow && !filters_set(ctx))
+    {
+        journal_write(ctx);
+    }
+
+    // Ends the transaction `c9_open()` started for the journal
+    if (!ctx->opts.follow)
+    {
+        end_read(ctx);
+    }
+
+    return C9_OK;
+}
+
+/*
+ * Load the revisions of 'doc' alone, if not done already - so a query on
+ * one document doesn't read every revision in the database
+ */
+int load_doc_revisions(c9_ctx_t *ctx, doc_t *doc)
+{
+    if (ctx->revs_loaded || doc->revs_loaded)
+    {
+        return C9_OK;
+    }
+
+    // Possibly just a count, from `c9_foreach_doc()`
+    doc->revisions = NULL;
+    doc->rev_cnt = 0;
+
+    int res = read_revisions(ctx, sqlite3_mprintf("SELECT document_id AS doc_id, revNum AS rev_num, operation AS op FROM Revisions WHERE document_id = %d AND %s ORDER BY revNum ASC", doc->id, ctx->rev_where));
+
+    if (res == C9_OK)
+    {
+        doc->revs_loaded = 1;
+    }
+
+    return res;
+}
+
+/*
+ * Note how many non-empty revisions each document has, without loading any
+ */
+static int count_revisions(c9_ctx_t *ctx)
+{
+    char *sql_err = NULL;
+    char *query = sqlite3_mprintf("SELECT document_id, COUNT(*) FROM Revisions WHERE operation != '[]' AND %s GROUP BY document_id", ctx->rev_where);
+
+    int res = sqlite3_exec(ctx->db, query, rev_count_cb, ctx, &sql_err);
+    sqlite3_free(query);
+
+    if (res != SQLITE_OK)
+    {
+        fprintf(stderr, "[ERROR] Failed to count revisions\n");
+        fprintf(stderr, "[SQLERR] %s\n", sql_err);
+
+        sqlite3_free(sql_err);
+
+        return C9_ESQL;
+    }
+
+    return C9_OK;
+}
+
+/*
+ * Read the current contents of 'doc' from the database
+ * Contents are read as a blob, straight into 'contents', rather than copied
+ * out of a result row. Only documents without any contents (NULL) go
+ * through a query.
+ */
+int load_contents(c9_ctx_t *ctx, doc_t *doc, c9_buf_t *contents)
+{
+    char *sql_err = NULL;
+    sqlite3_blob *blob;
+
+    contents->len = 0;
+
+    if (ctx->journal)
+    {
+        return journal_contents(ctx, doc, contents);
+    }
+
+    if (sqlite3_blob_open(ctx->db, "main", "Documents", "contents", doc->id, 0, &blob) == SQLITE_OK)
+    {
+        int len = sqlite3_blob_bytes(blob);
+        int res = doc_buf_reserve(contents, len + 1) < 0 ? SQLITE_NOMEM : SQLITE_OK;
+
+        if (res == SQLITE_OK && len)
+        {
+            res = sqlite3_blob_read(blob, contents->data, len, 0);
+        }
+
+        sqlite3_blob_close(blob);
+
+        if (res != SQLITE_OK)
+        {
+            fprintf(stderr, "[ERROR] Failed to read contents of '%s' : %s\n", doc->save_path, sqlite3_errstr(res));
+            return C9_ESQL;
+        }
+
+        contents->len = len;
+
+        return C9_OK;
+    }
+
+    // Byte length, as `length()` counts characters of text
+    char *query = sqlite3_mprintf("SELECT contents, length(CAST(contents AS BLOB)) AS content_len FROM Documents WHERE id = %d", doc->id);
+
+    int res = sqlite3_exec(ctx->db, query, load_contents_cb, contents, &sql_err);
+    sqlite3_free(query);
+
+    if (res != SQLITE_OK)
+    {
+        fprintf(stderr, "[ERROR] Failed to retrieve contents of '%s'\n", doc->save_path);
+        fprintf(stderr, "[SQLERR] %s\n", sql_err);
+
+        sqlite3_free(sql_err);
+
+        return C9_ESQL;
+    }
+
+    return C9_OK;
+}
+
+/* ========================================================================== */
+
+C9_API void c9_options_init(c9_options_t *opts)
+{
+    opts->quiet = 0;
+    opts->compress = 0;
+    opts->keyframe_interval = 0;
+    opts->bare = 0;
+    opts->checkout = 0;
+    opts->branches = 0;
+    opts->follow = 0;
+    opts->pipeline = 0;
+    opts->follow_interval = 0;
+    opts->journal = NULL;
+    opts->optimize = 0;
+    opts->attribution = 0;
+    opts->snapshot = 0;
+    opts->graft = 0;
+    opts->include = NULL;
+    opts->include_cnt = 0;
+    opts->exclude = NULL;
+    opts->exclude_cnt = 0;
+    opts->since_rev = 0;
+    opts->since_time = 0;
+    opts->encode_threads = 0;
+    opts->compression_level = -1;
+    opts->mem_size = 0;
+}
+
+C9_API int c9_open(c9_ctx_t **out, const char *db_path, const c9_options_t *opts)
+{
+    *out = NULL;
+
+    c9_ctx_t *ctx = calloc(1, sizeof(c9_ctx_t));
+    if (!ctx)
+    {
+        return C9_ENOMEM;
+    }
+
+    if (opts)
+    {
+        ctx->opts = *opts;
+    }
+    else
+    {
+        c9_options_init(&ctx->opts);
+    }
+
+    if (ctx->opts.checkout || ctx->opts.branches || ctx->opts.follow || ctx->opts.pipeline
+        || ctx->opts.attribution || ctx->opts.snapshot)
+    {
+        ctx->opts.bare = 1;
+    }
+
+    if (ctx->opts.follow_interval <= 0)
+    {
+        ctx->opts.follow_interval = FOLLOW_INTERVAL;
+    }
+
+    ctx->repo_fd = -1;
+    ctx->kf_fd = -1;
+
+    unsigned long mem_size = ctx->opts.mem_size ? ctx->opts.mem_size : MEM_SIZE;
+
+    // Initialise main memory, and split it into sub-pools
+    if (mem_alloc(&ctx->mem, mem_size) != 0)
+    {
+        free(ctx);
+        return C9_ENOMEM;
+    }
+
+    mem_sub_alloc(&ctx->mem, &ctx->struct_pool, mem_size / 4);
+    mem_sub_alloc(&ctx->mem, &ctx->string_pool, mem_size / 4);
+    mem_sub_alloc(&ctx->mem, &ctx->scratch_pool, mem_size / 4);
+    mem_sub_alloc(&ctx->mem, &ctx->block_pool, mem_size / 32);
+
+    ctx->block_list = (rev_block_t *)ctx->block_pool.cur;
+
+    // Keep a copy of the path, for sidecar files
+    ctx->db_path = mem_push(&ctx->string_pool, strlen(db_path) + 1);
+    strcpy(ctx->db_path, db_path);
+
+    // libgit2 keeps a reference count, so every context can do this
+    git_libgit2_init();
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Open database: %s\n", db_path);
+    }
+
+    if (sqlite3_open_v2(db_path, &ctx->db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to open %s : %s\n", db_path, sqlite3_errmsg(ctx->db));
+        c9_close(ctx);
+        return C9_EIO;
+    }
+
+    if (filter_init(ctx) < 0)
+    {
+        c9_close(ctx);
+        return C9_ENOMEM;
+    }
+
+    // A journal is checked against, or written from, one snapshot of the
+    // database - documents, revisions and contents alike. Held until
+    // revisions are loaded.
+    if (ctx->opts.journal && !ctx->opts.follow && begin_read(ctx) < 0)
+    {
+        c9_close(ctx);
+        return C9_ESQL;
+    }
+
+    // Following carries on from exactly what the document list (and later,
+    // revisions and contents) are read from
+    if (ctx->opts.follow && follow_snapshot(ctx) < 0)
+    {
+        c9_close(ctx);
+        return C9_ESQL;
+    }
+
+    // Following reads from the database itself, and a journal has no
+    // 'created_at' to filter on
+    if (ctx->opts.journal && !ctx->opts.follow && ctx->opts.since_time == 0 && journal_load(ctx) == 0)
+    {
+        end_read(ctx);
+
+        *out = ctx;
+        return C9_OK;
+    }
+
+    char *sql_err = NULL;
+
+    // 'doc_list' array will be stored contiguously in 'struct_pool'
+    // and populated by the following sqlite3_exec()
+    ctx->doc_list = (doc_t *)ctx->struct_pool.cur;
+
+    char *doc_query = sqlite3_mprintf("SELECT id, path, revNum AS rev_num FROM Documents WHERE %s ORDER BY id ASC", ctx->doc_where);
+
+    int res = sqlite3_exec(ctx->db, doc_query, load_doc_cb, ctx, &sql_err);
+    sqlite3_free(doc_query);
+
+    if (res != SQLITE_OK)
+    {
+        fprintf(stderr, "[ERROR] Failed to retrieve target filenames from database\n");
+        fprintf(stderr, "[SQLERR] %s\n", sql_err);
+
+        sqlite3_free(sql_err);
+        c9_close(ctx);
+
+        return C9_ESQL;
+    }
+
+    *out = ctx;
+
+    return C9_OK;
+}
+
+C9_API void c9_close(c9_ctx_t *ctx)
+{
+    if (!ctx)
+    {
+        return;
+    }
+
+    keyframe_close(ctx);
+    end_read(ctx);
+
+    git_commit_free(ctx->head);
+    filter_free(ctx);
+    sqlite3_close(ctx->db);
+    journal_close(ctx);
+
+    // Clean up libgit2 global state, once the last context is gone
+    git_libgit2_shutdown();
+
+    c9_buf_free(&ctx->contents);
+    c9_buf_free(&ctx->spare);
+    rev_cache_free(&ctx->rev_cache);
+    mem_free(&ctx->mem);
+
+    free(ctx);
+}
+
+static void doc_info(doc_t *doc, c9_doc_info_t *info)
+{
+    info->id = doc->id;
+    info->path = doc->save_path;
+    info->rev_num = doc->rev_num;
+    info->rev_cnt = doc->rev_cnt;
+}
+
+C9_API int c9_foreach_doc(c9_ctx_t *ctx, c9_doc_cb cb, void *data)
+{
+    // Counted, rather than loaded, unless a conversion already has
+    int res = ctx->revs_loaded ? C9_OK : count_revisions(ctx);
+    if (res != C9_OK)
+    {
+        return res;
+    }
+
+    for (doc_t *doc = ctx->doc_list; doc < ctx->doc_list + ctx->doc_cnt; doc++)
+    {
+        c9_doc_info_t info;
+        doc_info(doc, &info);
+
+        if ((res = cb(&info, data)) != 0)
+        {
+            return res;
+        }
+    }
+
+    return C9_OK;
+}
+
+C9_API int c9_find_doc(c9_ctx_t *ctx, const char *path, c9_doc_info_t *out)
+{
+    // Accept paths as they appear in commit messages
+    if (strncmp(path, "./", 2) == 0)
+    {
+        path += 2;
+    }
+
+    for (doc_t *doc = ctx->doc_list; doc < ctx->doc_list + ctx->doc_cnt; doc++)
+    {
+        if (strcmp(doc->save_path, path) == 0)
+        {
+            // For its revision count
+            int res = load_doc_revisions(ctx, doc);
+            if (res == C9_OK)
+            {
+                doc_info(doc, out);
+            }
+
+            return res;
+        }
+    }
+
+    fprintf(stderr, "[ERROR] No document '%s' in database\n", path);
+
+    return C9_EUSAGE;
+}
+
+C9_API int c9_foreach_rev(c9_ctx_t *ctx, int doc_id, c9_rev_cb cb, void *data)
+{
+    doc_t *doc = find_doc(ctx, doc_id);
+    if (!doc)
+    {
+        fprintf(stderr, "[ERROR] No document with id %d in database\n", doc_id);
+        return C9_EUSAGE;
+    }
+
+    int res = load_doc_revisions(ctx, doc);
+    if (res != C9_OK)
+    {
+        return res;
+    }
+
+    for (int i = 0; i < doc->rev_cnt; i++)
+    {
+        rev_t *rev = doc->revisions + i;
+
+        c9_rev_info_t info;
+        info.doc_id = doc_id;
+        info.num = rev->num;
+        info.op = rev_op(ctx, &ctx->rev_cache, rev);
+
+        if (!info.op)
+        {
+            return C9_EREPLAY;
+        }
+
+        if ((res = cb(&info, data)) != 0)
+        {
+            return res;
+        }
+    }
+
+    return C9_OK;
+}
+
+C9_API int c9_materialize(c9_ctx_t *ctx, int doc_id, int rev_num, c9_buf_t *out)
+{
+    // Only part of the history is loaded - states would be rebuilt, and
+    // keyframes cached, from the wrong starting point
+    if (ctx->opts.since_rev > 0 || ctx->opts.since_time > 0)
+    {
+        fprintf(stderr, "[ERROR] Documents can't be materialized with revision filters set\n");
+        return C9_EUSAGE;
+    }
+
+    doc_t *doc = find_doc(ctx, doc_id);
+    if (!doc)
+    {
+        fprintf(stderr, "[ERROR] No document with id %d in database\n", doc_id);
+        return C9_EUSAGE;
+    }
+
+    int res = load_doc_revisions(ctx, doc);
+    if (res != C9_OK)
+    {
+        return res;
+    }
+
+    if (rev_num < 0 || rev_num > doc->rev_num)
+    {
+        fprintf(stderr, "[ERROR] '%s' has no revision %d (latest is %d)\n", doc->save_path, rev_num, doc->rev_num);
+        return C9_EUSAGE;
+    }
+
+    int applied = revs_applied_at(doc, rev_num);
+    int resume = out->data && out->doc_id == doc_id && out->applied <= applied;
+    int from;
+
+    // Only valid again once replay succeeds
+    out->doc_id = 0;
+
+    if (resume)
+    {
+        // Continue on from the previous call
+        from = out->applied;
+    }
+    else if (ctx->opts.keyframe_interval > 0)
+    {
+        int interval = ctx->opts.keyframe_interval;
+
+        if (ctx->kf_fd == -1 && keyframe_open(ctx, interval) < 0)
+        {
+            return C9_EIO;
+        }
+
+        keyframe_t kf;
+        if (keyframe_find(ctx, doc, applied, &kf) == 0)
+        {
+            if (!history_resets(ctx, &ctx->rev_cache, doc) && (res = load_contents(ctx, doc, &ctx->contents)) != C9_OK)
+            {
+                return res;
+            }
+
+            if (keyframe_build(ctx, doc, &ctx->contents, interval) < 0)
+            {
+                return C9_EREPLAY;
+            }
+            keyframe_find(ctx, doc, applied, &kf);
+        }
+
+        if (kf.applied < 0 || doc_buf_reserve(out, kf.len + 1) < 0)
+        {
+            return C9_EIO;
+        }
+
+        if (pread(ctx->kf_fd, out->data, kf.len, kf.offset) != kf.len)
+        {
+            fprintf(stderr, "[ERROR %d] Failed to read keyframe for '%s'\n", errno, doc->save_path);
+            return C9_EIO;
+        }
+        out->len = kf.len;
+
+        from = kf.applied;
+    }
+    else
+    {
+        // Rebuild from the very start of the document's history
+        if (!history_resets(ctx, &ctx->rev_cache, doc) && (res = load_contents(ctx, doc, out)) != C9_OK)
+        {
+            return res;
+        }
+
+        if (initial_state(ctx, &ctx->rev_cache, doc, out, &ctx->spare, out) < 0)
+        {
+            return C9_EREPLAY;
+        }
+
+        from = 0;
+    }
+
+    if (replay_doc(ctx, &ctx->rev_cache, doc, out, &ctx->spare, from, applied) < 0)
+    {
+        return C9_EREPLAY;
+    }
+
+    out->doc_id = doc_id;
+    out->applied = applied;
+
+    return C9_OK;
+}
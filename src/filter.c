@@ -0,0 +1,153 @@
+#include <fnmatch.h>    // fnmatch
+#include <string.h>     // strlen, strncmp
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Path and revision filters
+ *
+ * Filters are compiled once into SQL conditions, so sqlite skips filtered
+ * documents and revisions itself:
+ *
+ *   doc_where : on Documents - the path globs
+ *   rev_where : on Revisions - revNum, created_at, and the path globs by way
+ *               of a sub-select on Documents
+ *
+ * Anything not read through those queries (a revision journal) is filtered
+ * with `path_included()` and `rev_included()` instead.
+ *
+ * Globs follow sqlite's GLOB, which `fnmatch()` without FNM_PATHNAME agrees
+ * with: '*' also matches '/'. A pattern ending in '/' matches everything
+ * below that directory.
+ */
+
+static void append_glob(sqlite3_str *sql, const char *pattern)
+{
+    size_t len = strlen(pattern);
+
+    if (len && pattern[len - 1] == '/')
+    {
+        sqlite3_str_appendf(sql, "path GLOB '%q*'", pattern);
+    }
+    else
+    {
+        sqlite3_str_appendf(sql, "path GLOB %Q", pattern);
+    }
+}
+
+static int glob_match(const char *pattern, const char *path)
+{
+    size_t len = strlen(pattern);
+
+    if (len && pattern[len - 1] == '/')
+    {
+        return strncmp(pattern, path, len) == 0;
+    }
+
+    return fnmatch(pattern, path, 0) == 0;
+}
+
+int filters_set(c9_ctx_t *ctx)
+{
+    return ctx->opts.include_cnt || ctx->opts.exclude_cnt
+        || ctx->opts.since_rev > 0 || ctx->opts.since_time > 0;
+}
+
+/*
+ * Build 'doc_where' and 'rev_where' from the options
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int filter_init(c9_ctx_t *ctx)
+{
+    c9_options_t *opts = &ctx->opts;
+    sqlite3_str *sql = sqlite3_str_new(ctx->db);
+
+    sqlite3_str_appendall(sql, "1");
+
+    for (int i = 0; i < opts->include_cnt; i++)
+    {
+        sqlite3_str_appendall(sql, i == 0 ? " AND (" : " OR ");
+        append_glob(sql, opts->include[i]);
+    }
+
+    if (opts->include_cnt)
+    {
+        sqlite3_str_appendall(sql, ")");
+    }
+
+    for (int i = 0; i < opts->exclude_cnt; i++)
+    {
+        sqlite3_str_appendall(sql, " AND NOT ");
+        append_glob(sql, opts->exclude[i]);
+    }
+
+    ctx->doc_where = sqlite3_str_finish(sql);
+
+    sql = sqlite3_str_new(ctx->db);
+    sqlite3_str_appendall(sql, "1");
+
+    if (opts->since_rev > 0)
+    {
+        sqlite3_str_appendf(sql, " AND revNum > %d", opts->since_rev);
+    }
+
+    // c9 records created_at in milliseconds
+    if (opts->since_time > 0)
+    {
+        sqlite3_str_appendf(sql, " AND created_at >= %lld", opts->since_time * 1000LL);
+    }
+
+    if (opts->include_cnt || opts->exclude_cnt)
+    {
+        sqlite3_str_appendf(sql, " AND document_id IN (SELECT id FROM Documents WHERE %s)", ctx->doc_where);
+    }
+
+    ctx->rev_where = sqlite3_str_finish(sql);
+
+    return ctx->doc_where && ctx->rev_where ? 0 : -1;
+}
+
+void filter_free(c9_ctx_t *ctx)
+{
+    sqlite3_free(ctx->doc_where);
+    sqlite3_free(ctx->rev_where);
+
+    ctx->doc_where = NULL;
+    ctx->rev_where = NULL;
+}
+
+/* ========================================================================== */
+
+/*
+ * Returns 1 if a document at 'path' passes the path filters
+ */
+int path_included(c9_ctx_t *ctx, const char *path)
+{
+    c9_options_t *opts = &ctx->opts;
+    int included = opts->include_cnt == 0;
+
+    for (int i = 0; i < opts->include_cnt && !included; i++)
+    {
+        included = glob_match(opts->include[i], path);
+    }
+
+    for (int i = 0; i < opts->exclude_cnt && included; i++)
+    {
+        included = !glob_match(opts->exclude[i], path);
+    }
+
+    return included;
+}
+
+/*
+ * Returns 1 if revision 'rev_num' passes the revision filters
+ * 'since_time' can't be checked here, for want of 'created_at'
+ */
+int rev_included(c9_ctx_t *ctx, int rev_num)
+{
+    return rev_num > ctx->opts.since_rev;
+}
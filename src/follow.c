@@ -0,0 +1,798 @@
+#include <string.h>     // memcpy, strcmp, strdup
+#include <time.h>       // clock_gettime, nanosleep
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Follow mode
+ *
+ * After the initial conversion, the database is polled for newly appended
+ * Revisions rows. Polls are gated on `PRAGMA data_version`, which only
+ * changes once another connection commits, and rows are then picked up by
+ * rowid - past the last row seen. Documents created without any revisions
+ * are picked up by id, past the last document seen.
+ *
+ * The initial conversion runs inside a single read transaction (see
+ * `follow_snapshot()`), from before the document list is loaded, so its
+ * documents, revisions and contents agree, and 'follow_rowid' and
+ * 'follow_doc_id' mark exactly where it stopped. Each poll is a single read
+ * transaction too.
+ *
+ * Each document's state is only brought into memory once it sees a new
+ * revision, from the tree at HEAD. It then stays there, for later revisions.
+ */
+
+typedef struct follow_doc {
+    int id;
+    char *path;
+    int owned;              // 'path' was allocated here, rather than by `push_doc()`
+    int loaded;
+    c9_buf_t state;
+} follow_doc_t;
+
+typedef struct follow_stats {
+    unsigned long polls;
+    unsigned long revs;
+    unsigned long lat_cnt;
+    double lat_sum;
+    double lat_max;
+} follow_stats_t;
+
+typedef struct follow {
+    c9_ctx_t *ctx;
+    git_repository *repo;
+
+    follow_doc_t *docs;     // Ascending id order
+    int doc_cnt;
+    int doc_cap;
+
+    c9_buf_t spare;
+
+    double last_poll;       // When the previous poll ran, in ms
+    double revmap_written;  // When the revision map last was, in ms
+    int revmap_stale;       // Commits made since
+    follow_stats_t batch;
+    follow_stats_t total;
+
+    int error;
+} follow_t;
+
+// A c9 created_at before this (2001-09-09) isn't a millisecond timestamp
+#define FOLLOW_MIN_EPOCH_MS 1e12
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* ========================================================================== */
+
+/*
+ * Expects:
+ *   data to be a long long
+ *   col_data[0] to be a single integer, or NULL
+ */
+static int read_int_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    *(long long *)data = col_data[0] ? atoll(col_data[0]) : 0;
+
+    return 0;
+}
+
+/*
+ * Expects:
+ *   data to be a char * to set
+ *   col_data[0] to be 'path'
+ */
+static int read_path_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    char **path = (char **)data;
+
+    if (col_data[0] && !*path)
+    {
+        *path = strdup(col_data[0]);
+    }
+
+    return 0;
+}
+
+static int query_int(c9_ctx_t *ctx, const char *query, long long *out)
+{
+    char *sql_err = NULL;
+
+    if (sqlite3_exec(ctx->db, query, read_int_cb, out, &sql_err) != SQLITE_OK)
+    {
+        fprintf(stderr, "[ERROR] Follow query failed: %s\n", query);
+        fprintf(stderr, "[SQLERR] %s\n", sql_err);
+
+        sqlite3_free(sql_err);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ========================================================================== */
+
+/*
+ * Start the read transaction the initial conversion runs in, and note the
+ * last revision and document it will see
+ * Called by `c9_open()`, before the document list is loaded.
+ */
+int follow_snapshot(c9_ctx_t *ctx)
+{
+    // Writers may briefly hold the database during a checkpoint
+    sqlite3_busy_timeout(ctx->db, FOLLOW_BUSY_TIMEOUT);
+
+    if (begin_read(ctx) < 0
+        || query_int(ctx, "SELECT MAX(rowid) FROM Revisions", &ctx->follow_rowid) < 0
+        || query_int(ctx, "SELECT MAX(id) FROM Documents", &ctx->follow_doc_id) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to start reading '%s'\n", ctx->db_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static follow_doc_t * find_follow_doc(follow_t *f, int doc_id)
+{
+    int lo = 0;
+    int hi = f->doc_cnt - 1;
+
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (f->docs[mid].id == doc_id)
+        {
+            return f->docs + mid;
+        }
+        else if (f->docs[mid].id < doc_id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Add a document, keeping 'docs' in id order
+ */
+static follow_doc_t * insert_follow_doc(follow_t *f, int doc_id, char *path, int owned)
+{
+    if (f->doc_cnt == f->doc_cap)
+    {
+        int cap = f->doc_cap ? f->doc_cap * 2 : 64;
+        follow_doc_t *docs = realloc(f->docs, cap * sizeof(follow_doc_t));
+        if (!docs)
+        {
+            return NULL;
+        }
+
+        f->docs = docs;
+        f->doc_cap = cap;
+    }
+
+    // New documents almost always have the highest id yet
+    int i = f->doc_cnt;
+    while (i > 0 && f->docs[i - 1].id > doc_id)
+    {
+        f->docs[i] = f->docs[i - 1];
+        i--;
+    }
+
+    follow_doc_t *doc = f->docs + i;
+    memset(doc, 0, sizeof(follow_doc_t));
+    doc->id = doc_id;
+    doc->path = path;
+    doc->owned = owned;
+
+    f->doc_cnt++;
+
+    return doc;
+}
+
+/*
+ * Bring a document's last committed state in from the tree at HEAD
+ * A document with no commits yet starts from its stored contents.
+ */
+static int load_follow_doc(follow_t *f, follow_doc_t *fdoc)
+{
+    c9_ctx_t *ctx = f->ctx;
+    git_tree *tree = NULL;
+    git_tree_entry *entry = NULL;
+    git_blob *blob = NULL;
+    int ret = 0;
+
+    fdoc->state.len = 0;
+
+    if (git_commit_tree(&tree, ctx->head) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not look up tree at HEAD\n");
+        return -1;
+    }
+
+    if (git_tree_entry_bypath(&entry, tree, fdoc->path) == 0)
+    {
+        if (git_blob_lookup(&blob, f->repo, git_tree_entry_id(entry)) < 0)
+        {
+            fprintf(stderr, "[ERROR] Could not look up blob for '%s'\n", fdoc->path);
+            ret = -1;
+        }
+        else
+        {
+            long len = (long)git_blob_rawsize(blob);
+
+            if (doc_buf_reserve(&fdoc->state, len + 1) < 0)
+            {
+                ret = -1;
+            }
+            else
+            {
+                memcpy(fdoc->state.data, git_blob_rawcontent(blob), len);
+                fdoc->state.len = len;
+            }
+        }
+    }
+    else
+    {
+        doc_t *doc = find_doc(ctx, fdoc->id);
+
+        if (doc && load_contents(ctx, doc, &fdoc->state) != C9_OK)
+        {
+            ret = -1;
+        }
+    }
+
+    git_blob_free(blob);
+    git_tree_entry_free(entry);
+    git_tree_free(tree);
+
+    fdoc->loaded = (ret == 0);
+
+    return ret;
+}
+
+static int commit_follow_doc(follow_t *f, follow_doc_t *fdoc, int rev_num)
+{
+    obj_cache_t *cache = &f->ctx->obj_cache;
+    c9_buf_t *state = &fdoc->state;
+    git_oid blob_id;
+
+    uint64_t hash = content_hash(state->data, state->len);
+
+    if (!blob_cache_find(cache, hash, state->data, state->len, &blob_id))
+    {
+        if (git_blob_create_from_buffer(&blob_id, f->repo, state->data, state->len) < 0)
+        {
+            fprintf(stderr, "[ERROR] Failed to write blob for '%s' [rev: %d]\n", fdoc->path, rev_num);
+            return -1;
+        }
+
+        BYTE *copy = malloc(state->len + 1);
+        if (copy)
+        {
+            memcpy(copy, state->data, state->len);
+            blob_cache_add(cache, hash, copy, state->len, &blob_id);
+        }
+    }
+
+    return add_oid_and_commit(f->ctx, f->repo, fdoc->id, fdoc->path, &blob_id, rev_num);
+}
+
+/*
+ * Apply a single parsed op to a document, and commit the result
+ */
+static int commit_follow_rev(follow_t *f, follow_doc_t *fdoc, rev_t *rev)
+{
+    if (apply_rev(f->ctx, &f->ctx->rev_cache, &f->spare, &fdoc->state, rev, false) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to apply revision %d to '%s'\n", rev->num, fdoc->path);
+        return -1;
+    }
+
+    c9_buf_t tmp = fdoc->state;
+    fdoc->state = f->spare;
+    f->spare = tmp;
+
+    return commit_follow_doc(f, fdoc, rev->num);
+}
+
+/* ========================================================================== */
+
+/*
+ * A document created since the initial conversion
+ * Its history is collected in full, then every revision ahead of 'rowid'
+ * (and so, not yet seen by the poll) is committed.
+ */
+
+typedef struct new_doc_revs {
+    rev_t *revisions;
+    long long *rowids;
+    int cnt;
+    int cap;
+} new_doc_revs_t;
+
+/*
+ * Expects:
+ *   data to be a new_doc_revs_t
+ *   col_data[0] to be 'rowid'
+ *   col_data[1] to be 'rev_num'
+ *   col_data[2] to be 'op'
+ */
+static int new_doc_rev_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    new_doc_revs_t *revs = (new_doc_revs_t *)data;
+
+    if (!col_data[2] || strcmp(col_data[2], "[]") == 0)
+    {
+        return 0;
+    }
+
+    if (revs->cnt == revs->cap)
+    {
+        int cap = revs->cap ? revs->cap * 2 : 16;
+        rev_t *revisions = realloc(revs->revisions, cap * sizeof(rev_t));
+        if (revisions)
+        {
+            revs->revisions = revisions;
+        }
+
+        long long *rowids = realloc(revs->rowids, cap * sizeof(long long));
+        if (rowids)
+        {
+            revs->rowids = rowids;
+        }
+
+        if (!revisions || !rowids)
+        {
+            return 1;
+        }
+
+        revs->cap = cap;
+    }
+
+    // Parsing never lengthens an op
+    char *parsed = malloc(strlen(col_data[2]) + 1);
+    if (!parsed)
+    {
+        return 1;
+    }
+
+    parse_op(col_data[2], parsed);
+
+    rev_t *rev = revs->revisions + revs->cnt;
+    rev->num = atoi(col_data[1]);
+    rev->block = -1;
+    rev->offset = 0;
+    rev->op = parsed;
+
+    revs->rowids[revs->cnt] = atoll(col_data[0]);
+    revs->cnt++;
+
+    return 0;
+}
+
+static follow_doc_t * add_new_doc(follow_t *f, int doc_id, long long rowid)
+{
+    c9_ctx_t *ctx = f->ctx;
+    char *path = NULL;
+    char *sql_err = NULL;
+
+    char *query = sqlite3_mprintf("SELECT path FROM Documents WHERE id = %d", doc_id);
+    sqlite3_exec(ctx->db, query, read_path_cb, &path, NULL);
+    sqlite3_free(query);
+
+    if (!path)
+    {
+        fprintf(stderr, "[ERROR] Revision refers to unknown document %d\n", doc_id);
+        return NULL;
+    }
+
+    follow_doc_t *fdoc = insert_follow_doc(f, doc_id, path, true);
+    if (!fdoc)
+    {
+        free(path);
+        return NULL;
+    }
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Follow new document '%s'...\n", path);
+    }
+
+    // Still within the poll's read, so this agrees with the stored contents
+    new_doc_revs_t revs = {0};
+    query = sqlite3_mprintf("SELECT rowid, revNum, operation FROM Revisions WHERE document_id = %d AND %s ORDER BY revNum ASC",
+                            doc_id, ctx->rev_where);
+
+    int res = sqlite3_exec(ctx->db, query, new_doc_rev_cb, &revs, &sql_err);
+    sqlite3_free(query);
+
+    doc_t doc = {0};
+    doc.id = doc_id;
+    doc.save_path = path;
+    doc.revisions = revs.revisions;
+    doc.rev_cnt = revs.cnt;
+
+    if (res != SQLITE_OK)
+    {
+        fprintf(stderr, "[ERROR] Failed to retrieve revisions of '%s'\n", path);
+        fprintf(stderr, "[SQLERR] %s\n", sql_err);
+        fdoc = NULL;
+    }
+    else if ((!history_resets(ctx, &ctx->rev_cache, &doc) && load_contents(ctx, &doc, &fdoc->state) != C9_OK)
+             || initial_state(ctx, &ctx->rev_cache, &doc, &fdoc->state, &f->spare, &fdoc->state) < 0)
+    {
+        fdoc = NULL;
+    }
+    else if (revs.cnt == 0)
+    {
+        // Revisionless doc, as in `process_revisions_bare()`
+        fdoc->loaded = true;
+
+        if (commit_follow_doc(f, fdoc, 0) < 0)
+        {
+            fdoc = NULL;
+        }
+    }
+    else
+    {
+        fdoc->loaded = true;
+
+        for (int i = 0; i < revs.cnt && revs.rowids[i] < rowid; i++)
+        {
+            if (commit_follow_rev(f, fdoc, revs.revisions + i) < 0)
+            {
+                fdoc = NULL;
+                break;
+            }
+
+            f->batch.revs++;
+        }
+    }
+
+    for (int i = 0; i < revs.cnt; i++)
+    {
+        free(revs.revisions[i].op);
+    }
+
+    free(revs.revisions);
+    free(revs.rowids);
+    sqlite3_free(sql_err);
+
+    return fdoc;
+}
+
+/* ========================================================================== */
+
+/*
+ * Replay a newly appended revision, and commit it
+ *
+ * Expects:
+ *   data to be a follow_t
+ *   col_data[0] to be 'rowid'
+ *   col_data[1] to be 'doc_id'
+ *   col_data[2] to be 'rev_num'
+ *   col_data[3] to be 'op'
+ *   col_data[4] to be 'created_at'
+ */
+static int follow_rev_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    follow_t *f = (follow_t *)data;
+    c9_ctx_t *ctx = f->ctx;
+
+    long long rowid = atoll(col_data[0]);
+    int doc_id = atoi(col_data[1]);
+    char *op = col_data[3];
+
+    follow_doc_t *fdoc = find_follow_doc(f, doc_id);
+
+    if (!fdoc && !(fdoc = add_new_doc(f, doc_id, rowid)))
+    {
+        f->error = -1;
+        return 1;
+    }
+
+    // Skip "empty" revisions
+    if (op && strcmp(op, "[]") != 0)
+    {
+        if (!fdoc->loaded && load_follow_doc(f, fdoc) < 0)
+        {
+            f->error = -1;
+            return 1;
+        }
+
+        int op_len = strlen(op) + 1;
+        char *parsed = mem_push(&ctx->scratch_pool, op_len);
+        parse_op(op, parsed);
+
+        rev_t rev = {0};
+        rev.num = atoi(col_data[2]);
+        rev.block = -1;
+        rev.op = parsed;
+
+        int res = commit_follow_rev(f, fdoc, &rev);
+
+        mem_pop(&parsed, &ctx->scratch_pool, op_len);
+
+        if (res < 0)
+        {
+            f->error = -1;
+            return 1;
+        }
+
+        // From when the row was written, where c9 recorded it - otherwise
+        // from the previous poll, which didn't see it yet
+        double now = now_ms();
+        double landed = col_data[4] ? atof(col_data[4]) : 0;
+
+        if (landed < FOLLOW_MIN_EPOCH_MS || landed > now)
+        {
+            landed = f->last_poll;
+        }
+
+        double latency = now - landed;
+
+        f->batch.lat_sum += latency;
+        f->batch.lat_cnt++;
+        if (latency > f->batch.lat_max)
+        {
+            f->batch.lat_max = latency;
+        }
+
+        f->batch.revs++;
+    }
+
+    ctx->follow_rowid = rowid;
+
+    return 0;
+}
+
+/*
+ * Commit a document created since the last poll without any revisions
+ *
+ * Expects:
+ *   data to be a follow_t
+ *   col_data[0] to be 'id'
+ */
+static int follow_new_doc_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    follow_t *f = (follow_t *)data;
+    c9_ctx_t *ctx = f->ctx;
+
+    int doc_id = atoi(col_data[0]);
+
+    // Any with revisions were already added, as those came in
+    if (!find_follow_doc(f, doc_id) && !add_new_doc(f, doc_id, ctx->follow_rowid + 1))
+    {
+        f->error = -1;
+        return 1;
+    }
+
+    if (doc_id > ctx->follow_doc_id)
+    {
+        ctx->follow_doc_id = doc_id;
+    }
+
+    return 0;
+}
+
+static void print_stats(const char *label, follow_stats_t *stats)
+{
+    fprintf(stdout, "[INFO] %s: %lu revisions committed, latency avg %.1f ms, max %.1f ms\n",
+            label, stats->revs,
+            stats->lat_cnt ? stats->lat_sum / stats->lat_cnt : 0.0, stats->lat_max);
+}
+
+/*
+ * Commit every revision and document added since the last poll
+ * Returns:
+ *  0 : Success
+ *  1 : Not everything could be read (most likely a writer holding the
+ *      database) - poll again, whether or not anything else is committed
+ * <0 : Failure
+ */
+static int follow_poll(follow_t *f)
+{
+    c9_ctx_t *ctx = f->ctx;
+    char *sql_err = NULL;
+
+    memset(&f->batch, 0, sizeof(follow_stats_t));
+
+    // Both queries see the same rows, so a new document is either found
+    // through its revisions, or has none yet
+    if (begin_read(ctx) < 0)
+    {
+        return 1;
+    }
+
+    // Filtered documents never reach `add_new_doc()`
+    char *query = sqlite3_mprintf("SELECT rowid, document_id, revNum, operation, created_at FROM Revisions WHERE rowid > %lld AND %s ORDER BY rowid ASC",
+                                  ctx->follow_rowid, ctx->rev_where);
+
+    int res = sqlite3_exec(ctx->db, query, follow_rev_cb, f, &sql_err);
+    sqlite3_free(query);
+
+    if (res == SQLITE_OK)
+    {
+        query = sqlite3_mprintf("SELECT id FROM Documents WHERE id > %lld AND %s ORDER BY id ASC",
+                                ctx->follow_doc_id, ctx->doc_where);
+
+        res = sqlite3_exec(ctx->db, query, follow_new_doc_cb, f, &sql_err);
+        sqlite3_free(query);
+    }
+
+    end_read(ctx);
+
+    if (res != SQLITE_OK && !f->error)
+    {
+        fprintf(stderr, "[WARNING] Follow poll failed, retrying: %s\n", sql_err);
+    }
+
+    sqlite3_free(sql_err);
+
+    f->total.polls++;
+    f->total.revs += f->batch.revs;
+    f->total.lat_cnt += f->batch.lat_cnt;
+    f->total.lat_sum += f->batch.lat_sum;
+    if (f->batch.lat_max > f->total.lat_max)
+    {
+        f->total.lat_max = f->batch.lat_max;
+    }
+
+    if (f->batch.revs && ctx->opts.quiet == 0)
+    {
+        print_stats("Follow", &f->batch);
+    }
+
+    if (f->batch.revs)
+    {
+        f->revmap_stale = 1;
+    }
+
+    if (f->error)
+    {
+        return f->error;
+    }
+
+    // Rows committed so far are not read again - 'follow_rowid' is past them
+    return res == SQLITE_OK ? 0 : 1;
+}
+
+/*
+ * Bring the revision map in step with HEAD for anyone reading it meanwhile,
+ * if anything was committed since it was last written
+ */
+static void update_revmap(follow_t *f)
+{
+    if (f->revmap_stale && revmap_write(f->ctx, f->repo) < 0)
+    {
+        fprintf(stderr, "[WARNING] Revision map not updated\n");
+    }
+
+    f->revmap_stale = 0;
+    f->revmap_written = now_ms();
+}
+
+/*
+ * Commit revisions as they are appended to the database, until `c9_stop()`
+ * Ends the transaction started by `follow_snapshot()`.
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int follow_revisions(c9_ctx_t *ctx, git_repository *repo)
+{
+    follow_t f = {0};
+    f.ctx = ctx;
+    f.repo = repo;
+
+    end_read(ctx);
+
+    for (doc_t *doc = ctx->doc_list; doc < ctx->doc_list + ctx->doc_cnt; doc++)
+    {
+        if (!insert_follow_doc(&f, doc->id, doc->save_path, false))
+        {
+            free(f.docs);
+            return -1;
+        }
+    }
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Following '%s' from revision row %lld...\n", ctx->db_path, ctx->follow_rowid);
+    }
+
+    if (revmap_write(ctx, repo) < 0)
+    {
+        fprintf(stderr, "[WARNING] Revision map not written\n");
+    }
+
+    long long data_version = -1;
+    int ret = 0;
+
+    struct timespec interval;
+    interval.tv_sec = ctx->opts.follow_interval / 1000;
+    interval.tv_nsec = (ctx->opts.follow_interval % 1000) * 1000000L;
+
+    f.last_poll = now_ms();
+    f.revmap_written = f.last_poll;
+
+    while (!ctx->stop)
+    {
+        long long version;
+
+        // Only changes once another connection commits
+        if (query_int(ctx, "PRAGMA data_version", &version) == 0 && version != data_version)
+        {
+            double started = now_ms();
+
+            int res = follow_poll(&f);
+
+            if (res < 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            // Otherwise the rows left unread would wait for the next commit
+            if (res == 0)
+            {
+                data_version = version;
+            }
+            f.last_poll = started;
+        }
+        else
+        {
+            f.last_poll = now_ms();
+        }
+
+        // Rewritten whole, so not after every poll
+        if (f.last_poll - f.revmap_written >= FOLLOW_REVMAP_INTERVAL)
+        {
+            update_revmap(&f);
+        }
+
+        nanosleep(&interval, NULL);
+    }
+
+    update_revmap(&f);
+
+    if (ctx->opts.quiet == 0)
+    {
+        print_stats("Follow total", &f.total);
+    }
+
+    for (int i = 0; i < f.doc_cnt; i++)
+    {
+        c9_buf_free(&f.docs[i].state);
+
+        if (f.docs[i].owned)
+        {
+            free(f.docs[i].path);
+        }
+    }
+
+    free(f.docs);
+    c9_buf_free(&f.spare);
+
+    return ret;
+}
+
+C9_API void c9_stop(c9_ctx_t *ctx)
+{
+    ctx->stop = 1;
+}
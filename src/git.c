@@ -0,0 +1,247 @@
+#include <string.h>     // memset
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+void git2_print_error(int error)
+{
+    // ref: https://libgit2.org/docs/guides/101-samples/
+    const git_error *e = git_error_last();
+    fprintf(stderr, "[ERROR %d/%d] %s\n", error, e->klass, e->message);
+}
+
+/* ========================================================================== */
+
+/*
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int get_signature(git_repository *repo, git_signature **sig)
+{
+    // NOTE : Defaults to using global git config, but has a fallback
+    // TODO : Allow sig to be set from command line
+    if (git_signature_default(sig, repo) < 0)
+    {
+        fprintf(stdout, "[INFO] It appears 'user.name' and 'user.email' are not set. Using 'c9rev2git' and 'bot@localhost'\n");
+
+        if (git_signature_now(sig, "c9rev2git", "bot@localhost") < 0)
+        {
+            fprintf(stderr, "[ERROR] Failed to set 'user.name' and 'user.email'. Exiting...\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Commit 'idx' to HEAD, with the given parents
+ * Its tree is written from the index, unless already known as 'known_tree'.
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int commit_index_onto(c9_ctx_t *ctx, git_repository *repo, git_index *idx, const char *msg,
+                      const git_commit **parents, int parent_cnt, const git_oid *known_tree)
+{
+    // Prepare commit
+    git_oid tree_id, commit_id;
+    git_tree *tree;
+
+    if (known_tree)
+    {
+        git_oid_cpy(&tree_id, known_tree);
+    }
+    else if (git_index_write_tree(&tree_id, idx) < 0)
+    {
+        fprintf(stderr, "[ERROR] Unable to write tree from index\n");
+        return -2;
+    }
+
+    // Bare conversions keep the index in memory only
+    if (!ctx->opts.bare && git_index_write(idx) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to write updated repo index\n");
+        return -3;
+    }
+
+    if (git_tree_lookup(&tree, repo, &tree_id) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not look up tree\n");
+        return -4;
+    }
+
+    git_signature *sig;
+    if (get_signature(repo, &sig) < 0)
+    {
+        git_tree_free(tree);
+        return -1;
+    }
+
+    int error = git_commit_create(&commit_id, repo, "HEAD", sig, sig,
+                                  NULL, msg, tree, parent_cnt, parents);
+
+    git_tree_free(tree);
+    git_signature_free(sig);
+
+    if (error < 0)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to create commit '%s'\n", error, msg);
+        return -4;
+    }
+
+    // Dereference HEAD to a commit
+    //git_commit_lookup(HEAD, repo, &commit_id);
+    git_object *head_commit;
+    error = git_revparse_single(&head_commit, repo, "HEAD^{commit}");
+
+    // Release any previous HEAD - contexts may run several conversions
+    git_commit_free(ctx->head);
+    ctx->head = (git_commit*)head_commit;
+
+    return 0;
+}
+
+/*
+ * Write a tree from 'idx' and commit it on top of 'head' (if any)
+ */
+static int commit_index(c9_ctx_t *ctx, git_repository *repo, git_index *idx, const char *msg)
+{
+    return commit_index_onto(ctx, repo, idx, msg, (const git_commit **)&ctx->head, ctx->head ? 1 : 0, NULL);
+}
+
+/*
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int git_initial_commit(c9_ctx_t *ctx, git_repository *repo)
+{
+    // Get latest repo index
+    git_index *idx;
+
+    if (git_repository_index(&idx, repo) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not open repository index. Exiting...\n");
+        return -1;
+    }
+
+    // Start a fresh history
+    git_commit_free(ctx->head);
+    ctx->head = NULL;
+
+    int error = commit_index(ctx, repo, idx, "Initial commit");
+
+    // Cleanup
+    git_index_free(idx);
+
+    return error;
+}
+
+/*
+ * Stage 'path' from the working directory, and commit it
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int add_and_commit(c9_ctx_t *ctx, git_repository *repo, int doc_id, char *path, int rev_num)
+{
+    // Get latest repo index
+    git_index *idx;
+
+    if (git_repository_index(&idx, repo) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not open repository index. Exiting...\n");
+        return -1;
+    }
+
+    // Stage file
+    if (git_index_add_bypath(idx, path) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to add %s for new commit. Exiting...\n", path);
+        git_index_free(idx);
+        return -1;
+    }
+
+    char commit_msg[255] = {0};
+    snprintf(commit_msg, sizeof(commit_msg), "./%s [rev: %d]", path, rev_num);
+
+    int error = commit_index(ctx, repo, idx, commit_msg);
+
+    if (error == 0)
+    {
+        error = revmap_add(ctx, doc_id, rev_num, git_commit_id(ctx->head));
+    }
+
+    // Cleanup
+    git_index_free(idx);
+
+    return error;
+}
+
+/*
+ * Stage 'path' as an already written blob, and commit it
+ * Nothing is written to the working directory
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int add_oid_and_commit(c9_ctx_t *ctx, git_repository *repo, int doc_id, const char *path,
+                       const git_oid *id, int rev_num)
+{
+    // Get latest repo index
+    git_index *idx;
+
+    if (git_repository_index(&idx, repo) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not open repository index. Exiting...\n");
+        return -1;
+    }
+
+    git_index_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.mode = GIT_FILEMODE_BLOB;
+    entry.path = path;
+    git_oid_cpy(&entry.id, id);
+
+    if (git_index_add(idx, &entry) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to add %s for new commit. Exiting...\n", path);
+        git_index_free(idx);
+        return -1;
+    }
+
+    // The index always matches HEAD here, so the same change to the same
+    // tree always gives the same tree
+    git_oid base, tree_id;
+    int known = 0;
+
+    if (ctx->head)
+    {
+        git_oid_cpy(&base, git_commit_tree_id(ctx->head));
+        known = tree_cache_find(&ctx->obj_cache, &base, path, id, &tree_id);
+    }
+
+    char commit_msg[255] = {0};
+    snprintf(commit_msg, sizeof(commit_msg), "./%s [rev: %d]", path, rev_num);
+
+    int error = commit_index_onto(ctx, repo, idx, commit_msg, (const git_commit **)&ctx->head,
+                                  ctx->head ? 1 : 0, known ? &tree_id : NULL);
+
+    if (error == 0 && !known && ctx->head)
+    {
+        tree_cache_add(&ctx->obj_cache, &base, path, id, git_commit_tree_id(ctx->head));
+    }
+
+    if (error == 0)
+    {
+        error = revmap_add(ctx, doc_id, rev_num, git_commit_id(ctx->head));
+    }
+
+    // Cleanup
+    git_index_free(idx);
+
+    return error;
+}
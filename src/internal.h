@@ -0,0 +1,490 @@
+#ifndef C9REV2GIT_INTERNAL_H
+#define C9REV2GIT_INTERNAL_H
+
+#include <pthread.h>
+#include <signal.h>     // sig_atomic_t
+#include <stdint.h>     // int32_t, int64_t
+#include <stdio.h>      // printf, fprintf
+#include <stdlib.h>     // malloc, realloc, free
+
+#include <sys/types.h>  // off_t
+
+#include <git2.h>
+
+#include <sqlite3.h>
+
+#include "c9rev2git.h"
+
+/* ========================================================================== */
+
+/*
+ * Reference:
+ * - https://libgit2.org/docs/
+ * - https://www.sqlite.org/docs.html
+ * - https://www.tutorialspoint.com/sqlite/sqlite_c_cpp.htm
+ */
+
+/* ========================================================================== */
+
+#define BYTE char
+
+#define KILOBYTE(v) ((v) * 1024LL)
+#define MEGABYTE(v) (KILOBYTE(v) * 1024L)
+
+#ifdef DEBUG
+    #define ASSERT(exp) \
+        if (!(exp)) \
+        { \
+            fprintf(stderr, "[ASSERT] %s:%d:%s\n", __FILE__, __LINE__, __func__); \
+            exit(2); \
+        }
+#else
+    #define ASSERT(exp)
+#endif
+
+#define false 0
+#define true 1
+
+// Default size of each context's memory arena
+#define MEM_SIZE MEGABYTE(2)
+
+// Compressed revision store tuning
+// Blocks hold consecutive ops of a single document
+#define REV_BLOCK_SIZE KILOBYTE(32)
+#define REV_BLOCK_OPS 64
+#define REV_CACHE_SLOTS 4
+
+// LZ codec parameters
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Keyframe cache
+#define KEYFRAME_MAGIC "C9KF"
+#define KEYFRAME_VERSION 2
+#define KEYFRAME_HEADER_LEN 12
+
+// Revision journal
+#define JOURNAL_MAGIC "C9JR"
+#define JOURNAL_VERSION 1
+
+// Revision map, written into the git directory
+#define REVMAP_NAME "c9-revmap"
+#define REVMAP_MAGIC "C9RM"
+#define REVMAP_VERSION 1
+
+// Line attribution, written into the git directory
+#define ATTRIB_DIR "c9-blame"
+
+// Two-phase conversion - where the history goes, behind the snapshot
+#define SNAPSHOT_HISTORY_REF "refs/heads/c9-history"
+
+// Deferred checkout
+#define CHECKOUT_BATCH 32
+#define CHECKOUT_MAX_THREADS 16
+
+// Object writer
+#define OBJ_MAX_THREADS 16
+#define OBJ_SLOTS_PER_THREAD 4
+
+// Pipeline - the window must be a power of 2
+#define PIPE_MAX_THREADS 16
+#define PIPE_WINDOW 64
+#define PIPE_SPINS 64
+
+// Object cache - slots must be a power of 2
+#define OBJ_CACHE_SLOTS 4096
+#define OBJ_CACHE_BYTES MEGABYTE(64)
+
+// Branch per document
+#define BRANCH_REF_PREFIX "refs/heads/doc/"
+#define BRANCH_MAX_THREADS 16
+
+// Follow mode
+#define FOLLOW_INTERVAL 1000    // ms between polls
+#define FOLLOW_BUSY_TIMEOUT 5000
+#define FOLLOW_REVMAP_INTERVAL 5000     // ms between revision map writes
+
+/* ========================================================================== */
+
+typedef struct mem_pool
+{
+    BYTE *base;
+    BYTE *top;
+    BYTE *cur;
+} mem_pool_t;
+
+typedef struct rev {
+    int num;
+    int block;              // -1 when 'op' is stored raw
+    unsigned int offset;    // Offset of the op within its decoded block
+    char *op;
+} rev_t;
+
+typedef struct doc {
+    int id;
+    int rev_num;
+    int rev_cnt;
+    int revs_loaded;        // On their own, by `load_doc_revisions()`
+    char *save_path;
+    rev_t *revisions;
+} doc_t;
+
+typedef struct rev_block {
+    unsigned int raw_len;
+    unsigned int packed_len;
+    BYTE *packed;
+} rev_block_t;
+
+typedef struct rev_stage {
+    int doc_id;
+    unsigned int op_cnt;
+    unsigned int len;
+    BYTE *buf;
+} rev_stage_t;
+
+// On-disk keyframe record, followed by 'len' bytes of content
+typedef struct keyframe_rec {
+    int32_t doc_id;
+    int32_t doc_rev_num;    // Documents.revNum when written, to spot stale frames
+    int32_t doc_rev_cnt;    // Revisions of the document when written
+    int32_t applied;        // Number of revisions applied to reach this state
+    int32_t rev_num;
+    int64_t len;
+} keyframe_rec_t;
+
+typedef struct keyframe {
+    int doc_id;
+    int doc_rev_num;
+    int doc_rev_cnt;
+    int applied;
+    long len;
+    off_t offset;           // Of the content within the cache file
+} keyframe_t;
+
+typedef struct rev_cache_slot {
+    int block;
+    unsigned int cap;
+    unsigned long last_use;
+    BYTE *data;
+} rev_cache_slot_t;
+
+// Blocks decoded by `rev_op()` - one per thread that replays
+typedef struct rev_cache {
+    rev_cache_slot_t slots[REV_CACHE_SLOTS];
+    unsigned long tick;
+} rev_cache_t;
+
+typedef struct blob_cache_entry {
+    uint64_t hash;
+    long len;
+    BYTE *data;             // NULL when the slot is free
+    git_oid id;
+} blob_cache_entry_t;
+
+typedef struct tree_cache_entry {
+    uint64_t hash;
+    const char *path;       // NULL when the slot is free
+    git_oid base;
+    git_oid blob;
+    git_oid tree;
+} tree_cache_entry_t;
+
+typedef struct obj_cache {
+    blob_cache_entry_t *blobs;
+    tree_cache_entry_t *trees;
+    unsigned int blob_cnt;
+    unsigned int tree_cnt;
+    unsigned long bytes;
+    unsigned long max_bytes;    // Share of OBJ_CACHE_BYTES, see `obj_cache_init()`
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long tree_hits;
+} obj_cache_t;
+
+enum obj_job_state {
+    JOB_FREE,
+    JOB_QUEUED,
+    JOB_DONE,
+    JOB_FAILED
+};
+
+typedef struct obj_job {
+    c9_buf_t data;          // Private copy of the blob contents
+    const char *path;
+    int doc_id;
+    int rev_num;
+    int state;
+    int cached;             // Found in the object cache, so never encoded
+    uint64_t hash;
+    git_oid id;             // Set once JOB_DONE
+} obj_job_t;
+
+typedef struct obj_writer {
+    obj_job_t *jobs;
+    int slot_cnt;
+
+    // Monotonic job counters, see objwrite.c
+    unsigned long head;
+    unsigned long claimed;
+    unsigned long tail;
+
+    obj_cache_t *cache;
+    int level;              // zlib level, -1 for libgit2's default
+    char *objects_dir;
+    git_odb *odb;           // Used when there are no threads
+
+    int stop;
+    int thread_cnt;
+    pthread_t threads[OBJ_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+} obj_writer_t;
+
+// Span of a document inserted by one revision - empty where one deleted
+typedef struct attrib_run {
+    int len;
+    int rev;
+} attrib_run_t;
+
+typedef struct attrib {
+    attrib_run_t *runs;
+    int cnt;
+    int cap;
+    attrib_run_t *next;     // Built from 'runs' by the next revision
+    int next_cnt;
+    int next_cap;
+} attrib_t;
+
+// Revision credited with each line of a replayed document
+typedef struct attrib_doc {
+    int *line_revs;
+    int line_cnt;
+} attrib_doc_t;
+
+// On-disk revision map entry
+typedef struct revmap_entry {
+    int32_t doc_id;
+    int32_t rev_num;
+    git_oid commit;
+} revmap_entry_t;
+
+typedef struct revmap {
+    revmap_entry_t *entries;
+    size_t cnt;
+    size_t cap;
+    size_t sorted;          // Entries already in order, as of the last write
+    uint32_t *by_commit;    // The first 'sorted' entries, in commit id order
+    pthread_mutex_t lock;   // Branch workers commit concurrently
+} revmap_t;
+
+typedef struct snapshot {
+    git_commit *commit;     // Every document's final contents, in one commit
+    char *branch;           // Where HEAD pointed when it was made
+} snapshot_t;
+
+/*
+ * Everything belonging to one open database
+ */
+struct c9_ctx {
+    c9_options_t opts;
+
+    // Memory for the entire context
+    mem_pool_t mem;
+    mem_pool_t struct_pool;
+    mem_pool_t string_pool;
+    mem_pool_t scratch_pool;
+    mem_pool_t block_pool;
+
+    sqlite3 *db;
+    char *db_path;
+    int reading;            // Within a read transaction, see `begin_read()`
+
+    doc_t *doc_list;
+    rev_t *rev_list;
+
+    unsigned int doc_cnt;
+    unsigned int rev_cnt;
+
+    int revs_loaded;
+
+    // Compressed revision store
+    rev_block_t *block_list;
+    unsigned int block_cnt;
+    rev_stage_t rev_stage;
+    rev_cache_t rev_cache;
+    unsigned long rev_raw_bytes;
+
+    // Conversion state
+    git_commit *head;
+    obj_cache_t obj_cache;
+    revmap_t revmap;
+    attrib_doc_t *attrib;   // One per document, when attributing
+    snapshot_t snapshot;
+    int repo_fd;
+
+    // Follow mode - last Revisions rowid, and Documents id, committed
+    long long follow_rowid;
+    long long follow_doc_id;
+    volatile sig_atomic_t stop;
+
+    // Path and revision filters, as SQL conditions
+    char *doc_where;
+    char *rev_where;
+
+    // Revision journal, when loaded from one
+    BYTE *journal;
+    size_t journal_size;
+
+    // Keyframe cache, opened on first use, and its index by (doc_id, applied)
+    int kf_fd;
+    keyframe_t *kf_list;
+    int kf_cnt;
+    int kf_cap;
+
+    // Working buffers for `c9_materialize()`
+    c9_buf_t contents;
+    c9_buf_t spare;
+};
+
+/* ========================================================================== */
+
+// Unit Separator
+extern const char US;
+
+// mem.c
+BYTE * mem_push(mem_pool_t *pool, unsigned int sz);
+void mem_pop(BYTE **mem, mem_pool_t *pool, unsigned int sz);
+int mem_alloc(mem_pool_t *pool, unsigned long capacity);
+int mem_sub_alloc(mem_pool_t *parent, mem_pool_t *child, unsigned long capacity);
+void mem_free(mem_pool_t *pool);
+
+// lz.c
+int lz_compress(const BYTE *src, unsigned int len, BYTE *dst, unsigned int cap);
+int lz_decompress(const BYTE *src, unsigned int len, BYTE *dst, unsigned int cap);
+
+// revstore.c
+int rev_block_pack(c9_ctx_t *ctx, const BYTE *raw, unsigned int raw_len);
+void rev_store_flush(c9_ctx_t *ctx);
+void rev_store_append(c9_ctx_t *ctx, int doc_id, rev_t *rev, const char *op, int len);
+char * rev_op(c9_ctx_t *ctx, rev_cache_t *cache, rev_t *rev);
+void rev_cache_free(rev_cache_t *cache);
+
+// ops.c
+int parse_op(const char *op, char *parsed);
+int next_op_code(char **op);
+int get_retain_val(const char *val);
+int get_instruction_len(const char *cur);
+int reset_check(char *op);
+int doc_buf_reserve(c9_buf_t *buf, long cap);
+int apply_rev(c9_ctx_t *ctx, rev_cache_t *cache, c9_buf_t *dst, const c9_buf_t *src, rev_t *rev, int invert);
+int replay_doc(c9_ctx_t *ctx, rev_cache_t *cache, doc_t *doc, c9_buf_t *state, c9_buf_t *spare, int from, int to);
+int history_resets(c9_ctx_t *ctx, rev_cache_t *cache, doc_t *doc);
+int initial_state(c9_ctx_t *ctx, rev_cache_t *cache, doc_t *doc, c9_buf_t *state, c9_buf_t *spare, const c9_buf_t *contents);
+int revs_applied_at(doc_t *doc, int rev_num);
+
+// keyframe.c
+int keyframe_open(c9_ctx_t *ctx, int interval);
+void keyframe_close(c9_ctx_t *ctx);
+int keyframe_find(c9_ctx_t *ctx, doc_t *doc, int applied, keyframe_t *best);
+int keyframe_write(c9_ctx_t *ctx, doc_t *doc, int applied, const c9_buf_t *state);
+int keyframe_build(c9_ctx_t *ctx, doc_t *doc, const c9_buf_t *contents, int interval);
+
+// journal.c
+int journal_load(c9_ctx_t *ctx);
+int journal_contents(c9_ctx_t *ctx, doc_t *doc, c9_buf_t *contents);
+void journal_close(c9_ctx_t *ctx);
+int journal_write(c9_ctx_t *ctx);
+
+// filter.c
+int filters_set(c9_ctx_t *ctx);
+int filter_init(c9_ctx_t *ctx);
+void filter_free(c9_ctx_t *ctx);
+int path_included(c9_ctx_t *ctx, const char *path);
+int rev_included(c9_ctx_t *ctx, int rev_num);
+
+// revmap.c
+void revmap_init(revmap_t *map);
+void revmap_free(revmap_t *map);
+int revmap_add(c9_ctx_t *ctx, int doc_id, int rev_num, const git_oid *commit);
+int revmap_write(c9_ctx_t *ctx, git_repository *repo);
+
+// attrib.c
+void attrib_free(attrib_t *a);
+int attrib_begin(attrib_t *a, long len, int rev);
+int attrib_apply(c9_ctx_t *ctx, rev_cache_t *cache, attrib_t *a, rev_t *rev, const c9_buf_t *prev);
+int attrib_finish(c9_ctx_t *ctx, attrib_t *a, unsigned int idx, const c9_buf_t *state);
+void attrib_close(c9_ctx_t *ctx);
+int attrib_write(c9_ctx_t *ctx, git_repository *repo);
+
+// snapshot.c
+int snapshot_commit(c9_ctx_t *ctx, git_repository *repo);
+int snapshot_link(c9_ctx_t *ctx, git_repository *repo);
+void snapshot_free(c9_ctx_t *ctx);
+
+// pack.c
+int optimize_repo(c9_ctx_t *ctx, git_repository *repo);
+
+// db.c
+int begin_read(c9_ctx_t *ctx);
+void end_read(c9_ctx_t *ctx);
+doc_t * find_doc(c9_ctx_t *ctx, int doc_id);
+doc_t * push_doc(c9_ctx_t *ctx, int doc_id, const char *path, int rev_num);
+int load_revisions(c9_ctx_t *ctx);
+int load_doc_revisions(c9_ctx_t *ctx, doc_t *doc);
+int load_contents(c9_ctx_t *ctx, doc_t *doc, c9_buf_t *contents);
+
+// git.c
+void git2_print_error(int error);
+int get_signature(git_repository *repo, git_signature **sig);
+int commit_index_onto(c9_ctx_t *ctx, git_repository *repo, git_index *idx, const char *msg,
+                      const git_commit **parents, int parent_cnt, const git_oid *tree_id);
+int git_initial_commit(c9_ctx_t *ctx, git_repository *repo);
+int add_and_commit(c9_ctx_t *ctx, git_repository *repo, int doc_id, char *path, int rev_num);
+int add_oid_and_commit(c9_ctx_t *ctx, git_repository *repo, int doc_id, const char *path,
+                       const git_oid *id, int rev_num);
+
+// objcache.c
+uint64_t content_hash(const BYTE *data, long len);
+int obj_cache_init(obj_cache_t *cache, int shares);
+void obj_cache_free(obj_cache_t *cache);
+int blob_cache_find(obj_cache_t *cache, uint64_t hash, const BYTE *data, long len, git_oid *out);
+void blob_cache_add(obj_cache_t *cache, uint64_t hash, BYTE *data, long len, const git_oid *id);
+int tree_cache_find(obj_cache_t *cache, const git_oid *base, const char *path,
+                    const git_oid *blob, git_oid *out);
+void tree_cache_add(obj_cache_t *cache, const git_oid *base, const char *path,
+                    const git_oid *blob, const git_oid *tree);
+
+// objwrite.c
+int loose_odb_open(const char *objects_dir, int level, git_odb **out);
+int obj_writer_start(obj_writer_t *w, c9_ctx_t *ctx, git_repository *repo);
+void obj_writer_stop(obj_writer_t *w);
+int obj_writer_full(obj_writer_t *w);
+int obj_writer_submit(obj_writer_t *w, const c9_buf_t *data, int doc_id, const char *path, int rev_num);
+obj_job_t * obj_writer_next(obj_writer_t *w, int wait);
+void obj_writer_release(obj_writer_t *w);
+
+// pipeline.c
+int process_revisions_pipeline(c9_ctx_t *ctx, git_repository *repo);
+
+// branches.c
+int process_revisions_branches(c9_ctx_t *ctx, git_repository *repo);
+
+// follow.c
+int follow_snapshot(c9_ctx_t *ctx);
+int follow_revisions(c9_ctx_t *ctx, git_repository *repo);
+
+// checkout.c
+int checkout_index(c9_ctx_t *ctx, git_repository *repo);
+
+// convert.c
+int mkdir_parents(c9_ctx_t *ctx, int dir_fd, const char *path);
+int revert_doc(c9_ctx_t *ctx, doc_t *doc);
+int revise_and_commit(c9_ctx_t *ctx, doc_t *doc, git_repository *repo);
+int process_revisions(c9_ctx_t *ctx, git_repository *repo);
+int process_revisions_bare(c9_ctx_t *ctx, git_repository *repo);
+
+#endif
@@ -0,0 +1,471 @@
+#include <errno.h>
+#include <string.h>     // memchr, memcmp, memcpy, strlen
+
+#include <unistd.h>     // close
+#include <sys/mman.h>   // mmap, munmap
+#include <sys/stat.h>   // fstat
+#include <fcntl.h>      // open
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Revision journal
+ *
+ * Everything a conversion reads from the database - documents, their final
+ * contents, and every revision already run through `parse_op()` - in a single
+ * file that is mapped straight into memory. Revisions are replayed from the
+ * mapping as they are, so a repeat conversion skips sqlite and op parsing
+ * entirely.
+ *
+ * Layout:
+ *   header    : journal_hdr_t
+ *   documents : journal_doc_t[doc_cnt], in ascending id order
+ *   revisions : journal_rev_t[rev_cnt], grouped by document, in revNum order
+ *   data      : paths, contents and parsed ops, each null terminated
+ *
+ * A journal is only used while the database it was taken from still has the
+ * same Revisions and Documents rows, as far as a cheap count can tell.
+ * Otherwise it is written again, once revisions have been loaded.
+ *
+ * It always holds every document and revision. Path and revNum filters are
+ * applied as it is loaded.
+ */
+
+typedef struct journal_hdr {
+    char magic[4];
+    int32_t version;
+    int64_t src_rowid;      // MAX(rowid) FROM Revisions
+    int64_t src_revs;       // COUNT(*) FROM Revisions
+    int64_t src_docs;       // COUNT(*) FROM Documents
+    int32_t doc_cnt;
+    int32_t rev_cnt;
+    int64_t doc_off;
+    int64_t rev_off;
+    int64_t size;
+} journal_hdr_t;
+
+typedef struct journal_doc {
+    int32_t id;
+    int32_t rev_num;
+    int32_t rev_cnt;
+    int32_t first_rev;
+    int64_t path_off;
+    int64_t contents_off;
+    int64_t contents_len;
+} journal_doc_t;
+
+typedef struct journal_rev {
+    int32_t num;
+    int32_t op_len;         // Excluding the null terminator
+    int64_t op_off;
+} journal_rev_t;
+
+/*
+ * Expects:
+ *   data to be a journal_hdr_t
+ *   col_data[0] to be MAX(rowid) of Revisions
+ *   col_data[1] to be COUNT(*) of Revisions
+ *   col_data[2] to be COUNT(*) of Documents
+ */
+static int source_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    journal_hdr_t *hdr = (journal_hdr_t *)data;
+
+    hdr->src_rowid = col_data[0] ? atoll(col_data[0]) : 0;
+    hdr->src_revs = atoll(col_data[1]);
+    hdr->src_docs = atoll(col_data[2]);
+
+    return 0;
+}
+
+/*
+ * Note what the database currently holds, to spot a stale journal
+ */
+static int read_source(c9_ctx_t *ctx, journal_hdr_t *hdr)
+{
+    char *sql_err = NULL;
+    char *query = "SELECT (SELECT MAX(rowid) FROM Revisions), (SELECT COUNT(*) FROM Revisions), (SELECT COUNT(*) FROM Documents)";
+
+    if (sqlite3_exec(ctx->db, query, source_cb, hdr, &sql_err) != SQLITE_OK)
+    {
+        fprintf(stderr, "[SQLERR] %s\n", sql_err);
+        sqlite3_free(sql_err);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Check every offset and count in the tables points within the mapping, at
+ * data that ends in a null terminator still within it
+ */
+static int check_tables(const BYTE *map, const journal_hdr_t *hdr)
+{
+    const journal_doc_t *jdocs = (const journal_doc_t *)(map + hdr->doc_off);
+    const journal_rev_t *jrevs = (const journal_rev_t *)(map + hdr->rev_off);
+    int64_t data_off = hdr->rev_off + (int64_t)hdr->rev_cnt * sizeof(journal_rev_t);
+
+    for (int i = 0; i < hdr->doc_cnt; i++)
+    {
+        const journal_doc_t *jdoc = jdocs + i;
+
+        // In ascending id order, as lookups expect
+        if ((i > 0 && jdoc->id <= jdocs[i - 1].id)
+            || jdoc->path_off < data_off || jdoc->path_off >= hdr->size
+            || !memchr(map + jdoc->path_off, '\0', hdr->size - jdoc->path_off)
+            || jdoc->contents_off < data_off || jdoc->contents_len < 0
+            || jdoc->contents_len >= hdr->size - jdoc->contents_off
+            || map[jdoc->contents_off + jdoc->contents_len] != '\0'
+            || jdoc->first_rev < 0 || jdoc->rev_cnt < 0
+            || (int64_t)jdoc->first_rev + jdoc->rev_cnt > hdr->rev_cnt)
+        {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < hdr->rev_cnt; i++)
+    {
+        const journal_rev_t *jrev = jrevs + i;
+
+        if (jrev->op_off < data_off || jrev->op_len < 0
+            || jrev->op_len >= hdr->size - jrev->op_off
+            || map[jrev->op_off + jrev->op_len] != '\0')
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* ========================================================================== */
+
+/*
+ * Map the journal, and take the document and revision lists from it
+ * Returns:
+ *  0 : Success
+ * <0 : No usable journal - load from the database instead
+ */
+int journal_load(c9_ctx_t *ctx)
+{
+    int fd = open(ctx->opts.journal, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    struct stat fs;
+    BYTE *map = MAP_FAILED;
+
+    if (fstat(fd, &fs) == 0 && fs.st_size >= (off_t)sizeof(journal_hdr_t))
+    {
+        map = mmap(NULL, fs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    // The mapping stays valid without the descriptor
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "[WARNING] Could not map journal '%s'\n", ctx->opts.journal);
+        return -1;
+    }
+
+    journal_hdr_t *hdr = (journal_hdr_t *)map;
+    journal_hdr_t src = {0};
+
+    int valid = memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) == 0
+        && hdr->version == JOURNAL_VERSION
+        && hdr->size == fs.st_size
+        && hdr->doc_cnt >= 0 && hdr->rev_cnt >= 0
+        && hdr->doc_off == sizeof(journal_hdr_t)
+        && hdr->rev_off == hdr->doc_off + (int64_t)hdr->doc_cnt * sizeof(journal_doc_t)
+        && hdr->rev_off + (int64_t)hdr->rev_cnt * sizeof(journal_rev_t) <= hdr->size
+        && check_tables(map, hdr) == 0;
+
+    if (!valid)
+    {
+        fprintf(stderr, "[WARNING] Ignoring invalid journal '%s'\n", ctx->opts.journal);
+        munmap(map, fs.st_size);
+        return -1;
+    }
+
+    if (read_source(ctx, &src) < 0
+        || src.src_rowid != hdr->src_rowid
+        || src.src_revs != hdr->src_revs
+        || src.src_docs != hdr->src_docs)
+    {
+        if (ctx->opts.quiet == 0)
+        {
+            fprintf(stdout, "[INFO] Journal '%s' is out of date\n", ctx->opts.journal);
+        }
+
+        munmap(map, fs.st_size);
+        return -1;
+    }
+
+    journal_doc_t *jdocs = (journal_doc_t *)(map + hdr->doc_off);
+    journal_rev_t *jrevs = (journal_rev_t *)(map + hdr->rev_off);
+
+    // 'doc_list' then 'rev_list', contiguous in 'struct_pool' as usual
+    ctx->doc_list = (doc_t *)ctx->struct_pool.cur;
+
+    for (int i = 0; i < hdr->doc_cnt; i++)
+    {
+        if (path_included(ctx, (char *)map + jdocs[i].path_off))
+        {
+            push_doc(ctx, jdocs[i].id, map + jdocs[i].path_off, jdocs[i].rev_num);
+        }
+    }
+
+    ctx->rev_list = (rev_t *)ctx->struct_pool.cur;
+
+    doc_t *doc = ctx->doc_list;
+
+    for (int i = 0; i < hdr->doc_cnt; i++)
+    {
+        if (doc == ctx->doc_list + ctx->doc_cnt || doc->id != jdocs[i].id)
+        {
+            continue;
+        }
+
+        journal_rev_t *jrev = jrevs + jdocs[i].first_rev;
+
+        for (int r = 0; r < jdocs[i].rev_cnt; r++, jrev++)
+        {
+            if (!rev_included(ctx, jrev->num))
+            {
+                continue;
+            }
+
+            rev_t *rev = (rev_t *)mem_push(&ctx->struct_pool, sizeof(rev_t));
+
+            rev->num = jrev->num;
+            rev->block = -1;
+            rev->offset = 0;
+
+            // Ops are never written to, so they can stay in the mapping
+            rev->op = (char *)map + jrev->op_off;
+
+            if (!doc->revisions)
+            {
+                doc->revisions = rev;
+            }
+            doc->rev_cnt++;
+
+            ctx->rev_cnt++;
+        }
+
+        doc++;
+    }
+
+    ctx->revs_loaded = 1;
+
+    ctx->journal = map;
+    ctx->journal_size = fs.st_size;
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Loaded %u documents and %u revisions from journal '%s'\n",
+                ctx->doc_cnt, ctx->rev_cnt, ctx->opts.journal);
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the final contents of 'doc' out of the journal
+ */
+int journal_contents(c9_ctx_t *ctx, doc_t *doc, c9_buf_t *contents)
+{
+    journal_hdr_t *hdr = (journal_hdr_t *)ctx->journal;
+    journal_doc_t *jdocs = (journal_doc_t *)(ctx->journal + hdr->doc_off);
+    journal_doc_t *jdoc = NULL;
+
+    // Documents may have been filtered out of 'doc_list', but both are in id order
+    int lo = 0;
+    int hi = hdr->doc_cnt - 1;
+
+    while (lo <= hi && !jdoc)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (jdocs[mid].id == doc->id)
+        {
+            jdoc = jdocs + mid;
+        }
+        else if (jdocs[mid].id < doc->id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    if (!jdoc)
+    {
+        fprintf(stderr, "[ERROR] '%s' is missing from journal '%s'\n", doc->save_path, ctx->opts.journal);
+        return C9_EIO;
+    }
+
+    if (doc_buf_reserve(contents, jdoc->contents_len + 1) < 0)
+    {
+        return C9_ENOMEM;
+    }
+
+    memcpy(contents->data, ctx->journal + jdoc->contents_off, jdoc->contents_len);
+    contents->len = jdoc->contents_len;
+
+    return C9_OK;
+}
+
+void journal_close(c9_ctx_t *ctx)
+{
+    if (ctx->journal)
+    {
+        munmap(ctx->journal, ctx->journal_size);
+        ctx->journal = NULL;
+    }
+}
+
+/* ========================================================================== */
+
+static int write_data(FILE *fp, const void *data, long len, int64_t *off)
+{
+    *off = ftell(fp);
+
+    if (fwrite(data, 1, len, fp) != (size_t)len || fputc('\0', fp) == EOF)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the loaded documents and revisions out as a journal
+ * Runs within the read transaction `c9_open()` started, so the counts and
+ * contents written are from the same snapshot the revisions were loaded from.
+ * Written to a temporary file first, so a reader never sees half a journal.
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int journal_write(c9_ctx_t *ctx)
+{
+    journal_hdr_t hdr = {0};
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    hdr.doc_cnt = ctx->doc_cnt;
+    hdr.rev_cnt = ctx->rev_cnt;
+    hdr.doc_off = sizeof(journal_hdr_t);
+    hdr.rev_off = hdr.doc_off + (int64_t)hdr.doc_cnt * sizeof(journal_doc_t);
+
+    if (read_source(ctx, &hdr) < 0)
+    {
+        return -1;
+    }
+
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ctx->opts.journal);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to create journal '%s'\n", errno, tmp_path);
+        return -1;
+    }
+
+    journal_doc_t *jdocs = calloc(hdr.doc_cnt + 1, sizeof(journal_doc_t));
+    journal_rev_t *jrevs = calloc(hdr.rev_cnt + 1, sizeof(journal_rev_t));
+    c9_buf_t contents = {0};
+    int ret = 0;
+
+    // Data first, after room for the tables
+    if (!jdocs || !jrevs || fseek(fp, hdr.rev_off + (int64_t)hdr.rev_cnt * sizeof(journal_rev_t), SEEK_SET) != 0)
+    {
+        ret = -1;
+        goto DONE;
+    }
+
+    int rev_idx = 0;
+
+    for (int i = 0; i < hdr.doc_cnt && ret == 0; i++)
+    {
+        doc_t *doc = ctx->doc_list + i;
+        journal_doc_t *jdoc = jdocs + i;
+
+        jdoc->id = doc->id;
+        jdoc->rev_num = doc->rev_num;
+        jdoc->rev_cnt = doc->rev_cnt;
+        jdoc->first_rev = rev_idx;
+
+        if (write_data(fp, doc->save_path, strlen(doc->save_path), &jdoc->path_off) < 0
+            || load_contents(ctx, doc, &contents) != C9_OK
+            || write_data(fp, contents.data, contents.len, &jdoc->contents_off) < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        jdoc->contents_len = contents.len;
+
+        for (int r = 0; r < doc->rev_cnt; r++, rev_idx++)
+        {
+            char *op = rev_op(ctx, &ctx->rev_cache, doc->revisions + r);
+            journal_rev_t *jrev = jrevs + rev_idx;
+
+            jrev->num = doc->revisions[r].num;
+            jrev->op_len = op ? strlen(op) : 0;
+
+            if (!op || write_data(fp, op, jrev->op_len, &jrev->op_off) < 0)
+            {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    hdr.size = ftell(fp);
+
+    if (ret == 0
+        && (fseek(fp, 0, SEEK_SET) != 0
+            || fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+            || fwrite(jdocs, sizeof(journal_doc_t), hdr.doc_cnt, fp) != (size_t)hdr.doc_cnt
+            || fwrite(jrevs, sizeof(journal_rev_t), hdr.rev_cnt, fp) != (size_t)hdr.rev_cnt))
+    {
+        ret = -1;
+    }
+
+DONE:
+    if (fclose(fp) != 0)
+    {
+        ret = -1;
+    }
+
+    if (ret == 0 && rename(tmp_path, ctx->opts.journal) == -1)
+    {
+        ret = -1;
+    }
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to write journal '%s'\n", errno, ctx->opts.journal);
+        unlink(tmp_path);
+    }
+    else if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Wrote journal '%s' (%ld bytes)\n", ctx->opts.journal, (long)hdr.size);
+    }
+
+    c9_buf_free(&contents);
+    free(jdocs);
+    free(jrevs);
+
+    return ret;
+}
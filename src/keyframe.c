@@ -0,0 +1,550 @@
+#include <errno.h>
+#include <string.h>     // memcmp
+
+#include <unistd.h>     // pread, write, close
+#include <sys/file.h>   // flock
+#include <sys/stat.h>   // open, fstat, fchmod
+#include <sys/uio.h>    // writev
+#include <fcntl.h>      // open, fcntl
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Keyframes
+ *
+ * Any revision of a document can be materialized in memory by replaying
+ * forward from the nearest keyframe - a full copy of the document taken
+ * every 'interval' revisions. Keyframes live in a sidecar cache file next to
+ * the database ('<database>.kf'), and are built on first use per document.
+ *
+ * Cache layout:
+ *   header   : "C9KF", then the format version and keyframe interval (int32)
+ *   records  : keyframe_rec_t immediately followed by 'len' bytes of content
+ *
+ * Each record notes the revNum and revision count of its document's history
+ * when written, and only matches while both are unchanged. The cache is read
+ * once per context into 'kf_list', and rewritten without stale, duplicate or
+ * partly written records whenever any turn up. A cache built with another
+ * interval (or format) is discarded.
+ *
+ * Only a context holding every revision may read or write the cache - a
+ * filtered one would count its revisions differently.
+ *
+ * Any number of contexts, in any number of processes, may share the cache.
+ * A cache file is only ever appended to, one whole record per write, under
+ * an exclusive `flock()` - the index is read under a shared one. Anything
+ * else (compacting, or starting over) writes a new file, and renames it
+ * into place. An index is then always good for the file it was read from,
+ * and a context finding the file replaced just opens and reads it again.
+ */
+
+static int cmp_frame(const void *a, const void *b)
+{
+    const keyframe_t *x = (const keyframe_t *)a;
+    const keyframe_t *y = (const keyframe_t *)b;
+
+    if (x->doc_id != y->doc_id)
+    {
+        return x->doc_id < y->doc_id ? -1 : 1;
+    }
+
+    if (x->applied != y->applied)
+    {
+        return x->applied < y->applied ? -1 : 1;
+    }
+
+    // Later records of the same frame last
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int same_frame(const keyframe_t *x, const keyframe_t *y)
+{
+    return x->doc_id == y->doc_id && x->applied == y->applied
+        && x->doc_rev_num == y->doc_rev_num && x->doc_rev_cnt == y->doc_rev_cnt;
+}
+
+// Whether 'frame' was built from the history 'doc' has now
+static int frame_current(const keyframe_t *frame, const doc_t *doc)
+{
+    return frame->doc_rev_num == doc->rev_num && frame->doc_rev_cnt == doc->rev_cnt;
+}
+
+static int push_frame(c9_ctx_t *ctx, const keyframe_rec_t *rec, off_t offset)
+{
+    if (ctx->kf_cnt == ctx->kf_cap)
+    {
+        int cap = ctx->kf_cap ? ctx->kf_cap * 2 : 256;
+        keyframe_t *list = realloc(ctx->kf_list, cap * sizeof(keyframe_t));
+
+        if (!list)
+        {
+            return -1;
+        }
+
+        ctx->kf_list = list;
+        ctx->kf_cap = cap;
+    }
+
+    keyframe_t *frame = ctx->kf_list + ctx->kf_cnt++;
+    frame->doc_id = rec->doc_id;
+    frame->doc_rev_num = rec->doc_rev_num;
+    frame->doc_rev_cnt = rec->doc_rev_cnt;
+    frame->applied = rec->applied;
+    frame->len = rec->len;
+    frame->offset = offset;
+
+    return 0;
+}
+
+static void cache_path(c9_ctx_t *ctx, char *path, size_t size)
+{
+    snprintf(path, size, "%s.kf", ctx->db_path);
+}
+
+static int read_index(c9_ctx_t *ctx, int fd);
+
+/*
+ * Lock the cache file with 'op' (LOCK_SH or LOCK_EX), first opening it
+ * again - and reading its index - if it was replaced since it was opened
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+static int lock_cache(c9_ctx_t *ctx, int op)
+{
+    char kf_path[512];
+    cache_path(ctx, kf_path, sizeof(kf_path));
+
+    for (;;)
+    {
+        struct stat fs, ps;
+
+        if (flock(ctx->kf_fd, op) == -1 || fstat(ctx->kf_fd, &fs) == -1)
+        {
+            fprintf(stderr, "[ERROR %d] Failed to lock keyframe cache '%s'\n", errno, kf_path);
+            return -1;
+        }
+
+        if (stat(kf_path, &ps) == 0 && ps.st_dev == fs.st_dev && ps.st_ino == fs.st_ino)
+        {
+            return 0;
+        }
+
+        // Renamed over by another context - or removed, and then created anew
+        int fd = open(kf_path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd == -1)
+        {
+            fprintf(stderr, "[ERROR %d] Failed to open keyframe cache '%s'\n", errno, kf_path);
+            return -1;
+        }
+
+        close(ctx->kf_fd);
+        ctx->kf_fd = fd;
+
+        // Stale frames are left for the next `keyframe_open()`
+        if (flock(fd, LOCK_SH) == -1 || read_index(ctx, fd) < 0)
+        {
+            return -1;
+        }
+    }
+}
+
+static void unlock_cache(c9_ctx_t *ctx)
+{
+    flock(ctx->kf_fd, LOCK_UN);
+}
+
+// Whether the cache was built with this format and interval
+static int header_valid(int fd, int interval)
+{
+    char magic[4];
+    int32_t header[2];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+        && memcmp(magic, KEYFRAME_MAGIC, sizeof(magic)) == 0
+        && pread(fd, header, sizeof(header), sizeof(magic)) == sizeof(header)
+        && header[0] == KEYFRAME_VERSION && header[1] == interval;
+}
+
+/*
+ * Read every record header into 'kf_list'
+ * Returns the number of records not worth keeping, or -1 on failure
+ */
+static int read_index(c9_ctx_t *ctx, int fd)
+{
+    struct stat fs;
+    if (fstat(fd, &fs) == -1)
+    {
+        return -1;
+    }
+
+    // Without path filters, every document still in the database is here
+    int all_docs = !filters_set(ctx);
+    off_t offset = KEYFRAME_HEADER_LEN;
+    int stale = 0;
+
+    ctx->kf_cnt = 0;
+
+    while (offset < fs.st_size)
+    {
+        keyframe_rec_t rec;
+
+        // A partially written record ends the cache
+        if (pread(fd, &rec, sizeof(rec), offset) != sizeof(rec)
+            || rec.len < 0 || offset + (off_t)sizeof(rec) + rec.len > fs.st_size)
+        {
+            stale++;
+            break;
+        }
+
+        offset += sizeof(rec);
+
+        doc_t *doc = find_doc(ctx, rec.doc_id);
+
+        // Documents outside the context are kept as they are, and revision
+        // counts only checked once a document's revisions are loaded
+        int counted = doc && (ctx->revs_loaded || doc->revs_loaded);
+
+        if (doc ? rec.doc_rev_num == doc->rev_num && (!counted || rec.doc_rev_cnt == doc->rev_cnt) : !all_docs)
+        {
+            if (push_frame(ctx, &rec, offset) < 0)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            stale++;
+        }
+
+        offset += rec.len;
+    }
+
+    qsort(ctx->kf_list, ctx->kf_cnt, sizeof(keyframe_t), cmp_frame);
+
+    // Only the last copy of a frame is kept
+    int kept = 0;
+
+    for (int i = 0; i < ctx->kf_cnt; i++)
+    {
+        if (kept && same_frame(ctx->kf_list + kept - 1, ctx->kf_list + i))
+        {
+            ctx->kf_list[kept - 1] = ctx->kf_list[i];
+            stale++;
+        }
+        else
+        {
+            ctx->kf_list[kept++] = ctx->kf_list[i];
+        }
+    }
+
+    ctx->kf_cnt = kept;
+
+    return stale;
+}
+
+/*
+ * Replace the cache with a new file, holding only the records in 'kf_list'
+ * The cache must be locked exclusively, and is left unlocked.
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+static int replace_cache(c9_ctx_t *ctx, int interval)
+{
+    char kf_path[512];
+    char tmp_path[520];
+
+    cache_path(ctx, kf_path, sizeof(kf_path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", kf_path);
+
+    int32_t header[2] = {KEYFRAME_VERSION, interval};
+    int tmp_fd = mkstemp(tmp_path);
+    c9_buf_t copy = {0};
+    int ret = 0;
+
+    if (tmp_fd == -1
+        || fchmod(tmp_fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == -1
+        || write(tmp_fd, KEYFRAME_MAGIC, 4) != 4
+        || write(tmp_fd, header, sizeof(header)) != sizeof(header))
+    {
+        ret = -1;
+    }
+
+    off_t end = KEYFRAME_HEADER_LEN;
+
+    for (int i = 0; i < ctx->kf_cnt && ret == 0; i++)
+    {
+        keyframe_t *frame = ctx->kf_list + i;
+        off_t rec_offset = frame->offset - sizeof(keyframe_rec_t);
+        long rec_len = sizeof(keyframe_rec_t) + frame->len;
+
+        if (doc_buf_reserve(&copy, rec_len) < 0
+            || pread(ctx->kf_fd, copy.data, rec_len, rec_offset) != rec_len
+            || write(tmp_fd, copy.data, rec_len) != rec_len)
+        {
+            ret = -1;
+            break;
+        }
+
+        frame->offset = end + sizeof(keyframe_rec_t);
+        end += rec_len;
+    }
+
+    c9_buf_free(&copy);
+
+    // Appended to from here on, like any other cache file
+    if (ret == 0
+        && (fcntl(tmp_fd, F_SETFL, O_APPEND) == -1 || rename(tmp_path, kf_path) == -1))
+    {
+        ret = -1;
+    }
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to rewrite keyframe cache '%s'\n", errno, kf_path);
+
+        if (tmp_fd != -1)
+        {
+            close(tmp_fd);
+            unlink(tmp_path);
+        }
+
+        unlock_cache(ctx);
+
+        return -1;
+    }
+
+    // Also drops the lock on the replaced file
+    close(ctx->kf_fd);
+    ctx->kf_fd = tmp_fd;
+
+    return 0;
+}
+
+/*
+ * Open (or create) the keyframe cache of the context's database, and read
+ * its index
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int keyframe_open(c9_ctx_t *ctx, int interval)
+{
+    if (ctx->opts.since_rev > 0 || ctx->opts.since_time > 0)
+    {
+        fprintf(stderr, "[ERROR] The keyframe cache needs every revision, without revision filters\n");
+        return -1;
+    }
+
+    char kf_path[512];
+    cache_path(ctx, kf_path, sizeof(kf_path));
+
+    ctx->kf_fd = open(kf_path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (ctx->kf_fd == -1)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to open keyframe cache '%s'\n", errno, kf_path);
+        return -1;
+    }
+
+    // Read under a shared lock, then again under an exclusive one if the
+    // file needs replacing - it may have been, meanwhile
+    int op = LOCK_SH;
+
+    for (;;)
+    {
+        if (lock_cache(ctx, op) < 0)
+        {
+            keyframe_close(ctx);
+            return -1;
+        }
+
+        // Missing, foreign, or built with another interval - start over
+        int valid = header_valid(ctx->kf_fd, interval);
+        int stale = valid ? read_index(ctx, ctx->kf_fd) : 0;
+
+        if (!valid)
+        {
+            ctx->kf_cnt = 0;
+        }
+
+        if (stale < 0)
+        {
+            keyframe_close(ctx);
+            return -1;
+        }
+
+        if (valid && stale == 0)
+        {
+            unlock_cache(ctx);
+            return 0;
+        }
+
+        if (op == LOCK_EX)
+        {
+            if (replace_cache(ctx, interval) < 0)
+            {
+                keyframe_close(ctx);
+                return -1;
+            }
+
+            return 0;
+        }
+
+        unlock_cache(ctx);
+        op = LOCK_EX;
+    }
+}
+
+void keyframe_close(c9_ctx_t *ctx)
+{
+    if (ctx->kf_fd != -1)
+    {
+        close(ctx->kf_fd);
+        ctx->kf_fd = -1;
+    }
+
+    free(ctx->kf_list);
+    ctx->kf_list = NULL;
+    ctx->kf_cnt = 0;
+    ctx->kf_cap = 0;
+}
+
+/*
+ * Find the closest keyframe of 'doc' at or before 'applied' revisions
+ * Returns the number of usable keyframes found for 'doc'
+ */
+int keyframe_find(c9_ctx_t *ctx, doc_t *doc, int applied, keyframe_t *best)
+{
+    // First frame of the document
+    int lo = 0;
+    int hi = ctx->kf_cnt;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (ctx->kf_list[mid].doc_id < doc->id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    int found = 0;
+    best->applied = -1;
+
+    for (keyframe_t *frame = ctx->kf_list + lo; frame < ctx->kf_list + ctx->kf_cnt && frame->doc_id == doc->id; frame++)
+    {
+        if (!frame_current(frame, doc))
+        {
+            continue;
+        }
+
+        found++;
+
+        if (frame->applied <= applied)
+        {
+            *best = *frame;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Append a keyframe of 'state' after 'applied' revisions of 'doc'
+ */
+int keyframe_write(c9_ctx_t *ctx, doc_t *doc, int applied, const c9_buf_t *state)
+{
+    keyframe_rec_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.doc_id = doc->id;
+    rec.doc_rev_num = doc->rev_num;
+    rec.doc_rev_cnt = doc->rev_cnt;
+    rec.applied = applied;
+    rec.rev_num = applied ? doc->revisions[applied - 1].num : 0;
+    rec.len = state->len;
+
+    // One write, so readers never see half a record - and under the lock,
+    // so 'end' is where it lands
+    struct iovec iov[2] = {{&rec, sizeof(rec)}, {state->data, state->len}};
+    ssize_t rec_len = sizeof(rec) + state->len;
+    struct stat fs;
+
+    if (lock_cache(ctx, LOCK_EX) < 0)
+    {
+        return -1;
+    }
+
+    off_t end = fstat(ctx->kf_fd, &fs) == 0 ? fs.st_size : -1;
+
+    if (end == -1 || writev(ctx->kf_fd, iov, 2) != rec_len)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to write keyframe for '%s'\n", errno, doc->save_path);
+        unlock_cache(ctx);
+        return -1;
+    }
+
+    unlock_cache(ctx);
+
+    if (push_frame(ctx, &rec, end + sizeof(rec)) < 0)
+    {
+        return -1;
+    }
+
+    // Frames are written in order, so this is usually already in place
+    keyframe_t frame = ctx->kf_list[ctx->kf_cnt - 1];
+    int i = ctx->kf_cnt - 1;
+
+    for (; i > 0 && cmp_frame(ctx->kf_list + i - 1, &frame) > 0; i--)
+    {
+        ctx->kf_list[i] = ctx->kf_list[i - 1];
+    }
+
+    ctx->kf_list[i] = frame;
+
+    return 0;
+}
+
+/*
+ * Replay the full history of 'doc', storing a keyframe every 'interval' revisions
+ */
+int keyframe_build(c9_ctx_t *ctx, doc_t *doc, const c9_buf_t *contents, int interval)
+{
+    c9_buf_t state = {0};
+    c9_buf_t spare = {0};
+    int ret = -1;
+
+    if (initial_state(ctx, &ctx->rev_cache, doc, &state, &spare, contents) < 0
+        || keyframe_write(ctx, doc, 0, &state) < 0)
+    {
+        goto DONE;
+    }
+
+    for (int i = 0; i < doc->rev_cnt; i++)
+    {
+        if (replay_doc(ctx, &ctx->rev_cache, doc, &state, &spare, i, i + 1) < 0)
+        {
+            goto DONE;
+        }
+
+        if ((i + 1) % interval == 0 && keyframe_write(ctx, doc, i + 1, &state) < 0)
+        {
+            goto DONE;
+        }
+    }
+
+    ret = 0;
+
+DONE:
+    c9_buf_free(&state);
+    c9_buf_free(&spare);
+
+    return ret;
+}
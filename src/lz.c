@@ -0,0 +1,207 @@
+#include <string.h>     // memcpy, memset
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Minimal LZ77 style codec for the compressed revision store.
+ *
+ * The packed stream is a run of groups, each made of:
+ *   [token] [literal len ext] [literals] [offset lo] [offset hi] [match len ext]
+ * The token holds the literal count in its high nibble and the match length
+ * (minus LZ_MIN_MATCH) in its low nibble. A nibble of 15 means extension
+ * bytes follow, each adding up to 255. The final group carries literals only.
+ */
+
+static unsigned int lz_hash(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char * lz_put_len(unsigned char *out, unsigned int len)
+{
+    while (len >= 255)
+    {
+        *out++ = 255;
+        len -= 255;
+    }
+    *out++ = (unsigned char)len;
+
+    return out;
+}
+
+/*
+ * Returns packed length, or -1 if 'cap' is too small
+ */
+int lz_compress(const BYTE *src, unsigned int len, BYTE *dst, unsigned int cap)
+{
+    unsigned int table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *end = base + len;
+
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *op_end = op + cap;
+
+    while (ip + LZ_MIN_MATCH <= end)
+    {
+        unsigned int h = lz_hash(ip);
+        const unsigned char *ref = base + table[h];
+        table[h] = ip - base;
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        unsigned int match = LZ_MIN_MATCH;
+        while (ip + match < end && ref[match] == ip[match])
+        {
+            match++;
+        }
+
+        unsigned int lit = ip - anchor;
+        unsigned int ext = match - LZ_MIN_MATCH;
+
+        // Worst case size of this group
+        if (op + 1 + lit + lit / 255 + 1 + 2 + ext / 255 + 1 > op_end)
+        {
+            return -1;
+        }
+
+        unsigned char *token = op++;
+        *token = (lit >= 15 ? 15 : lit) << 4;
+        if (lit >= 15)
+        {
+            op = lz_put_len(op, lit - 15);
+        }
+
+        memcpy(op, anchor, lit);
+        op += lit;
+
+        unsigned int offset = ip - ref;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+
+        *token |= (ext >= 15 ? 15 : ext);
+        if (ext >= 15)
+        {
+            op = lz_put_len(op, ext - 15);
+        }
+
+        ip += match;
+        anchor = ip;
+    }
+
+    // Trailing literals
+    unsigned int lit = end - anchor;
+    if (op + 1 + lit + lit / 255 + 1 > op_end)
+    {
+        return -1;
+    }
+
+    unsigned char *token = op++;
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15)
+    {
+        op = lz_put_len(op, lit - 15);
+    }
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - (unsigned char *)dst;
+}
+
+/*
+ * Returns unpacked length, or -1 on a corrupt stream or if 'cap' is too small
+ */
+int lz_decompress(const BYTE *src, unsigned int len, BYTE *dst, unsigned int cap)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *end = ip + len;
+
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *op_end = op + cap;
+
+    while (ip < end)
+    {
+        unsigned int token = *ip++;
+        unsigned int lit = token >> 4;
+        unsigned int b;
+
+        if (lit == 15)
+        {
+            do
+            {
+                if (ip >= end)
+                {
+                    return -1;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+
+        if (lit > (unsigned int)(end - ip) || lit > (unsigned int)(op_end - op))
+        {
+            return -1;
+        }
+
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        // Only the final group has no match
+        if (ip >= end)
+        {
+            break;
+        }
+
+        if (end - ip < 2)
+        {
+            return -1;
+        }
+
+        unsigned int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        unsigned int match = token & 15;
+        if (match == 15)
+        {
+            do
+            {
+                if (ip >= end)
+                {
+                    return -1;
+                }
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (unsigned int)(op - (unsigned char *)dst)
+            || match > (unsigned int)(op_end - op))
+        {
+            return -1;
+        }
+
+        // Byte-wise copy, as matches may overlap their own output
+        const unsigned char *ref = op - offset;
+        while (match--)
+        {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - (unsigned char *)dst;
+}
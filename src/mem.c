@@ -0,0 +1,54 @@
+#include "internal.h"
+
+/* ========================================================================== */
+
+BYTE * mem_push(mem_pool_t *pool, unsigned int sz)
+{
+    // Used during DEBUG. Can be used to tune total required memory
+    ASSERT(pool->base + sz <= pool->top);
+
+    BYTE *ret = pool->cur;
+
+    pool->cur += sz;
+
+    return ret;
+}
+
+void mem_pop(BYTE **mem, mem_pool_t *pool, unsigned int sz)
+{
+    ASSERT(pool->cur - sz >= pool->base);
+
+    pool->cur -= sz;
+    *mem = NULL;
+}
+
+int mem_alloc(mem_pool_t *pool, unsigned long capacity)
+{
+    pool->base = malloc(capacity);
+    if (!pool->base)
+    {
+        return 1;
+    }
+
+    pool->top = pool->base + capacity;
+    pool->cur = pool->base;
+
+    return 0;
+}
+
+int mem_sub_alloc(mem_pool_t *parent, mem_pool_t *child, unsigned long capacity)
+{
+    ASSERT(parent->base);
+    ASSERT(parent->cur + capacity <= parent->top);
+
+    child->base = mem_push(parent, capacity);
+    child->top = child->base + capacity;
+    child->cur = child->base;
+
+    return 0;
+}
+
+void mem_free(mem_pool_t *pool)
+{
+    free(pool->base);
+}
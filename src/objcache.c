@@ -0,0 +1,239 @@
+#include <string.h>     // memcpy, memcmp, memset, strcmp
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Object cache
+ *
+ * Documents often return to an earlier state (undo, revert to saved), and
+ * files are often duplicated across paths. Blobs already written during a
+ * run are remembered by a cheap content hash and length, and their contents
+ * compared on a hit, so a repeated state reuses the existing id without
+ * hashing, compressing or writing anything.
+ *
+ * Trees are remembered the same way, as the result of putting a given blob
+ * at a given path in a given tree.
+ *
+ * Both tables use open addressing, and are simply emptied once full (or once
+ * the cached blob contents outgrow their limit). Workers each keeping their
+ * own cache split OBJ_CACHE_BYTES between them, so a run never holds more.
+ */
+
+/*
+ * Hash 8 bytes at a time - well distributed, but far cheaper than SHA-1
+ */
+uint64_t content_hash(const BYTE *data, long len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+    const uint64_t mul = 0xff51afd7ed558ccdULL;
+
+    long i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+
+        h = (h ^ w) * mul;
+        h ^= h >> 32;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, len - i);
+
+    h = (h ^ tail) * mul;
+    h ^= h >> 29;
+
+    return h;
+}
+
+static uint64_t tree_key_hash(const git_oid *base, const char *path, const git_oid *blob)
+{
+    uint64_t a, b;
+    memcpy(&a, base->id, sizeof(a));
+    memcpy(&b, blob->id, sizeof(b));
+
+    return (a * 31) ^ b ^ content_hash(path, strlen(path));
+}
+
+static void clear_blobs(obj_cache_t *cache)
+{
+    for (unsigned int i = 0; i < OBJ_CACHE_SLOTS; i++)
+    {
+        free(cache->blobs[i].data);
+    }
+
+    memset(cache->blobs, 0, OBJ_CACHE_SLOTS * sizeof(blob_cache_entry_t));
+    cache->blob_cnt = 0;
+    cache->bytes = 0;
+}
+
+/*
+ * One of 'shares' caches in use at once, each holding an equal part of
+ * OBJ_CACHE_BYTES
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int obj_cache_init(obj_cache_t *cache, int shares)
+{
+    memset(cache, 0, sizeof(obj_cache_t));
+
+    cache->max_bytes = OBJ_CACHE_BYTES / (shares > 1 ? shares : 1);
+
+    cache->blobs = calloc(OBJ_CACHE_SLOTS, sizeof(blob_cache_entry_t));
+    cache->trees = calloc(OBJ_CACHE_SLOTS, sizeof(tree_cache_entry_t));
+
+    if (!cache->blobs || !cache->trees)
+    {
+        obj_cache_free(cache);
+        return -1;
+    }
+
+    return 0;
+}
+
+void obj_cache_free(obj_cache_t *cache)
+{
+    if (cache->blobs)
+    {
+        clear_blobs(cache);
+    }
+
+    free(cache->blobs);
+    free(cache->trees);
+
+    cache->blobs = NULL;
+    cache->trees = NULL;
+}
+
+/* ========================================================================== */
+
+/*
+ * Returns 1, with the blob's id in 'out', if these contents were written before
+ */
+int blob_cache_find(obj_cache_t *cache, uint64_t hash, const BYTE *data, long len, git_oid *out)
+{
+    if (!cache->blobs)
+    {
+        return 0;
+    }
+
+    for (unsigned int i = hash & (OBJ_CACHE_SLOTS - 1); cache->blobs[i].data; i = (i + 1) & (OBJ_CACHE_SLOTS - 1))
+    {
+        blob_cache_entry_t *entry = cache->blobs + i;
+
+        if (entry->hash == hash && entry->len == len && memcmp(entry->data, data, len) == 0)
+        {
+            git_oid_cpy(out, &entry->id);
+            cache->hits++;
+            return 1;
+        }
+    }
+
+    cache->misses++;
+
+    return 0;
+}
+
+/*
+ * Remember a written blob. The cache takes ownership of 'data', which must
+ * have been allocated with malloc.
+ */
+void blob_cache_add(obj_cache_t *cache, uint64_t hash, BYTE *data, long len, const git_oid *id)
+{
+    if (!cache->blobs)
+    {
+        free(data);
+        return;
+    }
+
+    if ((cache->blob_cnt + 1) * 4 > OBJ_CACHE_SLOTS * 3 || cache->bytes + len > cache->max_bytes)
+    {
+        clear_blobs(cache);
+    }
+
+    unsigned int i = hash & (OBJ_CACHE_SLOTS - 1);
+    while (cache->blobs[i].data)
+    {
+        i = (i + 1) & (OBJ_CACHE_SLOTS - 1);
+    }
+
+    blob_cache_entry_t *entry = cache->blobs + i;
+    entry->hash = hash;
+    entry->len = len;
+    entry->data = data;
+    git_oid_cpy(&entry->id, id);
+
+    cache->blob_cnt++;
+    cache->bytes += len;
+}
+
+/*
+ * Returns 1, with the tree's id in 'out', if 'blob' was put at 'path' in
+ * 'base' before
+ */
+int tree_cache_find(obj_cache_t *cache, const git_oid *base, const char *path,
+                    const git_oid *blob, git_oid *out)
+{
+    if (!cache->trees)
+    {
+        return 0;
+    }
+
+    uint64_t hash = tree_key_hash(base, path, blob);
+
+    for (unsigned int i = hash & (OBJ_CACHE_SLOTS - 1); cache->trees[i].path; i = (i + 1) & (OBJ_CACHE_SLOTS - 1))
+    {
+        tree_cache_entry_t *entry = cache->trees + i;
+
+        if (entry->hash == hash
+            && git_oid_equal(&entry->base, base)
+            && git_oid_equal(&entry->blob, blob)
+            && strcmp(entry->path, path) == 0)
+        {
+            git_oid_cpy(out, &entry->tree);
+            cache->tree_hits++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Remember the tree made by putting 'blob' at 'path' in 'base'
+ * 'path' must outlive the cache.
+ */
+void tree_cache_add(obj_cache_t *cache, const git_oid *base, const char *path,
+                    const git_oid *blob, const git_oid *tree)
+{
+    if (!cache->trees)
+    {
+        return;
+    }
+
+    if ((cache->tree_cnt + 1) * 4 > OBJ_CACHE_SLOTS * 3)
+    {
+        memset(cache->trees, 0, OBJ_CACHE_SLOTS * sizeof(tree_cache_entry_t));
+        cache->tree_cnt = 0;
+    }
+
+    uint64_t hash = tree_key_hash(base, path, blob);
+
+    unsigned int i = hash & (OBJ_CACHE_SLOTS - 1);
+    while (cache->trees[i].path)
+    {
+        i = (i + 1) & (OBJ_CACHE_SLOTS - 1);
+    }
+
+    tree_cache_entry_t *entry = cache->trees + i;
+    entry->hash = hash;
+    entry->path = path;
+    git_oid_cpy(&entry->base, base);
+    git_oid_cpy(&entry->blob, blob);
+    git_oid_cpy(&entry->tree, tree);
+
+    cache->tree_cnt++;
+}
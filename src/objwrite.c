@@ -0,0 +1,338 @@
+#include <pthread.h>
+#include <string.h>     // memcpy, strlen
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Object writer
+ *
+ * Blobs produced by in-memory replay are hashed and deflated on a pool of
+ * threads, while replay carries on. Jobs sit in a ring of 'slot_cnt' slots:
+ *
+ *   tail <= claimed <= head
+ *   [tail, claimed) : being encoded, or done and waiting to be committed
+ *   [claimed, head) : queued for a worker
+ *
+ * Only the submitting thread advances 'head' and 'tail', so results are
+ * always handed back in submission order. With no threads, jobs are encoded
+ * as they are submitted.
+ *
+ * Each worker writes through its own loose object backend, which is also
+ * where the configured zlib compression level is applied.
+ *
+ * Contents already written during the run are found in the object cache on
+ * submission, and never reach a worker.
+ */
+
+/*
+ * Open a loose object database of its own, writing at zlib 'level'
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int loose_odb_open(const char *objects_dir, int level, git_odb **out)
+{
+    git_odb_backend *loose;
+
+    // The loose backend skips deflate entirely at level 0, leaving objects
+    // git can't read
+    if (level == 0)
+    {
+        level = 1;
+    }
+
+    if (git_odb_new(out) < 0)
+    {
+        return -1;
+    }
+
+    if (git_odb_backend_loose(&loose, objects_dir, level, 0, 0, 0) < 0
+        || git_odb_add_backend(*out, loose, 1) < 0)
+    {
+        git_odb_free(*out);
+        *out = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_odb(obj_writer_t *w, git_odb **out)
+{
+    return loose_odb_open(w->objects_dir, w->level, out);
+}
+
+static int encode_job(git_odb *odb, obj_job_t *job)
+{
+    if (!odb || git_odb_write(&job->id, odb, job->data.data, job->data.len, GIT_OBJECT_BLOB) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to write blob for '%s' [rev: %d]\n", job->path, job->rev_num);
+        return JOB_FAILED;
+    }
+
+    return JOB_DONE;
+}
+
+static void * obj_worker(void *data)
+{
+    obj_writer_t *w = (obj_writer_t *)data;
+    git_odb *odb = NULL;
+
+    // Jobs still get claimed on failure, so the submitter never waits forever
+    open_odb(w, &odb);
+
+    pthread_mutex_lock(&w->lock);
+
+    for (;;)
+    {
+        while (!w->stop && w->claimed == w->head)
+        {
+            pthread_cond_wait(&w->queued, &w->lock);
+        }
+
+        if (w->claimed == w->head)
+        {
+            break;
+        }
+
+        obj_job_t *job = w->jobs + (w->claimed++ % w->slot_cnt);
+
+        if (job->cached)
+        {
+            continue;
+        }
+
+        pthread_mutex_unlock(&w->lock);
+
+        int state = encode_job(odb, job);
+
+        pthread_mutex_lock(&w->lock);
+        job->state = state;
+        pthread_cond_broadcast(&w->done);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    git_odb_free(odb);
+
+    return NULL;
+}
+
+/*
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int obj_writer_start(obj_writer_t *w, c9_ctx_t *ctx, git_repository *repo)
+{
+    memset(w, 0, sizeof(obj_writer_t));
+
+    w->cache = &ctx->obj_cache;
+    w->level = ctx->opts.compression_level;
+    w->thread_cnt = ctx->opts.encode_threads;
+
+    if (w->thread_cnt > OBJ_MAX_THREADS)
+    {
+        w->thread_cnt = OBJ_MAX_THREADS;
+    }
+
+    // Enough to keep every worker busy while the oldest result waits
+    w->slot_cnt = w->thread_cnt ? w->thread_cnt * OBJ_SLOTS_PER_THREAD : 1;
+    w->jobs = calloc(w->slot_cnt, sizeof(obj_job_t));
+
+    const char *git_dir = git_repository_path(repo);
+    w->objects_dir = malloc(strlen(git_dir) + sizeof("objects"));
+
+    if (!w->jobs || !w->objects_dir)
+    {
+        obj_writer_stop(w);
+        return -1;
+    }
+
+    // 'git_dir' always has a trailing slash
+    strcpy(w->objects_dir, git_dir);
+    strcat(w->objects_dir, "objects");
+
+    if (w->thread_cnt == 0)
+    {
+        if (open_odb(w, &w->odb) < 0)
+        {
+            fprintf(stderr, "[ERROR] Failed to open object database\n");
+            obj_writer_stop(w);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->queued, NULL);
+    pthread_cond_init(&w->done, NULL);
+
+    for (int i = 0; i < w->thread_cnt; i++)
+    {
+        if (pthread_create(w->threads + i, NULL, obj_worker, w) != 0)
+        {
+            w->thread_cnt = i;
+            break;
+        }
+    }
+
+    if (w->thread_cnt == 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to start object writer threads\n");
+        obj_writer_stop(w);
+        return -1;
+    }
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Encoding objects on %d threads...\n", w->thread_cnt);
+    }
+
+    return 0;
+}
+
+void obj_writer_stop(obj_writer_t *w)
+{
+    if (w->thread_cnt)
+    {
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_cond_broadcast(&w->queued);
+        pthread_mutex_unlock(&w->lock);
+
+        for (int i = 0; i < w->thread_cnt; i++)
+        {
+            pthread_join(w->threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->queued);
+        pthread_cond_destroy(&w->done);
+
+        w->thread_cnt = 0;
+    }
+
+    if (w->jobs)
+    {
+        for (int i = 0; i < w->slot_cnt; i++)
+        {
+            c9_buf_free(&w->jobs[i].data);
+        }
+    }
+
+    git_odb_free(w->odb);
+    free(w->jobs);
+    free(w->objects_dir);
+
+    w->odb = NULL;
+    w->jobs = NULL;
+    w->objects_dir = NULL;
+}
+
+int obj_writer_full(obj_writer_t *w)
+{
+    return w->head - w->tail == (unsigned long)w->slot_cnt;
+}
+
+/*
+ * Queue a copy of 'data' to be written as a blob
+ * The caller must make room first, if `obj_writer_full()`
+ */
+int obj_writer_submit(obj_writer_t *w, const c9_buf_t *data, int doc_id, const char *path, int rev_num)
+{
+    ASSERT(!obj_writer_full(w));
+
+    obj_job_t *job = w->jobs + (w->head % w->slot_cnt);
+
+    job->path = path;
+    job->doc_id = doc_id;
+    job->rev_num = rev_num;
+    job->hash = content_hash(data->data, data->len);
+    job->cached = blob_cache_find(w->cache, job->hash, data->data, data->len, &job->id);
+    job->state = job->cached ? JOB_DONE : JOB_QUEUED;
+
+    if (!job->cached)
+    {
+        if (doc_buf_reserve(&job->data, data->len + 1) < 0)
+        {
+            return -1;
+        }
+
+        memcpy(job->data.data, data->data, data->len);
+        job->data.len = data->len;
+    }
+
+    if (w->thread_cnt == 0)
+    {
+        if (!job->cached)
+        {
+            job->state = encode_job(w->odb, job);
+        }
+
+        w->head++;
+        return 0;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->head++;
+    pthread_cond_signal(&w->queued);
+    pthread_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+/*
+ * Returns the oldest job, once encoded - or NULL if there is none
+ * With 'wait' unset, also returns NULL if it is still being encoded
+ * Release it with `obj_writer_release()` when done
+ */
+obj_job_t * obj_writer_next(obj_writer_t *w, int wait)
+{
+    if (w->tail == w->head)
+    {
+        return NULL;
+    }
+
+    obj_job_t *job = w->jobs + (w->tail % w->slot_cnt);
+
+    if (w->thread_cnt == 0)
+    {
+        return job;
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    while (wait && job->state == JOB_QUEUED)
+    {
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+
+    int ready = job->state != JOB_QUEUED;
+
+    pthread_mutex_unlock(&w->lock);
+
+    return ready ? job : NULL;
+}
+
+void obj_writer_release(obj_writer_t *w)
+{
+    ASSERT(w->tail != w->head);
+
+    obj_job_t *job = w->jobs + (w->tail % w->slot_cnt);
+
+    // Hand the contents over to the cache, rather than copying them again
+    if (!job->cached && job->state == JOB_DONE)
+    {
+        blob_cache_add(w->cache, job->hash, job->data.data, job->data.len, &job->id);
+
+        job->data.data = NULL;
+        job->data.len = 0;
+        job->data.cap = 0;
+    }
+
+    w->tail++;
+}
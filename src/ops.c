@@ -0,0 +1,388 @@
+#include <string.h>     // memcpy, strlen
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+// Unit Separator
+const char US = 31;
+
+/* ========================================================================== */
+
+/*
+ * Replace quotes around instructions with a single Unit Separator char
+ * Replace escaped characters
+ *   TODO : anything other than '\n' and '\t' ?
+ * Return parsed op len, including null terminator
+ */
+int parse_op(const char *op, char *parsed)
+{
+    int len = 0;
+
+    // Can safely skip the first char - it is always '['
+    while (*++op)
+    {
+        if (*op == '"' && *(op - 1) != '\\')
+        {
+            if (*(op + 1) == ',' || *(op + 1) == ']')
+            {
+                op++;
+            }
+            else {
+                *parsed++ = US;
+                len++;
+            }
+        }
+        else if (*op == '\\')
+        {
+            switch (*(op + 1))
+            {
+                case '\\':
+                    // Preserve escaped escape sequences
+                    // TODO : Don't just allow for single-char escape sequences
+                    *parsed++ = *++op;
+                    *parsed++ = *++op;
+                    len += 2;
+                    break;
+                case 'n':
+                    *parsed++ = '\n';
+                    len++;
+                    op++;
+                    break;
+                case 't':
+                    *parsed++ = '\t';
+                    len++;
+                    op++;
+                    break;
+                case '"':
+                    *parsed++ = *++op;
+                    len++;
+                    break;
+            }
+        }
+        else
+        {
+            *parsed++ = *op;
+            len++;
+        }
+    }
+
+    // Nul terminate parsed op
+    *parsed = '\0';
+
+    return ++len;
+}
+
+/* ========================================================================== */
+
+/*
+ * Modify 'op' pointer to point at the next instruction char.
+ * Returns: 1 for success, 0 for failure
+ */
+int next_op_code(char **op)
+{
+    while (**op)
+    {
+        if (**op == US)
+        {
+            // The next char is an instruction
+            (*op)++;
+
+            return 1;
+        }
+        (*op)++;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns retain value
+ */
+int get_retain_val(const char *val)
+{
+    const char *cur = val;
+    int len = 0;
+
+    while (*cur)
+    {
+        if (*cur == US)
+        {
+            break;
+        }
+        cur++;
+        len++;
+    }
+
+    char val_dup[len + 1];
+    strncpy(val_dup, val, len);
+    val_dup[len] = '\0';
+
+    return atoi(val_dup);
+}
+
+/*
+ * Returns character count for instruction
+ */
+int get_instruction_len(const char *cur)
+{
+    int len = 0;
+
+    while (*cur)
+    {
+        if (*cur == US)
+        {
+            return len;
+        }
+        cur++;
+        len++;
+    }
+
+    return len;
+}
+
+int reset_check(char *op)
+{
+    // If instruction is an insertion ('i'), with no preceding or trailing retain ('r'),
+    // then we know the revision process began with an empty document
+    char *cur = op;
+    while(next_op_code(&cur))
+    {
+        if (*cur == 'r' || *cur == 'd')
+        {
+            // The revisions do not start from a "clean slate"
+            // and require full processing
+            return false;
+        }
+    }
+    return true;
+}
+
+/* ========================================================================== */
+
+/*
+ * In-memory replay
+ * Documents are rebuilt in a pair of buffers, swapped after each revision
+ */
+
+int doc_buf_reserve(c9_buf_t *buf, long cap)
+{
+    if (buf->cap >= cap)
+    {
+        return 0;
+    }
+
+    BYTE *data = realloc(buf->data, cap);
+    if (!data)
+    {
+        fprintf(stderr, "[ERROR] Failed to allocate %ld bytes for document\n", cap);
+        return -1;
+    }
+
+    buf->data = data;
+    buf->cap = cap;
+
+    return 0;
+}
+
+C9_API void c9_buf_free(c9_buf_t *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+    buf->doc_id = 0;
+    buf->applied = 0;
+}
+
+/*
+ * Apply one revision to 'src', writing the result to 'dst'
+ * With 'invert' set, 'i' and 'd' are swapped (see `revert_doc()`)
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int apply_rev(c9_ctx_t *ctx, rev_cache_t *cache, c9_buf_t *dst, const c9_buf_t *src, rev_t *rev, int invert)
+{
+    char *cur = rev_op(ctx, cache, rev);
+    if (!cur)
+    {
+        return -1;
+    }
+
+    // The result can grow by at most the length of the op itself
+    if (doc_buf_reserve(dst, src->len + strlen(cur) + 1) < 0)
+    {
+        return -1;
+    }
+
+    const BYTE *read_copy = src->data;
+    const BYTE *read_end = src->data + src->len;
+    BYTE *out = dst->data;
+
+    while (next_op_code(&cur))
+    {
+        char code = *cur;
+        int len;
+
+        if (invert && code != 'r')
+        {
+            code = (code == 'i') ? 'd' : 'i';
+        }
+
+        switch (code)
+        {
+            case 'i':
+                len = get_instruction_len(++cur);
+
+                // Write from op instruction
+                memcpy(out, cur, len);
+                out += len;
+                break;
+            case 'd':
+                len = get_instruction_len(++cur);
+
+                // Skip 'len' letters after read cursor
+                read_copy += len;
+                break;
+            case 'r':
+                len = get_retain_val(++cur);
+
+                if (read_copy + len > read_end)
+                {
+                    read_copy = read_end + 1;
+                    break;
+                }
+
+                // Write from original
+                memcpy(out, read_copy, len);
+                out += len;
+
+                // Move read cursor forward
+                read_copy += len;
+                break;
+        }
+
+        if (read_copy > read_end)
+        {
+            fprintf(stderr, "[ERROR] Revision %d runs past the end of the document\n", rev->num);
+            return -2;
+        }
+    }
+
+    dst->len = out - dst->data;
+
+    return 0;
+}
+
+/*
+ * Replay revisions [from, to) of 'doc' on top of 'state'
+ * 'spare' is used as the write buffer, and may be swapped with 'state'
+ */
+int replay_doc(c9_ctx_t *ctx, rev_cache_t *cache, doc_t *doc, c9_buf_t *state, c9_buf_t *spare, int from, int to)
+{
+    for (int i = from; i < to; i++)
+    {
+        if (apply_rev(ctx, cache, spare, state, doc->revisions + i, false) < 0)
+        {
+            return -1;
+        }
+
+        c9_buf_t tmp = *state;
+        *state = *spare;
+        *spare = tmp;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 1 if the history of 'doc' starts from an empty document, so its
+ * stored contents aren't needed to replay it
+ */
+int history_resets(c9_ctx_t *ctx, rev_cache_t *cache, doc_t *doc)
+{
+    if (doc->rev_cnt == 0)
+    {
+        return false;
+    }
+
+    char *first_op = rev_op(ctx, cache, doc->revisions);
+
+    return first_op && reset_check(first_op);
+}
+
+/*
+ * Bring 'contents' (the document in its final state) back to the state
+ * before any revisions were applied
+ * 'contents' may be 'state' itself, and is not read when `history_resets()`.
+ */
+int initial_state(c9_ctx_t *ctx, rev_cache_t *cache, doc_t *doc, c9_buf_t *state, c9_buf_t *spare, const c9_buf_t *contents)
+{
+    if (doc->rev_cnt)
+    {
+        char *first_op = rev_op(ctx, cache, doc->revisions);
+        if (!first_op)
+        {
+            return -1;
+        }
+
+        if (reset_check(first_op))
+        {
+            // History starts from an empty document
+            state->len = 0;
+            return 0;
+        }
+    }
+
+    if (contents != state)
+    {
+        if (doc_buf_reserve(state, contents->len + 1) < 0)
+        {
+            return -1;
+        }
+
+        memcpy(state->data, contents->data, contents->len);
+        state->len = contents->len;
+    }
+
+    for (int i = doc->rev_cnt - 1; i >= 0; i--)
+    {
+        if (apply_rev(ctx, cache, spare, state, doc->revisions + i, true) < 0)
+        {
+            return -1;
+        }
+
+        c9_buf_t tmp = *state;
+        *state = *spare;
+        *spare = tmp;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the number of revisions of 'doc' with a revNum up to 'rev_num'
+ */
+int revs_applied_at(doc_t *doc, int rev_num)
+{
+    int lo = 0;
+    int hi = doc->rev_cnt;
+
+    // Revisions are in ascending revNum order
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (doc->revisions[mid].num <= rev_num)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
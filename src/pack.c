@@ -0,0 +1,313 @@
+#include <dirent.h>     // opendir, readdir
+#include <string.h>     // strlen, strcmp
+#include <time.h>       // clock_gettime
+
+#include <unistd.h>     // unlink, rmdir
+
+#include <git2/sys/commit_graph.h>
+#include <git2/sys/midx.h>
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Repository optimisation
+ *
+ * A conversion leaves one loose object per blob, tree and commit, and every
+ * history walk has to inflate and parse each commit it passes. Once
+ * conversion is done, everything reachable from a ref is written to a single
+ * pack (deltified, on as many threads as libgit2 likes), the loose copies are
+ * removed, and a multi-pack-index and a commit-graph (parents, root trees and
+ * generation numbers for every commit) are written next to it.
+ *
+ * libgit2 can write neither changed-path Bloom filters nor reachability
+ * bitmaps, so those are left to `git commit-graph write --changed-paths` and
+ * `git repack -adb`, should they be wanted.
+ */
+
+static double elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+/*
+ * Start a walk from every ref - HEAD, and each document branch, if any
+ */
+static int walk_refs(git_repository *repo, git_revwalk **walk)
+{
+    git_reference_iterator *iter;
+    const char *name;
+    int error;
+
+    if (git_revwalk_new(walk, repo) < 0)
+    {
+        return -1;
+    }
+
+    if (git_reference_iterator_new(&iter, repo) < 0)
+    {
+        git_revwalk_free(*walk);
+        *walk = NULL;
+        return -1;
+    }
+
+    while ((error = git_reference_next_name(&name, iter)) == 0)
+    {
+        if ((error = git_revwalk_push_ref(*walk, name)) < 0)
+        {
+            break;
+        }
+    }
+
+    git_reference_iterator_free(iter);
+
+    if (error != GIT_ITEROVER)
+    {
+        git_revwalk_free(*walk);
+        *walk = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Remove every loose object that made it into pack 'idx_path'
+ * Returns the number removed
+ */
+static long prune_loose(const char *objects_dir, const char *idx_path)
+{
+    git_odb *pack_odb;
+    git_odb_backend *pack;
+
+    if (git_odb_new(&pack_odb) < 0)
+    {
+        return 0;
+    }
+
+    if (git_odb_backend_one_pack(&pack, idx_path) < 0
+        || git_odb_add_backend(pack_odb, pack, 1) < 0)
+    {
+        git_odb_free(pack_odb);
+        return 0;
+    }
+
+    long pruned = 0;
+    char path[512];
+
+    for (int i = 0; i < 256; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%02x", objects_dir, i);
+
+        DIR *dir = opendir(path);
+        if (!dir)
+        {
+            continue;
+        }
+
+        struct dirent *ent;
+
+        while ((ent = readdir(dir)) != NULL)
+        {
+            // Two hex digits from the directory, the rest from the file name
+            char hex[GIT_OID_HEXSZ + 1];
+            git_oid id;
+
+            if (strlen(ent->d_name) != GIT_OID_HEXSZ - 2)
+            {
+                continue;
+            }
+
+            snprintf(hex, sizeof(hex), "%02x%s", i, ent->d_name);
+
+            if (git_oid_fromstr(&id, hex) < 0 || !git_odb_exists(pack_odb, &id))
+            {
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "%s/%02x/%s", objects_dir, i, ent->d_name);
+
+            if (unlink(path) == 0)
+            {
+                pruned++;
+            }
+        }
+
+        closedir(dir);
+
+        // Only goes if nothing was left behind
+        snprintf(path, sizeof(path), "%s/%02x", objects_dir, i);
+        rmdir(path);
+    }
+
+    git_odb_free(pack_odb);
+
+    return pruned;
+}
+
+/*
+ * Index every pack in 'pack_dir' together
+ */
+static int write_midx(const char *pack_dir)
+{
+    git_midx_writer *w;
+
+    if (git_midx_writer_new(&w, pack_dir) < 0)
+    {
+        return -1;
+    }
+
+    DIR *dir = opendir(pack_dir);
+    int ret = dir ? 0 : -1;
+
+    struct dirent *ent;
+
+    while (dir && ret == 0 && (ent = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(ent->d_name);
+
+        if (len > 4 && strcmp(ent->d_name + len - 4, ".idx") == 0)
+        {
+            ret = git_midx_writer_add(w, ent->d_name);
+        }
+    }
+
+    if (dir)
+    {
+        closedir(dir);
+    }
+
+    if (ret == 0)
+    {
+        ret = git_midx_writer_commit(w);
+    }
+
+    git_midx_writer_free(w);
+
+    return ret;
+}
+
+/*
+ * Write the commit-graph for everything reachable from a ref
+ */
+static int write_commit_graph(git_repository *repo, const char *info_dir)
+{
+    git_commit_graph_writer *w;
+    git_commit_graph_writer_options opts;
+    git_revwalk *walk;
+
+    if (walk_refs(repo, &walk) < 0)
+    {
+        return -1;
+    }
+
+    if (git_commit_graph_writer_new(&w, info_dir) < 0)
+    {
+        git_revwalk_free(walk);
+        return -1;
+    }
+
+    int ret = git_commit_graph_writer_add_revwalk(w, walk);
+
+    if (ret == 0)
+    {
+        git_commit_graph_writer_options_init(&opts, GIT_COMMIT_GRAPH_WRITER_OPTIONS_VERSION);
+        ret = git_commit_graph_writer_commit(w, &opts);
+    }
+
+    git_commit_graph_writer_free(w);
+    git_revwalk_free(walk);
+
+    return ret;
+}
+
+/* ========================================================================== */
+
+/*
+ * Pack the repository, and write a multi-pack-index and commit-graph
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int optimize_repo(c9_ctx_t *ctx, git_repository *repo)
+{
+    git_packbuilder *pb;
+    git_revwalk *walk;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Pack repository...\n");
+    }
+
+    // 'git_dir' always has a trailing slash
+    const char *git_dir = git_repository_path(repo);
+    char objects_dir[512], pack_dir[512], info_dir[512], idx_path[512];
+
+    snprintf(objects_dir, sizeof(objects_dir), "%sobjects", git_dir);
+    snprintf(pack_dir, sizeof(pack_dir), "%sobjects/pack", git_dir);
+    snprintf(info_dir, sizeof(info_dir), "%sobjects/info", git_dir);
+
+    if (walk_refs(repo, &walk) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not walk repository refs\n");
+        return -1;
+    }
+
+    if (git_packbuilder_new(&pb, repo) < 0)
+    {
+        git_revwalk_free(walk);
+        return -1;
+    }
+
+    // 0 lets libgit2 use every core
+    git_packbuilder_set_threads(pb, ctx->opts.encode_threads);
+
+    int res = git_packbuilder_insert_walk(pb, walk);
+    if (res == 0)
+    {
+        res = git_packbuilder_write(pb, pack_dir, 0, NULL, NULL);
+    }
+
+    git_revwalk_free(walk);
+
+    if (res < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to write pack\n");
+        git_packbuilder_free(pb);
+        return -1;
+    }
+
+    size_t obj_cnt = git_packbuilder_object_count(pb);
+    snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", pack_dir, git_packbuilder_name(pb));
+
+    git_packbuilder_free(pb);
+
+    long pruned = prune_loose(objects_dir, idx_path);
+
+    if (write_midx(pack_dir) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to write multi-pack-index\n");
+        return -1;
+    }
+
+    if (write_commit_graph(repo, info_dir) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to write commit-graph\n");
+        return -1;
+    }
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Packed %zu objects, removed %ld loose, wrote multi-pack-index and commit-graph in %.0f ms\n",
+                obj_cnt, pruned, elapsed_ms(&start));
+    }
+
+    return 0;
+}
@@ -0,0 +1,963 @@
+#include <pthread.h>
+#include <sched.h>      // sched_yield
+#include <string.h>     // memcpy, strcmp
+#include <time.h>       // clock_gettime, nanosleep
+
+#include <unistd.h>     // sysconf
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Pipeline
+ *
+ * Conversion in three stages, all running at once:
+ *
+ *   ingest : one thread, streaming revisions out of the database a document
+ *            at a time, and parsing their ops
+ *   replay : a pool of threads, each replaying whole documents and writing
+ *            their blobs
+ *   commit : the calling thread, committing each document's blobs in turn
+ *
+ * Documents are handed between stages through bounded lock-free queues. No
+ * more than PIPE_WINDOW documents are ever in flight, so a stage that gets
+ * ahead waits for the one behind it, rather than filling memory. Replay can
+ * finish documents out of order - the committer puts them back in
+ * 'doc_list' order, so history comes out as from `process_revisions_bare()`.
+ *
+ * Each stage keeps track of how long it spent waiting on its neighbours,
+ * which is reported at the end as per-stage utilization.
+ */
+
+typedef struct pipe_blob {
+    int rev_num;
+    git_oid id;
+} pipe_blob_t;
+
+typedef struct pipe_item {
+    unsigned int seq;       // Index into 'doc_list'
+    doc_t doc;              // Copy, with 'revisions' pointing into 'revs'
+    c9_buf_t contents;
+    rev_t *revs;
+    int rev_cap;
+    c9_buf_t ops;           // Parsed ops, back to back
+    pipe_blob_t *blobs;
+    int blob_cnt;
+    int failed;
+} pipe_item_t;
+
+/*
+ * Bounded MPMC queue, after Dmitry Vyukov's
+ * Each cell's 'seq' says whose turn it is: a producer's while it equals the
+ * position being pushed, a consumer's once it is one past it.
+ */
+typedef struct pipe_cell {
+    unsigned long seq;
+    pipe_item_t *item;
+} pipe_cell_t;
+
+typedef struct pipe_queue {
+    pipe_cell_t *cells;
+    unsigned long mask;
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+} pipe_queue_t;
+
+typedef struct pipe_stats {
+    double run;             // ms from start to finish
+    double wait_in;         // ms with nothing to work on
+    double wait_out;        // ms held up by the next stage
+} pipe_stats_t;
+
+typedef struct pipeline {
+    c9_ctx_t *ctx;
+    char *objects_dir;
+    int level;
+
+    pipe_queue_t ingested;  // ingest -> replay
+    pipe_queue_t replayed;  // replay -> commit
+
+    unsigned long committed;
+    int ingest_done;
+    int abort;
+
+    // Ingest state
+    pipe_item_t *current;
+    unsigned int next_doc;
+    unsigned long rev_cnt;
+
+    int thread_cnt;
+    pipe_stats_t ingest;
+    double ingest_window;   // ms ingest waited for the committer to catch up
+    pipe_stats_t replay[PIPE_MAX_THREADS];
+    pipe_stats_t commit;
+} pipeline_t;
+
+typedef struct pipe_worker {
+    pipeline_t *p;
+    pipe_stats_t *stats;
+    git_odb *odb;
+    obj_cache_t cache;      // A share of OBJ_CACHE_BYTES, one per worker
+    rev_cache_t rev_cache;
+    c9_buf_t state;
+    c9_buf_t spare;
+    attrib_t attrib;
+} pipe_worker_t;
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Spin briefly, then yield, then sleep - so a waiting stage doesn't take
+ * CPU from the one it is waiting on
+ */
+static void backoff(int *spins)
+{
+    if (++*spins < PIPE_SPINS)
+    {
+        return;
+    }
+
+    if (*spins < PIPE_SPINS * 2)
+    {
+        sched_yield();
+        return;
+    }
+
+    struct timespec ts = {0, 50000};
+    nanosleep(&ts, NULL);
+}
+
+static int aborted(pipeline_t *p)
+{
+    return __atomic_load_n(&p->abort, __ATOMIC_RELAXED);
+}
+
+/* ========================================================================== */
+
+static int queue_init(pipe_queue_t *q, unsigned long cap)
+{
+    q->cells = calloc(cap, sizeof(pipe_cell_t));
+    if (!q->cells)
+    {
+        return -1;
+    }
+
+    for (unsigned long i = 0; i < cap; i++)
+    {
+        q->cells[i].seq = i;
+    }
+
+    q->mask = cap - 1;
+    q->head = 0;
+    q->tail = 0;
+
+    return 0;
+}
+
+/*
+ * Returns 0 if the queue is full
+ */
+static int queue_push(pipe_queue_t *q, pipe_item_t *item)
+{
+    unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        pipe_cell_t *cell = q->cells + (pos & q->mask);
+        long dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (dif == 0)
+        {
+            // On failure, 'pos' is reloaded
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                cell->item = item;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (dif < 0)
+        {
+            return 0;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Returns NULL if the queue is empty
+ */
+static pipe_item_t * queue_pop(pipe_queue_t *q)
+{
+    unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        pipe_cell_t *cell = q->cells + (pos & q->mask);
+        long dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                pipe_item_t *item = cell->item;
+                __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return item;
+            }
+        }
+        else if (dif < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Push, waiting for room if need be
+ * Returns:
+ *  0 : Success
+ * <0 : The pipeline was aborted
+ */
+static int push_wait(pipeline_t *p, pipe_queue_t *q, pipe_item_t *item, double *waited)
+{
+    if (queue_push(q, item))
+    {
+        return 0;
+    }
+
+    double start = now_ms();
+    int spins = 0;
+    int ret = 0;
+
+    while (!queue_push(q, item))
+    {
+        if (aborted(p))
+        {
+            ret = -1;
+            break;
+        }
+
+        backoff(&spins);
+    }
+
+    *waited += now_ms() - start;
+
+    return ret;
+}
+
+/*
+ * Pop, waiting for an item if need be
+ * Returns NULL once 'done' is set and the queue is empty, or on abort
+ */
+static pipe_item_t * pop_wait(pipeline_t *p, pipe_queue_t *q, const int *done, double *waited)
+{
+    pipe_item_t *item = queue_pop(q);
+    if (item)
+    {
+        return item;
+    }
+
+    double start = now_ms();
+    int spins = 0;
+
+    while ((item = queue_pop(q)) == NULL && !aborted(p))
+    {
+        // Anything pushed before 'done' was set is seen by this last pop
+        if (done && __atomic_load_n(done, __ATOMIC_ACQUIRE))
+        {
+            item = queue_pop(q);
+            break;
+        }
+
+        backoff(&spins);
+    }
+
+    *waited += now_ms() - start;
+
+    return item;
+}
+
+static void free_item(pipe_item_t *item)
+{
+    if (!item)
+    {
+        return;
+    }
+
+    c9_buf_free(&item->contents);
+    c9_buf_free(&item->ops);
+    free(item->revs);
+    free(item->blobs);
+    free(item);
+}
+
+/* ========================================================================== */
+
+/*
+ * Begin ingesting the next document, once the window has room for it
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+static int start_item(pipeline_t *p)
+{
+    c9_ctx_t *ctx = p->ctx;
+    unsigned int seq = p->next_doc++;
+
+    // Backpressure - don't get more than a window ahead of the committer
+    if (seq - __atomic_load_n(&p->committed, __ATOMIC_ACQUIRE) >= PIPE_WINDOW)
+    {
+        double start = now_ms();
+        int spins = 0;
+
+        while (seq - __atomic_load_n(&p->committed, __ATOMIC_ACQUIRE) >= PIPE_WINDOW)
+        {
+            if (aborted(p))
+            {
+                return -1;
+            }
+
+            backoff(&spins);
+        }
+
+        p->ingest_window += now_ms() - start;
+    }
+
+    pipe_item_t *item = calloc(1, sizeof(pipe_item_t));
+    if (!item)
+    {
+        return -1;
+    }
+
+    item->seq = seq;
+    item->doc = ctx->doc_list[seq];
+    item->doc.revisions = NULL;
+    item->doc.rev_cnt = 0;
+
+    p->current = item;
+
+    return 0;
+}
+
+/*
+ * Append a revision to the document being ingested, with room for 'op_len'
+ * bytes of parsed op
+ * Returns where the op goes - the caller then adds its length to 'ops' - or
+ * NULL on failure
+ */
+static char * add_rev(pipeline_t *p, int rev_num, int op_len)
+{
+    pipe_item_t *item = p->current;
+
+    if (item->doc.rev_cnt == item->rev_cap)
+    {
+        int cap = item->rev_cap ? item->rev_cap * 2 : 64;
+        rev_t *revs = realloc(item->revs, cap * sizeof(rev_t));
+
+        if (!revs)
+        {
+            return NULL;
+        }
+
+        item->revs = revs;
+        item->rev_cap = cap;
+    }
+
+    if (doc_buf_reserve(&item->ops, item->ops.len + op_len) < 0)
+    {
+        return NULL;
+    }
+
+    rev_t *rev = item->revs + item->doc.rev_cnt++;
+
+    // 'ops' may still move, so only the offset is kept for now
+    rev->num = rev_num;
+    rev->block = -1;
+    rev->offset = item->ops.len;
+    rev->op = NULL;
+
+    p->rev_cnt++;
+
+    return item->ops.data + item->ops.len;
+}
+
+/*
+ * Hand the document being ingested on to replay
+ */
+static int finish_item(pipeline_t *p)
+{
+    c9_ctx_t *ctx = p->ctx;
+    pipe_item_t *item = p->current;
+    p->current = NULL;
+
+    for (int i = 0; i < item->doc.rev_cnt; i++)
+    {
+        item->revs[i].op = item->ops.data + item->revs[i].offset;
+        item->revs[i].offset = 0;
+    }
+
+    item->doc.revisions = item->doc.rev_cnt ? item->revs : NULL;
+
+    // Only now is it known whether replay needs the contents at all
+    if (!history_resets(ctx, &ctx->rev_cache, &item->doc)
+        && load_contents(ctx, ctx->doc_list + item->seq, &item->contents) != C9_OK)
+    {
+        free_item(item);
+        return -1;
+    }
+
+    if (push_wait(p, &p->ingested, item, &p->ingest.wait_out) < 0)
+    {
+        free_item(item);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Ingest every document before 'doc_id' - none have revisions left to come
+ */
+static int flush_before(pipeline_t *p, long doc_id)
+{
+    c9_ctx_t *ctx = p->ctx;
+
+    if (p->current && p->current->doc.id < doc_id && finish_item(p) < 0)
+    {
+        return -1;
+    }
+
+    while (!p->current && p->next_doc < ctx->doc_cnt && ctx->doc_list[p->next_doc].id < doc_id)
+    {
+        if (start_item(p) < 0 || finish_item(p) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Stream each revision into the document it belongs to
+ *
+ * Expects:
+ *   data to be a pipeline_t
+ *   col_data[0] to be 'doc_id'
+ *   col_data[1] to be 'rev_num'
+ *   col_data[2] to be 'op'
+ */
+static int ingest_rev_cb(void *data, int col_cnt, char **col_data, char **col_names)
+{
+    pipeline_t *p = (pipeline_t *)data;
+    c9_ctx_t *ctx = p->ctx;
+
+    int doc_id  = atoi(col_data[0]);
+    int rev_num = atoi(col_data[1]);
+    char *op    = col_data[2];
+
+    // Skip "empty" revisions
+    if (strcmp(op, "[]") == 0)
+    {
+        return 0;
+    }
+
+    if (!p->current || p->current->doc.id != doc_id)
+    {
+        if (flush_before(p, doc_id) < 0)
+        {
+            return 1;
+        }
+
+        if (p->next_doc == ctx->doc_cnt || ctx->doc_list[p->next_doc].id != doc_id)
+        {
+            // Created since the document list was loaded - picked up once followed
+            if (ctx->opts.follow)
+            {
+                return 0;
+            }
+
+            fprintf(stderr, "[ERROR] Revision %d refers to unknown document %d\n", rev_num, doc_id);
+            return 1;
+        }
+
+        if (start_item(p) < 0)
+        {
+            return 1;
+        }
+    }
+
+    // Sized in bytes - `length()` counts characters of text
+    char *parsed = add_rev(p, rev_num, strlen(op) + 1);
+    if (!parsed)
+    {
+        return 1;
+    }
+
+    p->current->ops.len += parse_op(op, parsed);
+
+    return 0;
+}
+
+/*
+ * Revisions already in memory (from a journal) are copied, rather than read
+ * again - so replay never goes through `rev_op()`
+ */
+static int ingest_loaded(pipeline_t *p)
+{
+    c9_ctx_t *ctx = p->ctx;
+
+    while (p->next_doc < ctx->doc_cnt)
+    {
+        doc_t *doc = ctx->doc_list + p->next_doc;
+
+        if (start_item(p) < 0)
+        {
+            return -1;
+        }
+
+        for (int i = 0; i < doc->rev_cnt; i++)
+        {
+            // Already parsed - copied as they are
+            char *op = rev_op(ctx, &ctx->rev_cache, doc->revisions + i);
+            if (!op)
+            {
+                return -1;
+            }
+
+            int op_len = strlen(op) + 1;
+            char *copy = add_rev(p, doc->revisions[i].num, op_len);
+
+            if (!copy)
+            {
+                return -1;
+            }
+
+            memcpy(copy, op, op_len);
+            p->current->ops.len += op_len;
+        }
+
+        if (finish_item(p) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void * ingest_thread(void *data)
+{
+    pipeline_t *p = (pipeline_t *)data;
+    c9_ctx_t *ctx = p->ctx;
+    double start = now_ms();
+    int ret = 0;
+
+    if (ctx->revs_loaded)
+    {
+        ret = ingest_loaded(p);
+    }
+    else
+    {
+        char *sql_err = NULL;
+        char *rev_query = sqlite3_mprintf("SELECT document_id AS doc_id, revNum AS rev_num, operation AS op FROM Revisions WHERE %s ORDER BY document_id ASC, revNum ASC", ctx->rev_where);
+
+        if (sqlite3_exec(ctx->db, rev_query, ingest_rev_cb, p, &sql_err) != SQLITE_OK)
+        {
+            if (!aborted(p))
+            {
+                fprintf(stderr, "[ERROR] Failed to stream revisions from database\n");
+                fprintf(stderr, "[SQLERR] %s\n", sql_err);
+            }
+
+            ret = -1;
+        }
+
+        sqlite3_free(rev_query);
+        sqlite3_free(sql_err);
+
+        // Then any documents after the last with revisions - ids are 32 bit
+        if (ret == 0 && flush_before(p, (long)INT32_MAX + 1) < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret < 0)
+    {
+        free_item(p->current);
+        p->current = NULL;
+        __atomic_store_n(&p->abort, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&p->ingest_done, 1, __ATOMIC_RELEASE);
+
+    p->ingest.run = now_ms() - start;
+
+    return NULL;
+}
+
+/* ========================================================================== */
+
+static int write_blob(pipe_worker_t *w, const c9_buf_t *data, const char *path, int rev_num, pipe_blob_t *blob)
+{
+    uint64_t hash = content_hash(data->data, data->len);
+
+    blob->rev_num = rev_num;
+
+    if (blob_cache_find(&w->cache, hash, data->data, data->len, &blob->id))
+    {
+        return 0;
+    }
+
+    if (git_odb_write(&blob->id, w->odb, data->data, data->len, GIT_OBJECT_BLOB) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to write blob for '%s' [rev: %d]\n", path, rev_num);
+        return -1;
+    }
+
+    BYTE *copy = malloc(data->len + 1);
+    if (copy)
+    {
+        memcpy(copy, data->data, data->len);
+        blob_cache_add(&w->cache, hash, copy, data->len, &blob->id);
+    }
+
+    return 0;
+}
+
+/*
+ * Replay a whole document, writing a blob for every revision
+ */
+static int replay_item(pipe_worker_t *w, pipe_item_t *item)
+{
+    c9_ctx_t *ctx = w->p->ctx;
+    doc_t *doc = &item->doc;
+
+    item->blobs = malloc((doc->rev_cnt ? doc->rev_cnt : 1) * sizeof(pipe_blob_t));
+    if (!item->blobs)
+    {
+        return -1;
+    }
+
+    // Also docs whose revisions were all empty, or filtered out
+    if (doc->rev_cnt == 0)
+    {
+        item->blob_cnt = 1;
+
+        if (ctx->attrib
+            && (attrib_begin(&w->attrib, item->contents.len, doc->rev_num) < 0
+                || attrib_finish(ctx, &w->attrib, item->seq, &item->contents) < 0))
+        {
+            return -1;
+        }
+
+        return write_blob(w, &item->contents, doc->save_path, doc->rev_num, item->blobs);
+    }
+
+    if (initial_state(ctx, &w->rev_cache, doc, &w->state, &w->spare, &item->contents) < 0
+        || (ctx->attrib && attrib_begin(&w->attrib, w->state.len, 0) < 0))
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < doc->rev_cnt; i++)
+    {
+        // 'spare' is left holding the state before the revision
+        if (replay_doc(ctx, &w->rev_cache, doc, &w->state, &w->spare, i, i + 1) < 0
+            || (ctx->attrib && attrib_apply(ctx, &w->rev_cache, &w->attrib, doc->revisions + i, &w->spare) < 0)
+            || write_blob(w, &w->state, doc->save_path, doc->revisions[i].num, item->blobs + i) < 0)
+        {
+            return -1;
+        }
+
+        item->blob_cnt++;
+    }
+
+    return ctx->attrib ? attrib_finish(ctx, &w->attrib, item->seq, &w->state) : 0;
+}
+
+static void * replay_thread(void *data)
+{
+    pipe_worker_t *w = (pipe_worker_t *)data;
+    pipeline_t *p = w->p;
+    double start = now_ms();
+
+    pipe_item_t *item;
+
+    while ((item = pop_wait(p, &p->ingested, &p->ingest_done, &w->stats->wait_in)) != NULL)
+    {
+        item->failed = replay_item(w, item) < 0;
+
+        // Only the blobs are needed from here on
+        c9_buf_free(&item->contents);
+        c9_buf_free(&item->ops);
+        free(item->revs);
+        item->revs = NULL;
+        item->doc.revisions = NULL;
+
+        if (push_wait(p, &p->replayed, item, &w->stats->wait_out) < 0)
+        {
+            free_item(item);
+            break;
+        }
+    }
+
+    w->stats->run = now_ms() - start;
+
+    return NULL;
+}
+
+/* ========================================================================== */
+
+static double percent(double part, double whole)
+{
+    return whole > 0 ? 100.0 * part / whole : 0.0;
+}
+
+static void print_utilization(pipeline_t *p, double wall)
+{
+    c9_ctx_t *ctx = p->ctx;
+    pipe_stats_t replay = {0};
+
+    for (int i = 0; i < p->thread_cnt; i++)
+    {
+        replay.run += p->replay[i].run;
+        replay.wait_in += p->replay[i].wait_in;
+        replay.wait_out += p->replay[i].wait_out;
+    }
+
+    double replay_wall = wall * p->thread_cnt;
+
+    fprintf(stdout, "[INFO] Pipeline: %u documents, %lu revisions in %.0f ms\n", ctx->doc_cnt, p->rev_cnt, wall);
+    fprintf(stdout, "[INFO]   ingest : %5.1f%% busy, %5.1f%% waiting on replay, %5.1f%% on commit\n",
+            percent(p->ingest.run - p->ingest.wait_out - p->ingest_window, wall),
+            percent(p->ingest.wait_out, wall), percent(p->ingest_window, wall));
+    fprintf(stdout, "[INFO]   replay : %5.1f%% busy, %5.1f%% waiting on ingest, %5.1f%% on commit (%d threads)\n",
+            percent(replay.run - replay.wait_in - replay.wait_out, replay_wall),
+            percent(replay.wait_in, replay_wall), percent(replay.wait_out, replay_wall), p->thread_cnt);
+    fprintf(stdout, "[INFO]   commit : %5.1f%% busy, %5.1f%% waiting on replay\n",
+            percent(p->commit.run - p->commit.wait_in, wall), percent(p->commit.wait_in, wall));
+}
+
+/*
+ * Commit every document, in 'doc_list' order, as replay finishes them
+ */
+static int commit_items(pipeline_t *p, git_repository *repo)
+{
+    c9_ctx_t *ctx = p->ctx;
+    pipe_item_t *pending[PIPE_WINDOW] = {0};
+    int ret = 0;
+
+    for (unsigned int seq = 0; seq < ctx->doc_cnt && ret == 0; seq++)
+    {
+        pipe_item_t *item;
+
+        while (!pending[seq % PIPE_WINDOW])
+        {
+            if ((item = pop_wait(p, &p->replayed, NULL, &p->commit.wait_in)) == NULL)
+            {
+                ret = -1;
+                goto DONE;
+            }
+
+            pending[item->seq % PIPE_WINDOW] = item;
+        }
+
+        item = pending[seq % PIPE_WINDOW];
+        pending[seq % PIPE_WINDOW] = NULL;
+
+        char *doc_path = ctx->doc_list[seq].save_path;
+        int doc_id = ctx->doc_list[seq].id;
+
+        if (ctx->opts.quiet == 0)
+        {
+            fprintf(stdout, "[INFO] Process Revisions for '%s'...\n", doc_path);
+        }
+
+        if (item->failed)
+        {
+            ret = -1;
+        }
+
+        for (int i = 0; i < item->blob_cnt && ret == 0; i++)
+        {
+            ret = add_oid_and_commit(ctx, repo, doc_id, doc_path, &item->blobs[i].id, item->blobs[i].rev_num);
+        }
+
+        free_item(item);
+
+        __atomic_store_n(&p->committed, seq + 1, __ATOMIC_RELEASE);
+    }
+
+DONE:
+    for (int i = 0; i < PIPE_WINDOW; i++)
+    {
+        free_item(pending[i]);
+    }
+
+    return ret;
+}
+
+/*
+ * As `process_revisions_bare()`, but reading revisions, replaying them and
+ * committing them all at once
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int process_revisions_pipeline(c9_ctx_t *ctx, git_repository *repo)
+{
+    if (ctx->doc_cnt == 0)
+    {
+        return 0;
+    }
+
+    pipeline_t p = {0};
+    p.ctx = ctx;
+    p.level = ctx->opts.compression_level;
+    p.thread_cnt = ctx->opts.encode_threads;
+
+    if (p.thread_cnt == 0)
+    {
+        p.thread_cnt = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (p.thread_cnt > PIPE_MAX_THREADS)
+    {
+        p.thread_cnt = PIPE_MAX_THREADS;
+    }
+    if (p.thread_cnt < 1)
+    {
+        p.thread_cnt = 1;
+    }
+
+    // 'git_dir' always has a trailing slash
+    const char *git_dir = git_repository_path(repo);
+    p.objects_dir = malloc(strlen(git_dir) + sizeof("objects"));
+
+    pipe_worker_t workers[PIPE_MAX_THREADS] = {{0}};
+    pthread_t threads[PIPE_MAX_THREADS];
+    pthread_t ingest;
+    int started = 0;
+    int ingesting = 0;
+    int ret = -1;
+
+    if (!p.objects_dir
+        || queue_init(&p.ingested, PIPE_WINDOW) < 0
+        || queue_init(&p.replayed, PIPE_WINDOW) < 0)
+    {
+        goto DONE;
+    }
+
+    strcpy(p.objects_dir, git_dir);
+    strcat(p.objects_dir, "objects");
+
+    for (int i = 0; i < p.thread_cnt; i++)
+    {
+        workers[i].p = &p;
+        workers[i].stats = p.replay + i;
+
+        if (loose_odb_open(p.objects_dir, p.level, &workers[i].odb) < 0
+            || obj_cache_init(&workers[i].cache, p.thread_cnt) < 0)
+        {
+            fprintf(stderr, "[ERROR] Failed to open object database\n");
+            goto DONE;
+        }
+    }
+
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Pipeline %u documents, replaying on %d threads...\n", ctx->doc_cnt, p.thread_cnt);
+    }
+
+    double start = now_ms();
+
+    for (; started < p.thread_cnt; started++)
+    {
+        if (pthread_create(threads + started, NULL, replay_thread, workers + started) != 0)
+        {
+            break;
+        }
+    }
+
+    ingesting = started > 0 && pthread_create(&ingest, NULL, ingest_thread, &p) == 0;
+
+    if (!ingesting)
+    {
+        fprintf(stderr, "[ERROR] Failed to start pipeline threads\n");
+        __atomic_store_n(&p.abort, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        ret = commit_items(&p, repo);
+        p.commit.run = now_ms() - start;
+    }
+
+    if (ret < 0)
+    {
+        __atomic_store_n(&p.abort, 1, __ATOMIC_RELAXED);
+    }
+
+    if (ingesting)
+    {
+        pthread_join(ingest, NULL);
+    }
+
+    // Workers see 'ingest_done' or 'abort' either way
+    __atomic_store_n(&p.ingest_done, 1, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (ret == 0 && ctx->opts.quiet == 0)
+    {
+        print_utilization(&p, now_ms() - start);
+    }
+
+DONE:
+    // Whatever an abort left behind
+    if (p.ingested.cells && p.replayed.cells)
+    {
+        pipe_item_t *item;
+
+        while ((item = queue_pop(&p.ingested)) != NULL || (item = queue_pop(&p.replayed)) != NULL)
+        {
+            free_item(item);
+        }
+    }
+
+    for (int i = 0; i < p.thread_cnt; i++)
+    {
+        ctx->obj_cache.hits += workers[i].cache.hits;
+        ctx->obj_cache.misses += workers[i].cache.misses;
+
+        obj_cache_free(&workers[i].cache);
+        rev_cache_free(&workers[i].rev_cache);
+        c9_buf_free(&workers[i].state);
+        c9_buf_free(&workers[i].spare);
+        attrib_free(&workers[i].attrib);
+        git_odb_free(workers[i].odb);
+    }
+
+    free(p.ingested.cells);
+    free(p.replayed.cells);
+    free(p.objects_dir);
+
+    return ret;
+}
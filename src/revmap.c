@@ -0,0 +1,456 @@
+#include <errno.h>
+#include <string.h>     // memcmp, memcpy
+
+#include <unistd.h>     // close, unlink
+#include <sys/mman.h>   // mmap, munmap
+#include <sys/stat.h>   // fstat
+#include <fcntl.h>      // open
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Revision map
+ *
+ * Every commit made for a revision is noted as it is made, and the lot is
+ * written next to the repository's objects, as REVMAP_NAME in the git
+ * directory. Tooling can then go from a revision to its commit, or back,
+ * with a binary search over the mapped file - rather than a `git log` scan
+ * for "./path [rev: N]".
+ *
+ * Layout:
+ *   header    : revmap_hdr_t
+ *   entries   : revmap_entry_t[cnt], in (doc_id, rev_num) order
+ *   by_commit : uint32_t[cnt], indices into 'entries', in commit id order
+ *
+ * Follow mode writes it again every FOLLOW_REVMAP_INTERVAL while it commits,
+ * and once more when it stops. Only what was added since the previous write
+ * is sorted, then merged into the arrays kept from it.
+ */
+
+typedef struct revmap_hdr {
+    char magic[4];
+    int32_t version;
+    int64_t cnt;
+} revmap_hdr_t;
+
+typedef struct revmap_sort {
+    git_oid commit;
+    uint32_t idx;
+} revmap_sort_t;
+
+static int cmp_entry(const void *a, const void *b)
+{
+    const revmap_entry_t *x = (const revmap_entry_t *)a;
+    const revmap_entry_t *y = (const revmap_entry_t *)b;
+
+    if (x->doc_id != y->doc_id)
+    {
+        return x->doc_id < y->doc_id ? -1 : 1;
+    }
+
+    return x->rev_num < y->rev_num ? -1 : x->rev_num > y->rev_num;
+}
+
+static int cmp_commit(const void *a, const void *b)
+{
+    return git_oid_cmp(&((const revmap_sort_t *)a)->commit, &((const revmap_sort_t *)b)->commit);
+}
+
+/* ========================================================================== */
+
+void revmap_init(revmap_t *map)
+{
+    memset(map, 0, sizeof(revmap_t));
+    pthread_mutex_init(&map->lock, NULL);
+}
+
+void revmap_free(revmap_t *map)
+{
+    free(map->entries);
+    free(map->by_commit);
+    pthread_mutex_destroy(&map->lock);
+
+    map->entries = NULL;
+    map->by_commit = NULL;
+    map->cnt = 0;
+    map->cap = 0;
+    map->sorted = 0;
+}
+
+/*
+ * Note 'commit' as made for revision 'rev_num' of document 'doc_id'
+ * Safe to call from several threads at once.
+ */
+int revmap_add(c9_ctx_t *ctx, int doc_id, int rev_num, const git_oid *commit)
+{
+    revmap_t *map = &ctx->revmap;
+    int ret = 0;
+
+    pthread_mutex_lock(&map->lock);
+
+    if (map->cnt == map->cap)
+    {
+        size_t cap = map->cap ? map->cap * 2 : 1024;
+        revmap_entry_t *entries = realloc(map->entries, cap * sizeof(revmap_entry_t));
+
+        if (entries)
+        {
+            map->entries = entries;
+            map->cap = cap;
+        }
+    }
+
+    if (map->cnt < map->cap)
+    {
+        revmap_entry_t *entry = map->entries + map->cnt++;
+        entry->doc_id = doc_id;
+        entry->rev_num = rev_num;
+        git_oid_cpy(&entry->commit, commit);
+    }
+    else
+    {
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&map->lock);
+
+    return ret;
+}
+
+/*
+ * Merge the entries added since the last write into 'entries' and 'by_commit'
+ * Both are kept in order between writes, so only the new entries are sorted.
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+static int revmap_merge(revmap_t *map)
+{
+    size_t old_cnt = map->sorted;
+    size_t new_cnt = map->cnt - old_cnt;
+
+    if (new_cnt == 0)
+    {
+        return 0;
+    }
+
+    uint32_t *by_commit = realloc(map->by_commit, map->cnt * sizeof(uint32_t));
+    if (!by_commit)
+    {
+        return -1;
+    }
+    map->by_commit = by_commit;
+
+    revmap_entry_t *added = malloc(new_cnt * sizeof(revmap_entry_t));
+    revmap_sort_t *sorted = malloc(new_cnt * sizeof(revmap_sort_t));
+    uint32_t *moved = malloc((old_cnt + 1) * sizeof(uint32_t));   // Where each old entry ends up
+
+    if (!added || !sorted || !moved)
+    {
+        free(added);
+        free(sorted);
+        free(moved);
+        return -1;
+    }
+
+    memcpy(added, map->entries + old_cnt, new_cnt * sizeof(revmap_entry_t));
+    qsort(added, new_cnt, sizeof(revmap_entry_t), cmp_entry);
+
+    // From the back, so no old entry is overwritten before it has moved
+    size_t i = old_cnt;
+    size_t j = new_cnt;
+    size_t k = map->cnt;
+
+    while (j > 0)
+    {
+        k--;
+
+        if (i > 0 && cmp_entry(map->entries + i - 1, added + j - 1) > 0)
+        {
+            map->entries[k] = map->entries[--i];
+            moved[i] = k;
+        }
+        else
+        {
+            map->entries[k] = added[--j];
+            git_oid_cpy(&sorted[j].commit, &map->entries[k].commit);
+            sorted[j].idx = k;
+        }
+    }
+
+    for (size_t n = 0; n < i; n++)
+    {
+        moved[n] = n;
+    }
+
+    // Then the same for the commit order, pointing old indices at where they moved
+    qsort(sorted, new_cnt, sizeof(revmap_sort_t), cmp_commit);
+
+    i = old_cnt;
+    j = new_cnt;
+    k = map->cnt;
+
+    while (j > 0)
+    {
+        k--;
+
+        if (i > 0 && git_oid_cmp(&map->entries[moved[by_commit[i - 1]]].commit, &sorted[j - 1].commit) > 0)
+        {
+            by_commit[k] = moved[by_commit[--i]];
+        }
+        else
+        {
+            by_commit[k] = sorted[--j].idx;
+        }
+    }
+
+    while (i > 0)
+    {
+        i--;
+        by_commit[i] = moved[by_commit[i]];
+    }
+
+    map->sorted = map->cnt;
+
+    free(added);
+    free(sorted);
+    free(moved);
+
+    return 0;
+}
+
+/*
+ * Write every noted commit out as REVMAP_NAME in the git directory
+ * Written to a temporary file first, so a reader never sees half a map.
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int revmap_write(c9_ctx_t *ctx, git_repository *repo)
+{
+    revmap_t *map = &ctx->revmap;
+
+    char path[512], tmp_path[512];
+    snprintf(path, sizeof(path), "%s" REVMAP_NAME, git_repository_path(repo));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    if (revmap_merge(map) < 0)
+    {
+        fprintf(stderr, "[ERROR] Failed to allocate revision map\n");
+        return -1;
+    }
+
+    revmap_hdr_t hdr = {0};
+    memcpy(hdr.magic, REVMAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = REVMAP_VERSION;
+    hdr.cnt = map->cnt;
+
+    int ret = 0;
+    FILE *fp = fopen(tmp_path, "wb");
+
+    if (!fp
+        || fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+        || fwrite(map->entries, sizeof(revmap_entry_t), map->cnt, fp) != map->cnt
+        || fwrite(map->by_commit, sizeof(uint32_t), map->cnt, fp) != map->cnt)
+    {
+        ret = -1;
+    }
+
+    if (fp && fclose(fp) != 0)
+    {
+        ret = -1;
+    }
+
+    if (ret == 0 && rename(tmp_path, path) == -1)
+    {
+        ret = -1;
+    }
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "[ERROR %d] Failed to write revision map '%s'\n", errno, path);
+        unlink(tmp_path);
+    }
+
+    return ret;
+}
+
+/* ========================================================================== */
+
+typedef struct revmap_file {
+    BYTE *map;
+    size_t size;
+    revmap_hdr_t *hdr;
+    revmap_entry_t *entries;
+    uint32_t *by_commit;
+} revmap_file_t;
+
+/*
+ * Map the revision map of the repository at 'repo_dir' - bare or not
+ */
+static int revmap_open(const char *repo_dir, revmap_file_t *rf)
+{
+    char path[512];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/.git/" REVMAP_NAME, repo_dir);
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        snprintf(path, sizeof(path), "%s/" REVMAP_NAME, repo_dir);
+        fd = open(path, O_RDONLY);
+    }
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "[ERROR %d] No revision map in '%s'\n", errno, repo_dir);
+        return -1;
+    }
+
+    struct stat fs;
+    rf->map = MAP_FAILED;
+
+    if (fstat(fd, &fs) == 0 && fs.st_size >= (off_t)sizeof(revmap_hdr_t))
+    {
+        rf->map = mmap(NULL, fs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+
+    if (rf->map == MAP_FAILED)
+    {
+        fprintf(stderr, "[ERROR] Could not map revision map '%s'\n", path);
+        return -1;
+    }
+
+    rf->size = fs.st_size;
+    rf->hdr = (revmap_hdr_t *)rf->map;
+    rf->entries = (revmap_entry_t *)(rf->map + sizeof(revmap_hdr_t));
+    rf->by_commit = (uint32_t *)(rf->entries + rf->hdr->cnt);
+
+    if (memcmp(rf->hdr->magic, REVMAP_MAGIC, sizeof(rf->hdr->magic)) != 0
+        || rf->hdr->version != REVMAP_VERSION
+        || rf->hdr->cnt < 0
+        || (size_t)rf->hdr->cnt * (sizeof(revmap_entry_t) + sizeof(uint32_t)) + sizeof(revmap_hdr_t) != rf->size)
+    {
+        fprintf(stderr, "[ERROR] Invalid revision map '%s'\n", path);
+        munmap(rf->map, rf->size);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns:
+ *  C9_OK     : 'hex' holds the commit made for 'rev_num' of 'doc_id', or for
+ *              the latest revision before it that made one
+ *  C9_EUSAGE : No such commit
+ *  C9_EIO    : No usable revision map
+ */
+C9_API int c9_revmap_commit(const char *repo_dir, int doc_id, int rev_num, char *hex)
+{
+    revmap_file_t rf;
+
+    if (revmap_open(repo_dir, &rf) < 0)
+    {
+        return C9_EIO;
+    }
+
+    // Last entry at or before (doc_id, rev_num)
+    revmap_entry_t key = {0};
+    key.doc_id = doc_id;
+    key.rev_num = rev_num;
+
+    long lo = 0;
+    long hi = rf.hdr->cnt - 1;
+    long found = -1;
+
+    while (lo <= hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+
+        if (cmp_entry(rf.entries + mid, &key) <= 0)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    int ret = C9_EUSAGE;
+
+    if (found >= 0 && rf.entries[found].doc_id == doc_id)
+    {
+        git_oid_tostr(hex, GIT_OID_HEXSZ + 1, &rf.entries[found].commit);
+        ret = C9_OK;
+    }
+
+    munmap(rf.map, rf.size);
+
+    return ret;
+}
+
+/*
+ * 'hex' may be abbreviated, as long as it is unambiguous
+ * Returns:
+ *  C9_OK     : 'doc_id' and 'rev_num' hold the revision 'hex' was made for
+ *  C9_EUSAGE : No such commit, or more than one
+ *  C9_EIO    : No usable revision map
+ */
+C9_API int c9_revmap_rev(const char *repo_dir, const char *hex, int *doc_id, int *rev_num)
+{
+    size_t len = strlen(hex);
+    git_oid prefix;
+
+    if (len < 4 || len > GIT_OID_HEXSZ || git_oid_fromstrn(&prefix, hex, len) < 0)
+    {
+        return C9_EUSAGE;
+    }
+
+    revmap_file_t rf;
+
+    if (revmap_open(repo_dir, &rf) < 0)
+    {
+        return C9_EIO;
+    }
+
+    // First commit at or after 'prefix', padded with zeros
+    long lo = 0;
+    long hi = rf.hdr->cnt;
+
+    while (lo < hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+
+        if (git_oid_cmp(&rf.entries[rf.by_commit[mid]].commit, &prefix) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    int ret = C9_EUSAGE;
+
+    if (lo < rf.hdr->cnt && git_oid_ncmp(&rf.entries[rf.by_commit[lo]].commit, &prefix, len) == 0
+        && (lo + 1 == rf.hdr->cnt || git_oid_ncmp(&rf.entries[rf.by_commit[lo + 1]].commit, &prefix, len) != 0))
+    {
+        revmap_entry_t *entry = rf.entries + rf.by_commit[lo];
+
+        *doc_id = entry->doc_id;
+        *rev_num = entry->rev_num;
+        ret = C9_OK;
+    }
+
+    munmap(rf.map, rf.size);
+
+    return ret;
+}
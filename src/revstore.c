@@ -0,0 +1,163 @@
+#include <string.h>     // memcpy
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Compressed revision store
+ *
+ * With 'compress' set, parsed ops are not kept raw in 'string_pool'. Instead
+ * consecutive ops of a document are staged, then packed together as a block.
+ * Ops are fetched with `rev_op()`, which decodes blocks just in time into a
+ * small cache of recently used blocks. Each thread that replays passes its
+ * own 'rev_cache_t', as the blocks themselves are read-only.
+ */
+
+/*
+ * Compress 'raw' into a new block in 'string_pool'
+ * Returns the block index
+ */
+int rev_block_pack(c9_ctx_t *ctx, const BYTE *raw, unsigned int raw_len)
+{
+    rev_block_t *block = (rev_block_t *)mem_push(&ctx->block_pool, sizeof(rev_block_t));
+
+    // Reserve the worst case, then hand back whatever the codec didn't need
+    unsigned int bound = LZ_BOUND(raw_len);
+    block->packed = mem_push(&ctx->string_pool, bound);
+
+    int packed_len = lz_compress(raw, raw_len, block->packed, bound);
+    ASSERT(packed_len >= 0);
+
+    BYTE *spare = block->packed + packed_len;
+    mem_pop(&spare, &ctx->string_pool, bound - packed_len);
+
+    block->raw_len = raw_len;
+    block->packed_len = packed_len;
+
+    return ctx->block_cnt++;
+}
+
+/*
+ * Compress any ops waiting in 'rev_stage'
+ */
+void rev_store_flush(c9_ctx_t *ctx)
+{
+    rev_stage_t *stage = &ctx->rev_stage;
+
+    if (stage->len == 0)
+    {
+        return;
+    }
+
+    rev_block_pack(ctx, stage->buf, stage->len);
+
+    stage->op_cnt = 0;
+    stage->len = 0;
+}
+
+/*
+ * Stage a parsed op for compression, recording where to find it again
+ * Blocks never span documents, so a document decodes independently
+ */
+void rev_store_append(c9_ctx_t *ctx, int doc_id, rev_t *rev, const char *op, int len)
+{
+    rev_stage_t *stage = &ctx->rev_stage;
+
+    if (stage->doc_id != doc_id
+        || stage->op_cnt == REV_BLOCK_OPS
+        || stage->len + len > REV_BLOCK_SIZE)
+    {
+        rev_store_flush(ctx);
+    }
+
+    ctx->rev_raw_bytes += len;
+
+    // Oversized ops get a block to themselves
+    if (len > REV_BLOCK_SIZE)
+    {
+        rev->block = rev_block_pack(ctx, op, len);
+        rev->offset = 0;
+        return;
+    }
+
+    // Index of the block this op will land in once flushed
+    rev->block = ctx->block_cnt;
+    rev->offset = stage->len;
+
+    memcpy(stage->buf + stage->len, op, len);
+
+    stage->doc_id = doc_id;
+    stage->len += len;
+    stage->op_cnt++;
+}
+
+/*
+ * Returns a pointer to the parsed op, decoding its block just in time into
+ * 'cache', which is only ever touched by the calling thread
+ * The pointer is valid until REV_CACHE_SLOTS other blocks have been decoded
+ * Returns NULL on failure
+ */
+char * rev_op(c9_ctx_t *ctx, rev_cache_t *cache, rev_t *rev)
+{
+    if (rev->block < 0)
+    {
+        return rev->op;
+    }
+
+    rev_cache_slot_t *slots = cache->slots;
+    rev_cache_slot_t *victim = slots;
+
+    for (rev_cache_slot_t *slot = slots; slot < slots + REV_CACHE_SLOTS; slot++)
+    {
+        if (slot->data && slot->block == rev->block)
+        {
+            slot->last_use = ++cache->tick;
+            return slot->data + rev->offset;
+        }
+
+        if (slot->last_use < victim->last_use)
+        {
+            victim = slot;
+        }
+    }
+
+    // Evict the least recently used slot
+    rev_block_t *block = ctx->block_list + rev->block;
+
+    if (victim->cap < block->raw_len)
+    {
+        BYTE *data = realloc(victim->data, block->raw_len);
+        if (!data)
+        {
+            fprintf(stderr, "[ERROR] Failed to allocate revision cache\n");
+            return NULL;
+        }
+        victim->data = data;
+        victim->cap = block->raw_len;
+    }
+
+    if (lz_decompress(block->packed, block->packed_len, victim->data, victim->cap) != (int)block->raw_len)
+    {
+        fprintf(stderr, "[ERROR] Revision block %d is corrupt\n", rev->block);
+        victim->block = -1;
+        return NULL;
+    }
+
+    victim->block = rev->block;
+    victim->last_use = ++cache->tick;
+
+    return victim->data + rev->offset;
+}
+
+void rev_cache_free(rev_cache_t *cache)
+{
+    rev_cache_slot_t *slots = cache->slots;
+
+    for (rev_cache_slot_t *slot = slots; slot < slots + REV_CACHE_SLOTS; slot++)
+    {
+        free(slot->data);
+        slot->data = NULL;
+        slot->cap = 0;
+    }
+}
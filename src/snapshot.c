@@ -0,0 +1,228 @@
+#include <string.h>     // memset, strdup
+
+#include "internal.h"
+
+/* ========================================================================== */
+
+/*
+ * Two-phase conversion
+ *
+ * Every document's final contents are committed to HEAD first, in a single
+ * commit, straight from Documents.contents - no revisions are read, so the
+ * repository is usable after one pass over the table. The history is then
+ * built on SNAPSHOT_HISTORY_REF, from the same root commit, and HEAD put
+ * back on the snapshot once it is done.
+ *
+ * With 'graft' set, the snapshot is then replaced (as `git replace` does)
+ * by a copy whose parent is the end of the history, so `git log` carries on
+ * through it. The snapshot commit itself is left untouched.
+ */
+
+/*
+ * Stage each encoded blob, oldest first
+ * As `commit_encoded()`, but nothing is committed
+ */
+static int stage_encoded(git_index *idx, obj_writer_t *w, int wait)
+{
+    obj_job_t *job;
+
+    while ((job = obj_writer_next(w, wait || obj_writer_full(w))) != NULL)
+    {
+        git_index_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.mode = GIT_FILEMODE_BLOB;
+        entry.path = job->path;
+        git_oid_cpy(&entry.id, &job->id);
+
+        if (job->state == JOB_FAILED || git_index_add(idx, &entry) < 0)
+        {
+            fprintf(stderr, "[ERROR] Failed to add %s to the snapshot\n", job->path);
+            return -1;
+        }
+
+        obj_writer_release(w);
+    }
+
+    return 0;
+}
+
+/*
+ * Commit the final contents of every document to HEAD, then ready the
+ * repository for the history to be built on SNAPSHOT_HISTORY_REF
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int snapshot_commit(c9_ctx_t *ctx, git_repository *repo)
+{
+    if (ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Commit a snapshot of %u documents...\n", ctx->doc_cnt);
+    }
+
+    git_index *idx;
+
+    if (git_repository_index(&idx, repo) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not open repository index. Exiting...\n");
+        return -1;
+    }
+
+    c9_buf_t contents = {0};
+    obj_writer_t writer;
+    int ret = 0;
+
+    if (obj_writer_start(&writer, ctx, repo) < 0)
+    {
+        git_index_free(idx);
+        return -1;
+    }
+
+    for (doc_t *doc = ctx->doc_list; doc < ctx->doc_list + ctx->doc_cnt && ret == 0; doc++)
+    {
+        if (load_contents(ctx, doc, &contents) != C9_OK
+            || obj_writer_submit(&writer, &contents, doc->id, doc->save_path, doc->rev_num) < 0
+            || stage_encoded(idx, &writer, false) < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        ret = stage_encoded(idx, &writer, true);
+    }
+
+    obj_writer_stop(&writer);
+    c9_buf_free(&contents);
+
+    char commit_msg[255] = {0};
+    snprintf(commit_msg, sizeof(commit_msg), "Snapshot of %u documents", ctx->doc_cnt);
+
+    // On top of the initial commit, which the history then also starts from
+    git_commit *root = ctx->head;
+    ctx->head = NULL;
+
+    if (ret == 0)
+    {
+        ret = commit_index_onto(ctx, repo, idx, commit_msg, (const git_commit **)&root, 1, NULL);
+    }
+
+    git_reference *head_ref = NULL;
+
+    if (ret == 0
+        && (git_repository_head(&head_ref, repo) < 0
+            || !(ctx->snapshot.branch = strdup(git_reference_name(head_ref)))))
+    {
+        fprintf(stderr, "[ERROR] Could not read the snapshot's branch\n");
+        ret = -1;
+    }
+
+    git_reference_free(head_ref);
+
+    // The history starts over from an empty tree, on its own ref
+    if (ret == 0)
+    {
+        git_index_clear(idx);
+
+        if (git_repository_set_head(repo, SNAPSHOT_HISTORY_REF) < 0)
+        {
+            fprintf(stderr, "[ERROR] Could not point HEAD at '%s'\n", SNAPSHOT_HISTORY_REF);
+            ret = -1;
+        }
+    }
+
+    // Whatever happened, 'ctx->head' is left owning exactly one commit
+    ctx->snapshot.commit = ctx->head;
+    ctx->head = root;
+
+    git_index_free(idx);
+
+    if (ret == 0 && ctx->opts.quiet == 0)
+    {
+        fprintf(stdout, "[INFO] Snapshot committed to '%s'. Build history on '%s'...\n",
+                ctx->snapshot.branch, SNAPSHOT_HISTORY_REF);
+    }
+
+    return ret;
+}
+
+/*
+ * Once the history is built, put HEAD (and the index) back on the snapshot,
+ * and graft the history under it if asked to
+ * Returns:
+ *  0 : Success
+ * <0 : Failure
+ */
+int snapshot_link(c9_ctx_t *ctx, git_repository *repo)
+{
+    git_commit *tip = ctx->head;
+    git_commit *snap = ctx->snapshot.commit;
+
+    git_index *idx = NULL;
+    git_tree *tree = NULL;
+    int ret = 0;
+
+    if (git_repository_set_head(repo, ctx->snapshot.branch) < 0
+        || git_repository_index(&idx, repo) < 0
+        || git_commit_tree(&tree, snap) < 0
+        || git_index_read_tree(idx, tree) < 0)
+    {
+        fprintf(stderr, "[ERROR] Could not put HEAD back on '%s'\n", ctx->snapshot.branch);
+        ret = -1;
+        goto DONE;
+    }
+
+    // Contents the revisions don't account for
+    if (!git_oid_equal(git_commit_tree_id(tip), git_commit_tree_id(snap)))
+    {
+        fprintf(stderr, "[WARNING] The history on '%s' does not end with the snapshot's contents\n",
+                SNAPSHOT_HISTORY_REF);
+    }
+
+    if (ctx->opts.graft)
+    {
+        char hex[GIT_OID_HEXSZ + 1];
+        char ref_name[64];
+        git_reference *ref;
+        git_oid graft_id;
+
+        git_oid_tostr(hex, sizeof(hex), git_commit_id(snap));
+        snprintf(ref_name, sizeof(ref_name), "refs/replace/%s", hex);
+
+        if (git_commit_create(&graft_id, repo, NULL, git_commit_author(snap), git_commit_committer(snap),
+                              git_commit_message_encoding(snap), git_commit_message(snap), tree,
+                              1, (const git_commit **)&tip) < 0
+            || git_reference_create(&ref, repo, ref_name, &graft_id, 1, NULL) < 0)
+        {
+            fprintf(stderr, "[ERROR] Failed to graft the history under the snapshot\n");
+            ret = -1;
+            goto DONE;
+        }
+
+        git_reference_free(ref);
+
+        if (ctx->opts.quiet == 0)
+        {
+            fprintf(stdout, "[INFO] History grafted under the snapshot as '%s'\n", ref_name);
+        }
+    }
+
+    // The snapshot is HEAD again
+    ctx->head = snap;
+    ctx->snapshot.commit = tip;
+
+DONE:
+    git_tree_free(tree);
+    git_index_free(idx);
+
+    return ret;
+}
+
+void snapshot_free(c9_ctx_t *ctx)
+{
+    git_commit_free(ctx->snapshot.commit);
+    free(ctx->snapshot.branch);
+
+    memset(&ctx->snapshot, 0, sizeof(snapshot_t));
+}